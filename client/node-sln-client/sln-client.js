@@ -16,6 +16,10 @@ function has(obj, prop) {
 }
 
 sln.metatype = "application/vnd.stronglink.meta";
+sln.recordstype = "application/vnd.stronglink.uri-records";
+
+// Algorithm IDs used by URI records (see StrongLink.h).
+var RECORD_ALGOS = ["sha256", "sha1", "blake2b"];
 
 // returns: { algo: string, hash: string, query: string, fragment: string }
 sln.parseURI = function(uri) {
@@ -124,8 +128,11 @@ Repo.prototype.query = function(query, opts, cb) {
 		cb(err, null);
 	});
 };
-// opts: { lang: string, start: string, count: number, wait: bool, dir: string, agent: http.Agent }
+// opts: { lang: string, start: string, count: number, wait: bool, dir: string, records: bool, agent: http.Agent }
 // returns: stream.Readable (object mode, emits uri: string)
+// With `records`, the list is requested in the compact binary format and
+// the stream emits { uri: string, start: string } instead. Pass `start`
+// back to resume after that URI.
 Repo.prototype.createQueryStream = function(query, opts) {
 	var repo = this;
 	// TODO: Use POST, accept non-string queries.
@@ -142,12 +149,35 @@ Repo.prototype.createQueryStream = function(query, opts) {
 		}),
 		headers: {
 			"Cookie": "s="+repo.session,
+			"Accept": opts && opts.records ? sln.recordstype : "text/uri-list",
 		},
 		// TODO: If opts.wait is false, allow the default agent?
 		agent: opts && has(opts, "agent") ? opts.agent : false,
 		keepAlive: false,
 	});
-	return new URIListStream({ meta: false, req: req });
+	return new URIListStream({ meta: false, records: opts && opts.records, req: req });
+};
+// opts: { start: string, count: number, wait: bool, dir: string, records: bool, agent: http.Agent }
+// returns: stream.Readable (object mode, same as createQueryStream)
+Repo.prototype.createAllStream = function(opts) {
+	var repo = this;
+	var req = repo.client.get({
+		hostname: repo.hostname,
+		port: repo.port,
+		path: repo.path+"/sln/all?"+qs.stringify({
+			"start": opts ? opts.start : "",
+			"count": opts ? opts.count : "",
+			"wait": !opts || false !== opts.wait ? "1" : "0",
+			"dir": opts ? opts.dir : "",
+		}),
+		headers: {
+			"Cookie": "s="+repo.session,
+			"Accept": opts && opts.records ? sln.recordstype : "text/uri-list",
+		},
+		agent: opts && has(opts, "agent") ? opts.agent : false,
+		keepAlive: false,
+	});
+	return new URIListStream({ meta: false, records: opts && opts.records, req: req });
 };
 // opts: { start: string, count: number, wait: bool, dir: string, agent: http.Agent }
 // returns: stream.Readable (object mode, emits { uri: string, target: string })
@@ -387,16 +417,24 @@ sln.parseURIList = function(str, opts) {
 	return result;
 };
 
-// opts: { meta: bool, req: http.ClientRequest }
+// opts: { meta: bool, records: bool, req: http.ClientRequest }
+// If records were asked for but the server sends text, each URI is also
+// used as its own start position.
 function URIListStream(opts) {
 	var stream = this;
 	TransformStream.call(stream, { readableObjectMode: true });
 	stream._buffer = "";
 	stream._decoder = new StringDecoder("utf8");
 	stream._meta = opts ? !!opts.meta : false;
+	stream._records = opts ? !!opts.records : false;
+	stream._binary = null;
 
 	if(opts && opts.req) {
 		opts.req.on("response", function(res) {
+			var type = res.headers["content-type"] || "";
+			if(stream._records && 0 === type.indexOf(sln.recordstype)) {
+				stream._binary = new Buffer(0);
+			}
 			if(200 == res.statusCode) {
 				res.pipe(stream);
 				res.on("error", function(err) {
@@ -416,6 +454,7 @@ function URIListStream(opts) {
 util.inherits(URIListStream, TransformStream);
 
 URIListStream.prototype._transform = function(chunk, encoding, cb) {
+	if(this._binary) return this._transformRecords(chunk, cb);
 	// TODO: What to do with `encoding`?
 	this._buffer += this._decoder.write(chunk);
 	var x;
@@ -425,7 +464,9 @@ URIListStream.prototype._transform = function(chunk, encoding, cb) {
 		this._buffer = this._buffer.slice(x[0].length);
 		if(!x[1].length) continue;
 		if('#' === x[1][0]) continue; // Comment line.
-		if(!this._meta) {
+		if(this._records) {
+			this.push({ uri: x[1], start: x[1] });
+		} else if(!this._meta) {
 			this.push(x[1]);
 		} else {
 			x = /^(.*)\s*->\s*(.*)$/.exec(x[1]);
@@ -435,6 +476,35 @@ URIListStream.prototype._transform = function(chunk, encoding, cb) {
 	}
 	cb(null);
 };
+// <length> <algo> <digest> <sortID> <fileID> (see StrongLink.h)
+URIListStream.prototype._transformRecords = function(chunk, cb) {
+	var buf = Buffer.concat([this._binary, chunk]);
+	var pos = 0;
+	for(;;) {
+		if(pos+1 > buf.length) break;
+		var len = buf[pos];
+		if(pos+1+len > buf.length) break;
+		if(0 === len) { // Keep-alive
+			pos += 1;
+			continue;
+		}
+		if(len < 1+1+8+8) return cb(new Error("Parse error"));
+		var algo = RECORD_ALGOS[buf[pos+1]];
+		if(!algo) return cb(new Error("Unknown algorithm "+buf[pos+1]));
+		var end = pos+1+len;
+		var hash = buf.slice(pos+2, end-16).toString("hex");
+		// IDs are counters, so they fit in a double.
+		var sortID = buf.readUInt32BE(end-16) * 0x100000000 + buf.readUInt32BE(end-12);
+		var fileID = buf.readUInt32BE(end-8) * 0x100000000 + buf.readUInt32BE(end-4);
+		this.push({
+			uri: sln.formatURI({ algo: algo, hash: hash }),
+			start: sortID+"."+fileID,
+		});
+		pos = end;
+	}
+	this._binary = buf.slice(pos);
+	cb(null);
+};
 URIListStream.prototype._flush = function(cb) {
 	// We ignore incomplete trailing data.
 	cb(null);
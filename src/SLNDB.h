@@ -13,6 +13,7 @@ enum {
 	SLNUserIDByName = 21,
 	SLNSessionByID = 22,
 	SLNPullByID = 23, // Also by user ID?
+	SLNConfigByName = 24,
 
 	SLNFileByID = 40,
 	SLNFileIDByInfo = 41,
@@ -24,14 +25,24 @@ enum {
 //	SLNFileIDAndMetaFileID = 61, // Redundant, they're equivalent.
 	SLNTargetURIAndMetaFileID = 62,
 	SLNMetaFileIDFieldAndValue = 63,
-	SLNFieldValueAndMetaFileID = 64,
-	SLNTermMetaFileIDAndPosition = 65,
+	SLNFieldValueAndMetaFileID = 64, // Obsolete, see SLNFieldValuePostings
+	SLNTermMetaFileIDAndPosition = 65, // Obsolete, see SLNTermPostings
 	SLNFirstUniqueMetaFileID = 66,
+	SLNTermPostings = 67,
+	SLNFieldValuePostings = 68,
 
 	// It's expected that values less than ~240 should fit in one byte
 	// Depending on the varint format, of course
 };
 
+// Cached next IDs for SLNFileByID and SLNMetaFileByID, seeded when the
+// repo opens its database. Only used by the submission writer.
+DB_ids *SLNRepoGetIDs(SLNRepoRef const repo, dbid_t const table);
+
+// Writes the parsed meta-file's index entries. Sets out to the new
+// meta-file ID, or leaves it alone for duplicates and ordinary files.
+int SLNMetaFileStore(SLNMetaFileRef const meta, uint64_t const fileID, DB_ids *const metaFileIDs, DB_txn *const txn, uint64_t *const out);
+
 
 // TODO: Don't use simple assertions for data integrity checks.
 // TODO: Accept NULL out parameters in unpack functions.
@@ -121,6 +132,17 @@ static void SLNPullByIDValUnpack(DB_val *const val, DB_txn *const txn, uint64_t
 	*query = db_read_string(val, txn);
 }
 
+#define SLNConfigByNameKeyPack(val, txn, name) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX + DB_INLINE_MAX); \
+	db_bind_uint64((val), SLNConfigByName); \
+	db_bind_string((val), (name), (txn));
+#define SLNConfigByNameValPack(val, txn, value) \
+	DB_VAL_STORAGE(val, DB_INLINE_MAX); \
+	db_bind_string((val), (value), (txn));
+static void SLNConfigByNameValUnpack(DB_val *const val, DB_txn *const txn, strarg_t *const value) {
+	*value = db_read_string(val, txn);
+}
+
 #define SLNFileByIDKeyPack(val, txn, fileID) \
 	DB_VAL_STORAGE(val, DB_VARINT_MAX + DB_VARINT_MAX); \
 	db_bind_uint64((val), SLNFileByID); \
@@ -244,6 +266,10 @@ static void SLNMetaFileIDFieldAndValueKeyUnpack(DB_val *const val, DB_txn *const
 	db_bind_string((val), field, (txn)); \
 	db_bind_string((val), value, (txn)); \
 	db_bind_uint64((val), (metaFileID));
+#define SLNFieldValueAndMetaFileIDRange0(range, txn) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX); \
+	db_bind_uint64((range)->min, SLNFieldValueAndMetaFileID); \
+	db_range_genmax((range));
 #define SLNFieldValueAndMetaFileIDRange2(range, txn, field, value) \
 	DB_RANGE_STORAGE(range, DB_VARINT_MAX * 1 + DB_INLINE_MAX * 2); \
 	db_bind_uint64((range)->min, SLNFieldValueAndMetaFileID); \
@@ -264,6 +290,10 @@ static void SLNFieldValueAndMetaFileIDKeyUnpack(DB_val *const val, DB_txn *const
 	db_bind_string((val), (token), (txn)); \
 	db_bind_uint64((val), (metaFileID)); \
 	db_bind_uint64((val), (position));
+#define SLNTermMetaFileIDAndPositionRange0(range, txn) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX); \
+	db_bind_uint64((range)->min, SLNTermMetaFileIDAndPosition); \
+	db_range_genmax((range));
 #define SLNTermMetaFileIDAndPositionRange1(range, txn, token) \
 	DB_RANGE_STORAGE(range, DB_VARINT_MAX + DB_INLINE_MAX); \
 	db_bind_uint64((range)->min, SLNTermMetaFileIDAndPosition); \
@@ -297,3 +327,26 @@ static void SLNFirstUniqueMetaFileIDKeyUnpack(DB_val *const val, DB_txn *const t
 	*metaFileID = db_read_uint64(val);
 }
 
+// Posting lists, see db_postings_append(). Block keys are the range
+// followed by the first meta-file ID in each block.
+#define SLNTermPostingsRange0(range, txn) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX); \
+	db_bind_uint64((range)->min, SLNTermPostings); \
+	db_range_genmax((range));
+#define SLNTermPostingsRange1(range, txn, token) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX + DB_INLINE_MAX); \
+	db_bind_uint64((range)->min, SLNTermPostings); \
+	db_bind_string((range)->min, (token), (txn)); \
+	db_range_genmax((range));
+
+#define SLNFieldValuePostingsRange0(range, txn) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX); \
+	db_bind_uint64((range)->min, SLNFieldValuePostings); \
+	db_range_genmax((range));
+#define SLNFieldValuePostingsRange2(range, txn, field, value) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX + DB_INLINE_MAX * 2); \
+	db_bind_uint64((range)->min, SLNFieldValuePostings); \
+	db_bind_string((range)->min, (field), (txn)); \
+	db_bind_string((range)->min, (value), (txn)); \
+	db_range_genmax((range));
+
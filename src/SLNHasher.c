@@ -1,43 +1,212 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "StrongLink.h"
 
+// Input is batched so that handing a buffer to the workers costs much
+// less than hashing it.
+#define HASH_BUF_SIZE (1024 * 64)
+
+// Short URIs are truncated to this many hex digits.
+#define HASH_SHORT_LEN 24
+
+typedef struct {
+	strarg_t name;
+	EVP_MD const *(*md)(void);
+} SLNHashAlgo;
+
+// Note: Support for old/weak algorithms is important for old files
+// that have links using those algorithms. The algorithm we use
+// internally is currently SHA-256, and it must stay first.
+// Repos store their algorithms by name, so adding one is just a matter
+// of listing it here (and in record_algos, to send it in URI records).
+static SLNHashAlgo const algos[] = {
+	{ "sha256", EVP_sha256 },
+	{ "sha1", EVP_sha1 },
+#if !defined(LIBRESSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_BLAKE2)
+	{ "blake2b", EVP_blake2b512 },
+#endif
+};
+
+unsigned SLNHashAlgoFromName(strarg_t const name, size_t const len) {
+	if(!name) return 0;
+	for(size_t i = 0; i < numberof(algos); ++i) {
+		if(strlen(algos[i].name) != len) continue;
+		if(0 != strncasecmp(algos[i].name, name, len)) continue;
+		return 1 << i;
+	}
+	return 0;
+}
+strarg_t SLNHashAlgoName(unsigned const algo) {
+	for(size_t i = 0; i < numberof(algos); ++i) {
+		if(algo == 1U << i) return algos[i].name;
+	}
+	return NULL;
+}
+// URI record IDs are part of the wire format, so unlike the registry
+// above, they don't depend on what this build supports. Append only.
+static strarg_t const record_algos[] = {
+	"sha256",
+	"sha1",
+	"blake2b",
+};
+strarg_t SLNRecordAlgoName(unsigned const id) {
+	if(id >= numberof(record_algos)) return NULL;
+	return record_algos[id];
+}
+int SLNRecordAlgoID(strarg_t const name) {
+	if(!name) return UV_EINVAL;
+	for(size_t i = 0; i < numberof(record_algos); ++i) {
+		if(0 == strcasecmp(record_algos[i], name)) return (int)i;
+	}
+	return UV_EINVAL;
+}
+int SLNHashAlgosParse(strarg_t const list, unsigned *const out) {
+	assert(out);
+	unsigned x = SLN_HASH_INTERNAL;
+	strarg_t pos = list ? list : SLN_HASH_ALGOS_DEFAULT;
+	while('\0' != *pos) {
+		size_t const len = strcspn(pos, ", ");
+		if(len) {
+			unsigned const algo = SLNHashAlgoFromName(pos, len);
+			if(!algo) return UV_EINVAL;
+			x |= algo;
+		}
+		pos += len;
+		pos += strspn(pos, ", ");
+	}
+	*out = x;
+	return 0;
+}
+
+struct hash_task {
+	SLNHasherRef hasher;
+	EVP_MD_CTX *ctx;
+	int status; // Only set by the task itself
+};
 struct SLNHasher {
 	str_t *type;
-	SHA_CTX sha1;
-	SHA256_CTX sha256;
+	unsigned algos;
+	struct hash_task tasks[SLN_HASH_ALGO_MAX];
 	str_t *internalHash;
+
+	// Double buffered: new input is copied into `fill` while each
+	// algorithm runs on its own worker thread over `busy`. Background
+	// tasks are only started on the main fiber, and must be waited on
+	// there (see SLNHasherWait). Each task only touches its own state.
+	byte_t *fill;
+	size_t filled;
+	byte_t *busy;
+	size_t busylen;
+	unsigned pending;
+	async_sem_t done[1];
+	int status;
 };
 
-SLNHasherRef SLNHasherCreate(strarg_t const type) {
+static void hash_task(struct hash_task *const task) {
+	SLNHasherRef const hasher = task->hasher;
+	async_pool_enter(NULL);
+	if(!EVP_DigestUpdate(task->ctx, hasher->busy, hasher->busylen)) task->status = -1;
+	async_pool_leave(NULL);
+	async_sem_post(hasher->done);
+}
+static int hasher_wait(SLNHasherRef const hasher) {
+	// Pool workers can't block on semaphores, and the tasks might need
+	// the very worker we'd be waiting on.
+	assertf(async_main || !hasher->pending, "Hasher used off the main fiber with tasks pending");
+	while(hasher->pending) {
+		async_sem_wait(hasher->done);
+		hasher->pending--;
+	}
+	if(hasher->status < 0) return hasher->status;
+	for(size_t i = 0; i < numberof(algos); ++i) {
+		if(hasher->tasks[i].status < 0) return hasher->tasks[i].status;
+	}
+	return 0;
+}
+static int hasher_flush(SLNHasherRef const hasher) {
+	int rc = hasher_wait(hasher);
+	if(rc < 0) return rc;
+	if(!hasher->filled) return 0;
+	if(!async_main) {
+		// Already on a worker (e.g. yajl callbacks), so hash in place.
+		for(size_t i = 0; i < numberof(algos); ++i) {
+			if(!hasher->tasks[i].ctx) continue;
+			if(!EVP_DigestUpdate(hasher->tasks[i].ctx, hasher->fill, hasher->filled)) return -1;
+		}
+		hasher->filled = 0;
+		return 0;
+	}
+	byte_t *const buf = hasher->busy;
+	hasher->busy = hasher->fill;
+	hasher->busylen = hasher->filled;
+	hasher->fill = buf;
+	hasher->filled = 0;
+
+	for(size_t i = 0; i < numberof(algos); ++i) {
+		if(!hasher->tasks[i].ctx) continue;
+		hasher->pending++;
+		rc = async_spawn(STACK_MINIMUM, (void (*)())hash_task, &hasher->tasks[i]);
+		if(rc < 0) {
+			hasher->pending--;
+			hasher->status = rc;
+		}
+	}
+	return 0;
+}
+
+SLNHasherRef SLNHasherCreate(strarg_t const type, unsigned const algomask) {
 	assertf(type, "SLNHasher type required");
 	SLNHasherRef hasher = calloc(1, sizeof(struct SLNHasher));
 	if(!hasher) return NULL;
 	hasher->type = strdup(type);
-
-	// Note: Support for old/weak algorithms is important for old files
-	// that have links using those algorithms. The algorithm we use
-	// internally is currently SHA-256.
-	// TODO: Plugin support.
-	int rc = 0;
-	rc = rc < 0 ? rc : SHA256_Init(&hasher->sha256);
-	rc = rc < 0 ? rc : SHA1_Init(&hasher->sha1);
-	if(rc < 0) {
+	hasher->algos = algomask | SLN_HASH_INTERNAL;
+	hasher->fill = malloc(HASH_BUF_SIZE);
+	hasher->busy = malloc(HASH_BUF_SIZE);
+	async_sem_init(hasher->done, 0, 0);
+	if(!hasher->type || !hasher->fill || !hasher->busy) {
 		SLNHasherFree(&hasher);
 		return NULL;
-	};
+	}
+
+	for(size_t i = 0; i < numberof(algos); ++i) {
+		if(!(hasher->algos & (1 << i))) continue;
+		EVP_MD_CTX *const ctx = EVP_MD_CTX_new();
+		if(!ctx) {
+			SLNHasherFree(&hasher);
+			return NULL;
+		}
+		hasher->tasks[i].hasher = hasher;
+		hasher->tasks[i].ctx = ctx;
+		if(!EVP_DigestInit_ex(ctx, algos[i].md(), NULL)) {
+			SLNHasherFree(&hasher);
+			return NULL;
+		}
+	}
 
 	return hasher;
 }
 void SLNHasherFree(SLNHasherRef *const hasherptr) {
 	SLNHasherRef hasher = *hasherptr;
 	if(!hasher) return;
+	hasher_wait(hasher);
 	FREE(&hasher->type);
-	memset(&hasher->sha1, 0, sizeof(hasher->sha1));
-	memset(&hasher->sha256, 0, sizeof(hasher->sha256));
+	hasher->algos = 0;
+	for(size_t i = 0; i < SLN_HASH_ALGO_MAX; ++i) {
+		EVP_MD_CTX_free(hasher->tasks[i].ctx);
+		hasher->tasks[i].ctx = NULL;
+		hasher->tasks[i].hasher = NULL;
+		hasher->tasks[i].status = 0;
+	}
 	FREE(&hasher->internalHash);
+	FREE(&hasher->fill);
+	hasher->filled = 0;
+	FREE(&hasher->busy);
+	hasher->busylen = 0;
+	async_sem_destroy(hasher->done);
+	memset(hasher->done, 0, sizeof(hasher->done));
+	hasher->status = 0;
 	assert_zeroed(hasher, 1);
 	FREE(hasherptr); hasher = NULL;
 }
@@ -45,52 +214,67 @@ int SLNHasherWrite(SLNHasherRef const hasher, byte_t const *const buf, size_t co
 	if(!hasher) return 0;
 	if(!len) return 0;
 	assertf(buf, "Buffer required");
-	if(SHA1_Update(&hasher->sha1, buf, len) < 0) return -1;
-	if(SHA256_Update(&hasher->sha256, buf, len) < 0) return -1;
+	size_t used = 0;
+	while(used < len) {
+		size_t const x = MIN(len-used, HASH_BUF_SIZE-hasher->filled);
+		memcpy(hasher->fill+hasher->filled, buf+used, x);
+		hasher->filled += x;
+		used += x;
+		if(hasher->filled < HASH_BUF_SIZE) break;
+		int rc = hasher_flush(hasher);
+		if(rc < 0) return rc;
+	}
 	return 0;
 }
 
+// Waits for any hashing started in the background by SLNHasherWrite.
+// Callers on the main fiber must do this before returning control to
+// anything that might use the hasher from a pool worker.
+int SLNHasherWait(SLNHasherRef const hasher) {
+	if(!hasher) return 0;
+	return hasher_wait(hasher);
+}
+
 str_t **SLNHasherEnd(SLNHasherRef const hasher) {
 	if(!hasher) return NULL;
+	if(hasher_flush(hasher) < 0) return NULL;
+	if(hasher_wait(hasher) < 0) return NULL;
 
-	byte_t sha1[SHA_DIGEST_LENGTH];
-	byte_t sha256[SHA256_DIGEST_LENGTH];
-	if(SHA1_Final(sha1, &hasher->sha1) < 0) return NULL;
-	if(SHA256_Final(sha256, &hasher->sha256) < 0) return NULL;
-	str_t *sha1hex = tohexstr(sha1, SHA_DIGEST_LENGTH);
-	str_t *sha256hex = tohexstr(sha256, SHA256_DIGEST_LENGTH);
-	if(!sha1hex || !sha256hex) {
-		FREE(&sha1hex);
-		FREE(&sha256hex);
-		return NULL;
-	}
-	// TODO: Base64.
+	// Each algorithm gets a full and a short URI.
+	str_t **URIs = calloc(numberof(algos)*2+1, sizeof(str_t *));
+	if(!URIs) return NULL;
+	size_t count = 0;
 
-	hasher->internalHash = strdup(sha256hex);
+	// The preferred URI (e.g. the one used for internalHash) comes
+	// first because the internal algorithm is first in the registry.
+	for(size_t i = 0; i < numberof(algos); ++i) {
+		if(!hasher->tasks[i].ctx) continue;
+		byte_t digest[EVP_MAX_MD_SIZE];
+		unsigned len = 0;
+		if(!EVP_DigestFinal_ex(hasher->tasks[i].ctx, digest, &len)) goto fail;
+		str_t *hex = tohexstr(digest, len);
+		if(!hex) goto fail;
+		// TODO: Base64.
 
-	// TODO: Plugins, dynamic size.
-	str_t **const URIs = malloc(sizeof(str_t *) * (4+1));
-	if(!URIs) {
-		FREE(&sha1hex);
-		FREE(&sha256hex);
-		return NULL;
+		if(SLN_HASH_INTERNAL == 1 << i) {
+			hasher->internalHash = strdup(hex);
+			if(!hasher->internalHash) { FREE(&hex); goto fail; }
+		}
+		str_t *const full = SLNFormatURI(algos[i].name, hex);
+		hex[MIN(strlen(hex), HASH_SHORT_LEN)] = '\0';
+		str_t *const brief = SLNFormatURI(algos[i].name, hex);
+		FREE(&hex);
+		if(full) URIs[count++] = full;
+		if(brief) URIs[count++] = brief;
+		if(!full || !brief) goto fail;
 	}
-
-	// Make sure the preferred URI (e.g. the one used for internalHash) is first.
-	URIs[0] = SLNFormatURI("sha256", sha256hex);
-	sha256hex[24] = '\0';
-	URIs[1] = SLNFormatURI("sha256", sha256hex);
-
-	URIs[2] = SLNFormatURI("sha1", sha1hex);
-	sha1hex[24] = '\0';
-	URIs[3] = SLNFormatURI("sha1", sha1hex);
-
-	URIs[4] = NULL;
-
-	FREE(&sha1hex);
-	FREE(&sha256hex);
-
+	URIs[count] = NULL;
 	return URIs;
+
+fail:
+	for(size_t i = 0; i < count; ++i) FREE(&URIs[i]);
+	FREE(&URIs);
+	return NULL;
 }
 strarg_t SLNHasherGetInternalHash(SLNHasherRef const hasher) {
 	if(!hasher) return NULL;
@@ -8,39 +8,63 @@
 #include "http/HTTPHeaders.h"
 #include "http/QueryString.h"
 
-// TODO: This entire file is obsolete.
-// It implements the old sync algorithm using /sln/all, which
-// mixes files and meta-files. The correct algorithm is implemented in
-// the `sln-pipe` example script. On the other hand, this version is much
-// faster because it does concurrent transfers and batching.
-// This algorithm still works fine for full mirrors, but it doesn't work
-// with queries (partial mirrors).
-
-#define READER_COUNT 64
-#define QUEUE_SIZE 64 // TODO: Find a way to lower these without sacrificing performance, and perhaps automatically adjust them somehow.
+// Files are listed by a single feeder connection (/sln/all for full
+// mirrors, /sln/query for partial ones) and fetched by the readers, each
+// of which keeps several requests in flight on its own connection. Where
+// the remote supports it, everything a reader needs is fetched with a
+// single /sln/batch request instead of one GET per file. The writer
+// stores them in batches, in the order they were listed.
+// TODO: The correct algorithm (separate streams for files and meta-files,
+// with meta-files blocking on their targets) is implemented in the
+// `sln-pipe` example script. Query pulls don't fetch meta-files yet.
+
+#define READER_COUNT 16
+#define PIPELINE_DEPTH 32 // Files in flight per reader connection.
+#define QUEUE_SIZE (READER_COUNT * PIPELINE_DEPTH) // TODO: Find a way to lower these without sacrificing performance, and perhaps automatically adjust them somehow.
 
 struct SLNPull {
 	uint64_t pullID;
 	SLNSessionRef session;
 	str_t *host;
 	str_t *cookie;
-//	str_t *query;
+	str_t *query;
 
-	async_mutex_t connlock[1];
 	HTTPConnectionRef conn;
+	str_t *last; // Resume position for the feeder.
+	bool records; // The remote is listing SLN_URI_RECORDS_TYPE.
+	bool batch; // Cleared if the remote doesn't support /sln/batch.
 
 	async_mutex_t mutex[1];
 	async_cond_t cond[1];
 	bool stop;
 	size_t tasks;
+	str_t *URIs[QUEUE_SIZE];
 	SLNSubmissionRef queue[QUEUE_SIZE];
 	bool filled[QUEUE_SIZE];
 	size_t cur;
 	size_t count;
+	size_t unclaimed;
+};
+
+enum {
+	PULL_UNSENT = 0,
+	PULL_SENT,
+	PULL_SKIP,
 };
+typedef struct {
+	size_t pos;
+	str_t *URI;
+	int state;
+	bool batched;
+	bool first; // First and last in their batch, respectively.
+	bool last;
+} pull_req;
 
 static int reconnect(SLNPullRef const pull);
-static int import(SLNPullRef const pull, strarg_t const URI, size_t const pos, HTTPConnectionRef *const conn);
+static int request(SLNPullRef const pull, pull_req *const req, HTTPConnectionRef *const conn);
+static int request_batch(SLNPullRef const pull, pull_req reqs[], size_t const head, size_t const count, HTTPConnectionRef *const conn);
+static int response(SLNPullRef const pull, pull_req *const req, HTTPConnectionRef const conn);
+static void enqueue(SLNPullRef const pull, size_t const pos, SLNSubmissionRef *const subptr);
 
 SLNPullRef SLNRepoCreatePull(SLNRepoRef const repo, uint64_t const pullID, uint64_t const userID, strarg_t const host, strarg_t const sessionid, strarg_t const query) {
 	SLNPullRef pull = calloc(1, sizeof(struct SLNPull));
@@ -51,14 +75,12 @@ SLNPullRef SLNRepoCreatePull(SLNRepoRef const repo, uint64_t const pullID, uint6
 	pull->session = SLNSessionCreateInternal(cache, 0, NULL, NULL, userID, SLN_RDWR, NULL); // TODO: How to create this properly?
 	pull->host = strdup(host);
 	pull->cookie = aasprintf("s=%s", sessionid ? sessionid : "");
-//	pull->query = strdup(query);
-	assert(!query || '\0' == query[0]); // TODO
-	if(!pull->session || !pull->host || !pull->cookie) {
+	pull->query = strdup(query ? query : "");
+	if(!pull->session || !pull->host || !pull->cookie || !pull->query) {
 		SLNPullFree(&pull);
 		return NULL;
 	}
 
-	async_mutex_init(pull->connlock, 0);
 	async_mutex_init(pull->mutex, 0);
 	async_cond_init(pull->cond, 0);
 	pull->stop = true;
@@ -75,9 +97,9 @@ void SLNPullFree(SLNPullRef *const pullptr) {
 	SLNSessionRelease(&pull->session);
 	FREE(&pull->host);
 	FREE(&pull->cookie);
-//	FREE(&pull->query);
+	FREE(&pull->query);
+	FREE(&pull->last);
 
-	async_mutex_destroy(pull->connlock);
 	async_mutex_destroy(pull->mutex);
 	async_cond_destroy(pull->cond);
 	pull->stop = false;
@@ -86,18 +108,65 @@ void SLNPullFree(SLNPullRef *const pullptr) {
 	FREE(pullptr); pull = NULL;
 }
 
-static void reader(SLNPullRef const pull) {
-	HTTPConnectionRef conn = NULL;
-	int rc;
+static int read_exact(HTTPConnectionRef const conn, byte_t *const out, size_t const len) {
+	size_t used = 0;
+	while(used < len) {
+		HTTPEvent type;
+		uv_buf_t buf[1];
+		int rc = HTTPConnectionPeek(conn, &type, buf);
+		if(rc < 0) return rc;
+		if(HTTPMessageEnd == type) return UV_EOF;
+		if(HTTPBody != type) return UV_EPROTO;
+		size_t const x = MIN(buf->len, len-used);
+		memcpy(out+used, buf->base, x);
+		HTTPConnectionPop(conn, x);
+		used += x;
+	}
+	return 0;
+}
+static uint64_t get_uint64(byte_t const *const buf) {
+	uint64_t x = 0;
+	for(size_t i = 0; i < 8; i++) x = x << 8 | buf[i];
+	return x;
+}
+// Reads one record (see SLN_URI_RECORDS_TYPE). The URI is left empty for
+// keep-alives. The position can be used as the `start` parameter.
+static int read_record(HTTPConnectionRef const conn, str_t *const URI, size_t const max, str_t *const pos, size_t const posmax) {
+	byte_t rec[SLN_URI_RECORD_MAX];
+	URI[0] = '\0';
+	int rc = read_exact(conn, rec, 1);
+	if(rc < 0) return rc;
+	if(0 == rec[0]) return 0;
+	size_t const len = rec[0];
+	if(len < 1+1+8+8 || 1+len > sizeof(rec)) return UV_EPROTO;
+	rc = read_exact(conn, rec+1, len);
+	if(rc < 0) return rc;
+
+	strarg_t const algo = SLNRecordAlgoName(rec[1]);
+	if(!algo) return UV_EPROTO;
+	size_t const size = len-1-8-8;
+	str_t hash[SLN_URI_RECORD_MAX*2+1];
+	tohex(hash, rec+2, size);
+	hash[size*2] = '\0';
+	snprintf(URI, max, "hash://%s/%s", algo, hash);
+	snprintf(pos, posmax, "%llu.%llu",
+		(unsigned long long)get_uint64(rec+2+size),
+		(unsigned long long)get_uint64(rec+2+size+8));
+	return 0;
+}
 
+static void feeder(SLNPullRef const pull) {
 	for(;;) {
 		if(pull->stop) goto stop;
 
 		str_t URI[URI_MAX];
-
-		async_mutex_lock(pull->connlock);
-
-		rc = HTTPConnectionReadBodyLine(pull->conn, URI, sizeof(URI));
+		str_t start[URI_MAX];
+		int rc;
+		if(pull->records) {
+			rc = read_record(pull->conn, URI, sizeof(URI), start, sizeof(start));
+		} else {
+			rc = HTTPConnectionReadBodyLine(pull->conn, URI, sizeof(URI));
+		}
 		if(rc < 0) {
 			for(;;) {
 				if(pull->stop) break;
@@ -105,39 +174,114 @@ static void reader(SLNPullRef const pull) {
 				if(pull->stop) break;
 				async_sleep(1000 * 5);
 			}
-			async_mutex_unlock(pull->connlock);
 			continue;
 		}
-		if('#' == URI[0]) { // Comment line.
-			async_mutex_unlock(pull->connlock);
+		if('#' == URI[0]) continue; // Comment line.
+		if('\0' == URI[0]) continue; // Keep-alive.
+
+		str_t *x = strdup(URI);
+		str_t *last = strdup(pull->records ? start : URI);
+		if(!x || !last) {
+			FREE(&x); FREE(&last);
+			HTTPConnectionFree(&pull->conn);
 			continue;
 		}
+		FREE(&pull->last);
+		pull->last = last;
 
 		async_mutex_lock(pull->mutex);
 		while(pull->count + 1 > QUEUE_SIZE) {
 			async_cond_wait(pull->cond, pull->mutex);
 			if(pull->stop) {
 				async_mutex_unlock(pull->mutex);
-				async_mutex_unlock(pull->connlock);
+				FREE(&x);
 				goto stop;
 			}
 		}
-		size_t pos = (pull->cur + pull->count) % QUEUE_SIZE;
-		pull->count += 1;
+		size_t const pos = (pull->cur + pull->count) % QUEUE_SIZE;
+		assert(!pull->URIs[pos]);
+		pull->URIs[pos] = x;
+		pull->count++;
+		pull->unclaimed++;
+		async_cond_broadcast(pull->cond);
 		async_mutex_unlock(pull->mutex);
+	}
 
-		async_mutex_unlock(pull->connlock);
+stop:
+	HTTPConnectionFree(&pull->conn);
+	async_mutex_lock(pull->mutex);
+	assertf(pull->stop, "Feeder ended early");
+	assert(pull->tasks > 0);
+	pull->tasks--;
+	async_cond_broadcast(pull->cond);
+	async_mutex_unlock(pull->mutex);
+}
+static void reader(SLNPullRef const pull) {
+	HTTPConnectionRef conn = NULL;
+	pull_req reqs[PIPELINE_DEPTH] = {};
+	size_t head = 0;
+	size_t count = 0;
+	int rc;
 
-		for(;;) {
-			if(import(pull, URI, pos, &conn) >= 0) break;
-			if(pull->stop) goto stop;
-			async_sleep(1000 * 5);
+	for(;;) {
+		if(pull->stop) goto stop;
+
+		// Claim as many URIs as will fit in our pipeline, but only
+		// wait for more if we don't have any responses to read.
+		async_mutex_lock(pull->mutex);
+		while(count < PIPELINE_DEPTH) {
+			if(!pull->unclaimed) {
+				if(count) break;
+				async_cond_wait(pull->cond, pull->mutex);
+				if(pull->stop) {
+					async_mutex_unlock(pull->mutex);
+					goto stop;
+				}
+				continue;
+			}
+			size_t const pos = (pull->cur + pull->count - pull->unclaimed) % QUEUE_SIZE;
+			pull->unclaimed--;
+			pull_req *const req = &reqs[(head + count) % PIPELINE_DEPTH];
+			req->pos = pos;
+			req->URI = pull->URIs[pos]; pull->URIs[pos] = NULL;
+			req->state = PULL_UNSENT;
+			count++;
 		}
+		async_mutex_unlock(pull->mutex);
 
+		// Requests are only buffered here. They go out together when
+		// we block reading the first response.
+		rc = 0;
+		if(pull->batch) {
+			rc = request_batch(pull, reqs, head, count, &conn);
+		} else for(size_t i = 0; i < count; i++) {
+			pull_req *const req = &reqs[(head + i) % PIPELINE_DEPTH];
+			if(PULL_UNSENT != req->state) continue;
+			rc = request(pull, req, &conn);
+			if(rc < 0) break;
+		}
+		if(rc >= 0) rc = response(pull, &reqs[head], conn);
+		if(rc < 0) {
+			// Everything still in flight has to be requested again
+			// on a new connection.
+			HTTPConnectionFree(&conn);
+			for(size_t i = 0; i < count; i++) {
+				pull_req *const req = &reqs[(head + i) % PIPELINE_DEPTH];
+				if(PULL_SENT == req->state) req->state = PULL_UNSENT;
+			}
+			if(pull->stop) goto stop;
+			// Falling back to single files can happen right away.
+			if(UV_ENOTSUP != rc) async_sleep(1000 * 5);
+			continue;
+		}
+		FREE(&reqs[head].URI);
+		head = (head + 1) % PIPELINE_DEPTH;
+		count--;
 	}
 
 stop:
 	HTTPConnectionFree(&conn);
+	for(size_t i = 0; i < PIPELINE_DEPTH; i++) FREE(&reqs[i].URI);
 	async_mutex_lock(pull->mutex);
 	assertf(pull->stop, "Reader ended early");
 	assert(pull->tasks > 0);
@@ -178,7 +322,8 @@ static void writer(SLNPullRef const pull) {
 		assert(count <= QUEUE_SIZE);
 
 		for(;;) {
-			int rc = SLNSubmissionStoreBatch(queue, count);
+			int rc = SLNSubmissionSyncBatch(queue, count);
+			if(rc >= 0) rc = SLNSubmissionStoreBatch(queue, count);
 			if(rc >= 0) break;
 			fprintf(stderr, "Submission error %s (%d)\n", sln_strerror(rc), rc);
 			async_sleep(1000 * 5);
@@ -213,6 +358,9 @@ int SLNPullStart(SLNPullRef const pull) {
 	if(!pull->stop) return 0;
 	assert(0 == pull->tasks);
 	pull->stop = false;
+	pull->batch = true;
+	pull->tasks++;
+	async_spawn(STACK_DEFAULT, (void (*)())feeder, pull);
 	for(size_t i = 0; i < READER_COUNT; ++i) {
 		pull->tasks++;
 		async_spawn(STACK_DEFAULT, (void (*)())reader, pull);
@@ -236,13 +384,18 @@ void SLNPullStop(SLNPullRef const pull) {
 	async_mutex_unlock(pull->mutex);
 
 	HTTPConnectionFree(&pull->conn);
+	// Anything queued is dropped, so start over next time.
+	FREE(&pull->last);
 
 	for(size_t i = 0; i < QUEUE_SIZE; ++i) {
+		FREE(&pull->URIs[i]);
 		SLNSubmissionFree(&pull->queue[i]);
 		pull->filled[i] = false;
 	}
 	pull->cur = 0;
 	pull->count = 0;
+	pull->unclaimed = 0;
+	pull->batch = false;
 }
 
 static int reconnect(SLNPullRef const pull) {
@@ -255,20 +408,32 @@ static int reconnect(SLNPullRef const pull) {
 		return rc;
 	}
 
-//	str_t path[URI_MAX];
-//	str_t *query_encoded = NULL;
-//	if(pull->query) query_encoded = QSEscape(pull->query, strlen(pull->query), true);
-//	snprintf(path, sizeof(path), "/sln/query-obsolete?q=%s", query_encoded ?: "");
-//	FREE(&query_encoded);
-	HTTPConnectionWriteRequest(pull->conn, HTTP_GET, "/sln/all", pull->host);
-	// TODO
-	// - New API /sln/query and /sln/metafiles
-	// - Pagination ?start=[last URI seen]
-	// - Error handling
-	// - Query string formatter
-	HTTPConnectionWriteHeader(pull->conn, "Cookie", pull->cookie);
-	HTTPConnectionBeginBody(pull->conn);
-	rc = HTTPConnectionEnd(pull->conn);
+	// Full mirrors still use /sln/all so that they get meta-files too.
+	// Either way, we pick up after the last URI we saw and then wait
+	// for new ones.
+	str_t *query = QSEscape(pull->query, strlen(pull->query), true);
+	str_t *start = pull->last ? QSEscape(pull->last, strlen(pull->last), true) : NULL;
+	str_t *path = NULL;
+	if(query && (start || !pull->last)) {
+		if('\0' == pull->query[0]) {
+			path = aasprintf("/sln/all?wait=1%s%s", start ? "&start=" : "", start ? start : "");
+		} else {
+			path = aasprintf("/sln/query?q=%s&wait=1%s%s", query, start ? "&start=" : "", start ? start : "");
+		}
+	}
+	FREE(&query);
+	FREE(&start);
+	if(!path) {
+		HTTPConnectionFree(&pull->conn);
+		return UV_ENOMEM;
+	}
+	rc = HTTPConnectionWriteRequest(pull->conn, HTTP_GET, path, pull->host);
+	FREE(&path);
+	if(rc >= 0) rc = HTTPConnectionWriteHeader(pull->conn, "Cookie", pull->cookie);
+	// Older remotes just ignore this and send text.
+	if(rc >= 0) rc = HTTPConnectionWriteHeader(pull->conn, "Accept", SLN_URI_RECORDS_TYPE ", text/uri-list");
+	if(rc >= 0) rc = HTTPConnectionBeginBody(pull->conn);
+	if(rc >= 0) rc = HTTPConnectionEnd(pull->conn);
 	if(rc < 0) {
 		fprintf(stderr, "Pull couldn't connect to %s (%s)\n", pull->host, sln_strerror(rc));
 		return rc;
@@ -287,123 +452,293 @@ static int reconnect(SLNPullRef const pull) {
 		return UV_EPROTO;
 	}
 
-	// TODO: All this does is scan past the headers.
-	// We don't actually use them...
 	HTTPHeadersRef headers;
 	rc = HTTPHeadersCreateFromConnection(pull->conn, &headers);
-	assert(rc >= 0); // TODO
-	HTTPHeadersFree(&headers);
-/*	rc = HTTPConnectionReadHeaders(pull->conn, NULL, NULL, 0);
 	if(rc < 0) {
 		fprintf(stderr, "Pull connection error %s\n", sln_strerror(rc));
 		return rc;
-	}*/
+	}
+	strarg_t const type = HTTPHeadersGet(headers, "Content-Type");
+	pull->records = type && 0 == strcasecmp(type, SLN_URI_RECORDS_TYPE);
+	HTTPHeadersFree(&headers);
 
 	return 0;
 }
 
-
-static int import(SLNPullRef const pull, strarg_t const URI, size_t const pos, HTTPConnectionRef *const conn) {
-	if(!pull) return 0;
-
-	// TODO: Even if there's nothing to do, we have to enqueue something to fill up our reserved slots. I guess it's better than doing a lot of work inside the connection lock, but there's got to be a better way.
-	SLNSubmissionRef sub = NULL;
-	HTTPHeadersRef headers = NULL;
-
-	if(!URI) goto enqueue;
-
+static bool needed(SLNPullRef const pull, pull_req *const req) {
+	assert(PULL_UNSENT == req->state);
 	str_t algo[SLN_ALGO_SIZE];
 	str_t hash[SLN_HASH_SIZE];
-	if(SLNParseURI(URI, algo, hash) < 0) goto enqueue;
-
-	int rc = SLNSessionGetFileInfo(pull->session, URI, NULL);
-	if(rc >= 0) goto enqueue;
+	if(SLNParseURI(req->URI, algo, hash) < 0) {
+		req->state = PULL_SKIP;
+		return false;
+	}
+	int rc = SLNSessionGetFileInfo(pull->session, req->URI, NULL);
+	if(rc >= 0) {
+		req->state = PULL_SKIP;
+		return false;
+	}
 	db_assertf(DB_NOTFOUND == rc, "Database error %s", sln_strerror(rc));
-
-	// TODO: We're logging out of order when we do it like this...
-//	fprintf(stderr, "Pulling %s\n", URI);
-
-	if(!*conn) {
-		rc = HTTPConnectionCreateOutgoing(pull->host, 0, conn);
-		if(rc < 0) {
-			fprintf(stderr, "Pull import connection error %s\n", sln_strerror(rc));
-			goto fail;
-		}
+	return true;
+}
+static int open_conn(SLNPullRef const pull, HTTPConnectionRef *const conn) {
+	if(*conn) return 0;
+	int rc = HTTPConnectionCreateOutgoing(pull->host, 0, conn);
+	if(rc < 0) {
+		fprintf(stderr, "Pull import connection error %s\n", sln_strerror(rc));
+		return rc;
 	}
+	return 0;
+}
+static int request(SLNPullRef const pull, pull_req *const req, HTTPConnectionRef *const conn) {
+	if(!needed(pull, req)) return 0;
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	SLNParseURI(req->URI, algo, hash);
+
+	int rc = open_conn(pull, conn);
+	if(rc < 0) return rc;
 
 	str_t *path = aasprintf("/sln/file/%s/%s", algo, hash);
 	if(!path) {
 		fprintf(stderr, "Pull aasprintf error\n");
-		goto fail;
+		return UV_ENOMEM;
 	}
 	rc = HTTPConnectionWriteRequest(*conn, HTTP_GET, path, pull->host);
-	assert(rc >= 0); // TODO
 	FREE(&path);
-
-	HTTPConnectionWriteHeader(*conn, "Cookie", pull->cookie);
-	HTTPConnectionBeginBody(*conn);
-	rc = HTTPConnectionEnd(*conn);
+	if(rc >= 0) rc = HTTPConnectionWriteHeader(*conn, "Cookie", pull->cookie);
+	if(rc >= 0) rc = HTTPConnectionBeginBody(*conn);
 	if(rc < 0) {
 		fprintf(stderr, "Pull import request error %s\n", sln_strerror(rc));
-		goto fail;
+		return rc;
+	}
+	req->state = PULL_SENT;
+	req->batched = false;
+	return 0;
+}
+static int send_batch(SLNPullRef const pull, pull_req *const list[], size_t const count, HTTPConnectionRef *const conn) {
+	int rc = open_conn(pull, conn);
+	if(rc < 0) return rc;
+
+	size_t len = 0;
+	for(size_t i = 0; i < count; i++) len += strlen(list[i]->URI)+1;
+	str_t *body = malloc(len+1);
+	if(!body) return UV_ENOMEM;
+	size_t pos = 0;
+	for(size_t i = 0; i < count; i++) {
+		pos += snprintf(body+pos, len+1-pos, "%s\n", list[i]->URI);
+	}
+
+	rc = HTTPConnectionWriteRequest(*conn, HTTP_POST, "/sln/batch", pull->host);
+	if(rc >= 0) rc = HTTPConnectionWriteHeader(*conn, "Cookie", pull->cookie);
+	if(rc >= 0) rc = HTTPConnectionWriteHeader(*conn, "Content-Type", "text/uri-list; charset=utf-8");
+	if(rc >= 0) rc = HTTPConnectionWriteContentLength(*conn, len);
+	if(rc >= 0) rc = HTTPConnectionBeginBody(*conn);
+	if(rc >= 0) rc = HTTPConnectionWrite(*conn, (byte_t const *)body, len);
+	FREE(&body);
+	if(rc < 0) {
+		fprintf(stderr, "Pull batch request error %s\n", sln_strerror(rc));
+		return rc;
+	}
+	for(size_t i = 0; i < count; i++) {
+		list[i]->state = PULL_SENT;
+		list[i]->batched = true;
+		list[i]->first = 0 == i;
+		list[i]->last = count-1 == i;
+	}
+	return 0;
+}
+static int request_batch(SLNPullRef const pull, pull_req reqs[], size_t const head, size_t const count, HTTPConnectionRef *const conn) {
+	pull_req *list[SLN_BATCH_MAX];
+	size_t n = 0;
+	for(size_t i = 0; i < count; i++) {
+		pull_req *const req = &reqs[(head + i) % PIPELINE_DEPTH];
+		if(PULL_UNSENT != req->state) continue;
+		if(!needed(pull, req)) continue;
+		list[n++] = req;
+		if(n < numberof(list)) continue;
+		int rc = send_batch(pull, list, n, conn);
+		if(rc < 0) return rc;
+		n = 0;
 	}
-	int const status = HTTPConnectionReadResponseStatus(*conn);
+	if(!n) return 0;
+	return send_batch(pull, list, n, conn);
+}
+
+static int read_file(SLNPullRef const pull, pull_req *const req, HTTPConnectionRef const conn, SLNSubmissionRef *const out) {
+	int const status = HTTPConnectionReadResponseStatus(conn);
 	if(status < 0) {
 		fprintf(stderr, "Pull import response error %s\n", sln_strerror(status));
-		goto fail;
+		return status;
 	}
-	if(status < 200 || status >= 300) {
+	bool const missing = status >= 400 && status < 500;
+	if(!missing && (status < 200 || status >= 300)) {
 		fprintf(stderr, "Pull import status error %d\n", status);
-		goto fail;
+		return UV_EPROTO;
 	}
 
-	rc = HTTPHeadersCreateFromConnection(*conn, &headers);
-	assert(rc >= 0); // TODO
-/*	if(rc < 0) {
+	HTTPHeadersRef headers = NULL;
+	int rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	if(rc < 0) {
 		fprintf(stderr, "Pull import headers error %s\n", sln_strerror(rc));
-		goto fail;
-	}*/
+		return rc;
+	}
+	if(missing) {
+		// Same as a missing file in a batch (see read_frame).
+		HTTPHeadersFree(&headers);
+		fprintf(stderr, "Pull skipping %s (%d)\n", req->URI, status);
+		for(;;) {
+			uv_buf_t buf[1] = {};
+			rc = HTTPConnectionReadBody(conn, buf);
+			if(rc < 0) return rc;
+			if(0 == buf->len) return 0;
+		}
+	}
 	strarg_t const type = HTTPHeadersGet(headers, "content-type");
-
-	rc = SLNSubmissionCreate(pull->session, URI, type, &sub);
+	rc = SLNSubmissionCreate(pull->session, req->URI, type, out);
+	HTTPHeadersFree(&headers);
 	if(rc < 0) {
 		fprintf(stderr, "Pull submission error\n");
-		goto fail;
+		return rc;
 	}
 	for(;;) {
-		if(pull->stop) goto fail;
+		if(pull->stop) return UV_ECANCELED;
 		uv_buf_t buf[1] = {};
-		rc = HTTPConnectionReadBody(*conn, buf);
+		rc = HTTPConnectionReadBody(conn, buf);
 		if(rc < 0) {
 			fprintf(stderr, "Pull download error %s\n", sln_strerror(rc));
-			goto fail;
+			return rc;
 		}
 		if(0 == buf->len) break;
-		rc = SLNSubmissionWrite(sub, (byte_t *)buf->base, buf->len);
+		rc = SLNSubmissionWrite(*out, (byte_t *)buf->base, buf->len);
 		if(rc < 0) {
 			fprintf(stderr, "Pull write error\n");
-			goto fail;
+			return rc;
+		}
+	}
+	return 0;
+}
+static int read_frame(SLNPullRef const pull, pull_req *const req, HTTPConnectionRef const conn, SLNSubmissionRef *const out) {
+	int rc;
+	if(req->first) {
+		int const status = HTTPConnectionReadResponseStatus(conn);
+		if(status < 0) {
+			fprintf(stderr, "Pull batch response error %s\n", sln_strerror(status));
+			return status;
+		}
+		if(400 == status || 404 == status || 405 == status || 501 == status) {
+			fprintf(stderr, "Pull batch not supported by %s (%d)\n", pull->host, status);
+			pull->batch = false;
+			return UV_ENOTSUP;
+		}
+		if(status < 200 || status >= 300) {
+			fprintf(stderr, "Pull batch status error %d\n", status);
+			return UV_EPROTO;
+		}
+		HTTPHeadersRef headers = NULL;
+		rc = HTTPHeadersCreateFromConnection(conn, &headers);
+		HTTPHeadersFree(&headers);
+		if(rc < 0) {
+			fprintf(stderr, "Pull batch headers error %s\n", sln_strerror(rc));
+			return rc;
 		}
 	}
-	rc = SLNSubmissionEnd(sub);
+
+	// <URI> <status>[ <size> <type>]
+	str_t line[URI_MAX * 2];
+	rc = HTTPConnectionReadBodyLine(conn, line, sizeof(line));
 	if(rc < 0) {
-		fprintf(stderr, "Pull submission error %s\n", sln_strerror(rc));
-		goto fail;
+		fprintf(stderr, "Pull batch frame error %s\n", sln_strerror(rc));
+		return rc;
+	}
+	str_t *x = strchr(line, ' ');
+	if(!x) return UV_EPROTO;
+	*x++ = '\0';
+	long const status = strtol(x, &x, 10);
+	if(0 != strcmp(line, req->URI)) {
+		fprintf(stderr, "Pull batch out of order (%s, expected %s)\n", line, req->URI);
+		return UV_EPROTO;
+	}
+	if(status >= 400 && status < 500) {
+		// One missing file shouldn't hold up the rest of the batch.
+		// It's left out of the queue, like the files we already have.
+		fprintf(stderr, "Pull skipping %s (%ld)\n", req->URI, status);
+		goto end;
 	}
+	if(200 != status) {
+		fprintf(stderr, "Pull batch status error %ld for %s\n", status, req->URI);
+		return UV_EPROTO;
+	}
+	if(' ' != *x) return UV_EPROTO;
+	uint64_t remaining = strtoull(x+1, &x, 10);
+	if(' ' != *x) return UV_EPROTO;
+	strarg_t const type = x+1;
 
-enqueue:
-	HTTPHeadersFree(&headers);
+	rc = SLNSubmissionCreate(pull->session, req->URI, type, out);
+	if(rc < 0) {
+		fprintf(stderr, "Pull submission error\n");
+		return rc;
+	}
+	while(remaining) {
+		if(pull->stop) return UV_ECANCELED;
+		HTTPEvent event;
+		uv_buf_t buf[1];
+		rc = HTTPConnectionPeek(conn, &event, buf);
+		if(rc < 0) {
+			fprintf(stderr, "Pull download error %s\n", sln_strerror(rc));
+			return rc;
+		}
+		if(HTTPBody != event) return UV_EPROTO;
+		size_t const len = MIN(buf->len, remaining);
+		rc = SLNSubmissionWrite(*out, (byte_t *)buf->base, len);
+		if(rc < 0) {
+			fprintf(stderr, "Pull write error\n");
+			return rc;
+		}
+		HTTPConnectionPop(conn, len);
+		remaining -= len;
+	}
+
+end:
+	if(req->last) {
+		uv_buf_t buf[1] = {};
+		rc = HTTPConnectionReadBody(conn, buf);
+		if(rc < 0) return rc;
+		if(0 != buf->len) return UV_EPROTO; // Extra frames
+	}
+	return 0;
+}
+static int response(SLNPullRef const pull, pull_req *const req, HTTPConnectionRef const conn) {
+	// TODO: Even if there's nothing to do, we have to enqueue something to fill up our reserved slots. I guess it's better than doing a lot of work inside the connection lock, but there's got to be a better way.
+	SLNSubmissionRef sub = NULL;
+	int rc = 0;
+
+	if(PULL_SKIP != req->state) {
+		assert(PULL_SENT == req->state);
+		// TODO: We're logging out of order when we do it like this...
+//		fprintf(stderr, "Pulling %s\n", req->URI);
+		if(req->batched) rc = read_frame(pull, req, conn, &sub);
+		else rc = read_file(pull, req, conn, &sub);
+		if(rc < 0) goto cleanup;
+
+		// The writer syncs the whole batch at once.
+		rc = SLNSubmissionEndNoSync(sub);
+		if(rc < 0) {
+			fprintf(stderr, "Pull submission error %s\n", sln_strerror(rc));
+			goto cleanup;
+		}
+	}
+
+	enqueue(pull, req->pos, &sub);
+
+cleanup:
+	SLNSubmissionFree(&sub);
+	return rc;
+}
+static void enqueue(SLNPullRef const pull, size_t const pos, SLNSubmissionRef *const subptr) {
 	async_mutex_lock(pull->mutex);
-	pull->queue[pos] = sub; sub = NULL;
+	pull->queue[pos] = *subptr; *subptr = NULL;
 	pull->filled[pos] = true;
 	async_cond_broadcast(pull->cond);
 	async_mutex_unlock(pull->mutex);
-	return 0;
-
-fail:
-	HTTPHeadersFree(&headers);
-	SLNSubmissionFree(&sub);
-	HTTPConnectionFree(conn);
-	return -1;
 }
-
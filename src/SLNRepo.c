@@ -7,6 +7,11 @@
 
 #define CACHE_SIZE 1000
 
+// How long (in milliseconds) the group commit leader waits for other
+// submissions to join its transaction. Submissions that arrive while a
+// commit is in progress are always merged, regardless of this setting.
+#define COMMIT_DELAY 0
+
 struct SLNRepo {
 	str_t *dir;
 	str_t *name;
@@ -18,25 +23,32 @@ struct SLNRepo {
 
 	SLNMode pub_mode;
 	SLNMode reg_mode;
+	unsigned hash_algos;
 	SLNSessionCacheRef session_cache;
+	SLNQueryCacheRef query_cache;
 
 	DB_env *db;
+	DB_ids fileIDs[1];
+	DB_ids metaFileIDs[1];
 
 	async_mutex_t sub_mutex[1];
 	async_cond_t sub_cond[1];
 	uint64_t sub_latest;
+	uint64_t commit_delay;
+	async_mutex_t commit_mutex[1];
+	unsigned commit_pending; // atomic
 
 	SLNPullRef *pulls;
 	size_t pull_count;
 	size_t pull_size;
 };
 
-static int createDBConnection(SLNRepoRef const repo);
+static int createDBConnection(SLNRepoRef const repo, strarg_t const algos);
 static void loadPulls(SLNRepoRef const repo);
 
 static void debug_data(DB_env *const db);
 
-SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name) {
+SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name, strarg_t const algos) {
 	assert(dir);
 	assert(name);
 	SLNRepoRef repo = calloc(1, sizeof(struct SLNRepo));
@@ -66,8 +78,13 @@ SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name) {
 		SLNRepoFree(&repo);
 		return NULL;
 	}
+	repo->query_cache = SLNQueryCacheCreate();
+	if(!repo->query_cache) {
+		SLNRepoFree(&repo);
+		return NULL;
+	}
 
-	int rc = createDBConnection(repo);
+	int rc = createDBConnection(repo, algos);
 	if(rc < 0) {
 		SLNRepoFree(&repo);
 		return NULL;
@@ -78,6 +95,8 @@ SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name) {
 
 	async_mutex_init(repo->sub_mutex, 0);
 	async_cond_init(repo->sub_cond, 0);
+	repo->commit_delay = COMMIT_DELAY;
+	async_mutex_init(repo->commit_mutex, 0);
 	return repo;
 }
 void SLNRepoFree(SLNRepoRef *const repoptr) {
@@ -96,13 +115,19 @@ void SLNRepoFree(SLNRepoRef *const repoptr) {
 
 	repo->pub_mode = 0;
 	repo->reg_mode = 0;
+	repo->hash_algos = 0;
 	SLNSessionCacheFree(&repo->session_cache);
+	SLNQueryCacheFree(&repo->query_cache);
 
 	db_env_close(repo->db); repo->db = NULL;
+	memset(repo->fileIDs, 0, sizeof(repo->fileIDs));
+	memset(repo->metaFileIDs, 0, sizeof(repo->metaFileIDs));
 
 	async_mutex_destroy(repo->sub_mutex);
 	async_cond_destroy(repo->sub_cond);
 	repo->sub_latest = 0;
+	repo->commit_delay = 0;
+	async_mutex_destroy(repo->commit_mutex);
 
 	for(size_t i = 0; i < repo->pull_count; ++i) {
 		SLNPullFree(&repo->pulls[i]);
@@ -156,10 +181,18 @@ SLNMode SLNRepoGetRegistrationMode(SLNRepoRef const repo) {
 	if(!repo) return 0;
 	return repo->reg_mode;
 }
+unsigned SLNRepoGetHashAlgos(SLNRepoRef const repo) {
+	if(!repo) return 0;
+	return repo->hash_algos;
+}
 SLNSessionCacheRef SLNRepoGetSessionCache(SLNRepoRef const repo) {
 	if(!repo) return NULL;
 	return repo->session_cache;
 }
+SLNQueryCacheRef SLNRepoGetQueryCache(SLNRepoRef const repo) {
+	if(!repo) return NULL;
+	return repo->query_cache;
+}
 
 void SLNRepoDBOpen(SLNRepoRef const repo, DB_env **const dbptr) {
 	assert(repo);
@@ -175,8 +208,19 @@ void SLNRepoDBClose(SLNRepoRef const repo, DB_env **const dbptr) {
 	*dbptr = NULL;
 }
 
+DB_ids *SLNRepoGetIDs(SLNRepoRef const repo, dbid_t const table) {
+	assert(repo);
+	switch(table) {
+		case SLNFileByID: return repo->fileIDs;
+		case SLNMetaFileByID: return repo->metaFileIDs;
+		default: assert(!"ID table"); return NULL;
+	}
+}
+
 void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID) {
 	assert(repo);
+	// Invalidate first so that woken listeners don't see stale pages.
+	SLNQueryCacheInvalidate(repo->query_cache);
 	async_mutex_lock(repo->sub_mutex);
 	if(sortID > repo->sub_latest) {
 		repo->sub_latest = sortID;
@@ -196,6 +240,32 @@ int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t const sortID, uint64_t
 	return rc;
 }
 
+uint64_t SLNRepoGetCommitDelay(SLNRepoRef const repo) {
+	if(!repo) return 0;
+	return repo->commit_delay;
+}
+void SLNRepoSetCommitDelay(SLNRepoRef const repo, uint64_t const milliseconds) {
+	assert(repo);
+	repo->commit_delay = milliseconds;
+}
+// Group commit happens per event loop. Leaders from different loops take
+// this lock so that only one of them is assigning IDs at a time.
+void SLNRepoCommitLock(SLNRepoRef const repo) {
+	assert(repo);
+	__sync_fetch_and_add(&repo->commit_pending, 1);
+	async_mutex_lock(repo->commit_mutex);
+}
+void SLNRepoCommitUnlock(SLNRepoRef const repo) {
+	assert(repo);
+	async_mutex_unlock(repo->commit_mutex);
+	__sync_fetch_and_sub(&repo->commit_pending, 1);
+}
+// Long-running readers check this to give up their snapshots.
+bool SLNRepoCommitPending(SLNRepoRef const repo) {
+	if(!repo) return false;
+	return __sync_fetch_and_add(&repo->commit_pending, 0) > 0;
+}
+
 void SLNRepoPullsStart(SLNRepoRef const repo) {
 	if(!repo) return;
 	for(size_t i = 0; i < repo->pull_count; ++i) {
@@ -236,7 +306,137 @@ static int create_admin(SLNRepoRef const repo, DB_txn *const txn) {
 
 	return 0;
 }
-static int createDBConnection(SLNRepoRef const repo) {
+// Older repos stored one key per (term, meta-file, position) and per
+// (field, value, meta-file). Rebuild them as posting lists the first time
+// they're opened. The old keys are left behind because the LevelDB back-end
+// can't delete yet, but nothing reads them anymore.
+// Old terms were all stored at position 0, which new meta-files never use,
+// so phrase queries know to fall back to matching the tokens anywhere.
+static int migrate_terms(DB_txn *const txn) {
+	DB_cursor *cursor = NULL;
+	int rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range postings[1];
+	SLNTermPostingsRange0(postings, txn);
+	rc = db_cursor_firstr(cursor, postings, NULL, NULL, +1);
+	if(DB_NOTFOUND != rc) return rc < 0 ? rc : 0;
+
+	str_t *token = NULL;
+	uint64_t metaFileID = 0;
+	uint64_t *positions = NULL;
+	size_t count = 0;
+	size_t asize = 0;
+	DB_cursor *old = NULL;
+	rc = db_cursor_open(txn, &old);
+	if(rc < 0) goto cleanup;
+
+	DB_range range[1];
+	SLNTermMetaFileIDAndPositionRange0(range, txn);
+	DB_val key[1];
+	rc = db_cursor_firstr(old, range, key, NULL, +1);
+	for(;;) {
+		strarg_t t = NULL;
+		uint64_t m = 0, position = 0;
+		if(rc >= 0) SLNTermMetaFileIDAndPositionKeyUnpack(key, txn, &t, &m, &position);
+		bool const flush = token && (rc < 0 || m != metaFileID || 0 != strcmp(t, token));
+		// Copy the next token before writing, which may move cursor data.
+		str_t *next = NULL;
+		if(rc >= 0 && (!token || flush)) {
+			next = strdup(t);
+			if(!next) { rc = DB_ENOMEM; goto cleanup; }
+		}
+		if(flush) {
+			DB_range dst[1];
+			SLNTermPostingsRange1(dst, txn, token);
+			int const x = db_postings_append(txn, dst, metaFileID, positions, count);
+			if(x < 0) { FREE(&next); rc = x; goto cleanup; }
+			FREE(&token);
+			count = 0;
+		}
+		if(rc < 0) break;
+		if(next) {
+			token = next; next = NULL;
+			metaFileID = m;
+		}
+		if(count >= asize) {
+			asize = MAX(16, asize * 2);
+			uint64_t *const p = realloc(positions, sizeof(uint64_t) * asize);
+			if(!p) { rc = DB_ENOMEM; goto cleanup; }
+			positions = p;
+		}
+		positions[count++] = position;
+		rc = db_cursor_nextr(old, range, key, NULL, +1);
+	}
+	if(DB_NOTFOUND == rc) rc = 0;
+cleanup:
+	db_cursor_close(old); old = NULL;
+	FREE(&token);
+	FREE(&positions);
+	return rc;
+}
+static int migrate_fields(DB_txn *const txn) {
+	DB_cursor *cursor = NULL;
+	int rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range postings[1];
+	SLNFieldValuePostingsRange0(postings, txn);
+	rc = db_cursor_firstr(cursor, postings, NULL, NULL, +1);
+	if(DB_NOTFOUND != rc) return rc < 0 ? rc : 0;
+
+	DB_cursor *old = NULL;
+	rc = db_cursor_open(txn, &old);
+	if(rc < 0) return rc;
+
+	DB_range range[1];
+	SLNFieldValueAndMetaFileIDRange0(range, txn);
+	DB_val key[1];
+	rc = db_cursor_firstr(old, range, key, NULL, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(old, range, key, NULL, +1)) {
+		strarg_t field, value;
+		uint64_t metaFileID;
+		SLNFieldValueAndMetaFileIDKeyUnpack(key, txn, &field, &value, &metaFileID);
+		DB_range dst[1];
+		SLNFieldValuePostingsRange2(dst, txn, field, value);
+		rc = db_postings_append(txn, dst, metaFileID, NULL, 0);
+		if(DB_KEYEXIST == rc) rc = 0;
+		if(rc < 0) break;
+	}
+	if(DB_NOTFOUND == rc) rc = 0;
+	db_cursor_close(old); old = NULL;
+	return rc;
+}
+
+// The hash algorithms are chosen when the repo is created. Repos from
+// before they were configurable get the old default.
+static int load_hash_algos(SLNRepoRef const repo, DB_txn *const txn, strarg_t const algos) {
+	DB_val key[1];
+	SLNConfigByNameKeyPack(key, txn, "hash-algos");
+	DB_val val[1];
+	int rc = db_get(txn, key, val);
+	if(rc >= 0) {
+		strarg_t stored;
+		SLNConfigByNameValUnpack(val, txn, &stored);
+		return SLNHashAlgosParse(stored, &repo->hash_algos);
+	}
+	if(DB_NOTFOUND != rc) return rc;
+
+	DB_cursor *cursor = NULL;
+	rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range files[1];
+	SLNFileByIDRange0(files, txn);
+	rc = db_cursor_firstr(cursor, files, NULL, NULL, +1);
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	strarg_t const list = DB_NOTFOUND == rc && algos ? algos : SLN_HASH_ALGOS_DEFAULT;
+
+	rc = SLNHashAlgosParse(list, &repo->hash_algos);
+	if(rc < 0) return rc;
+	DB_val value[1];
+	SLNConfigByNameValPack(value, txn, list);
+	return db_put(txn, key, value, 0);
+}
+
+static int createDBConnection(SLNRepoRef const repo, strarg_t const algos) {
 	assert(repo);
 	int rc = db_env_create(&repo->db);
 	rc = rc < 0 ? rc : db_env_set_mapsize(repo->db, 1024 * 1024 * 1024 * 1);
@@ -298,6 +498,32 @@ static int createDBConnection(SLNRepoRef const repo) {
 		return rc;
 	}
 
+	rc = db_ids_seed(repo->fileIDs, SLNFileByID, txn);
+	if(rc >= 0) rc = db_ids_seed(repo->metaFileIDs, SLNMetaFileByID, txn);
+	if(rc < 0) {
+		db_txn_abort(txn); txn = NULL;
+		SLNRepoDBClose(repo, &db);
+		fprintf(stderr, "Database ID error (%s)\n", sln_strerror(rc));
+		return rc;
+	}
+
+	rc = load_hash_algos(repo, txn, algos);
+	if(rc < 0) {
+		db_txn_abort(txn); txn = NULL;
+		SLNRepoDBClose(repo, &db);
+		fprintf(stderr, "Database hash algorithm error (%s)\n", sln_strerror(rc));
+		return rc;
+	}
+
+	rc = migrate_terms(txn);
+	if(rc >= 0) rc = migrate_fields(txn);
+	if(rc < 0) {
+		db_txn_abort(txn); txn = NULL;
+		SLNRepoDBClose(repo, &db);
+		fprintf(stderr, "Database migration error (%s)\n", sln_strerror(rc));
+		return rc;
+	}
+
 	rc = db_txn_commit(txn); txn = NULL;
 	SLNRepoDBClose(repo, &db);
 	if(rc < 0) {
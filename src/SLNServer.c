@@ -2,10 +2,12 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <ctype.h>
 #include "common.h"
 #include "StrongLink.h"
 #include "http/HTTPServer.h"
 #include "http/HTTPHeaders.h"
+#include "http/HTTPRouter.h"
 #include "http/MultipartForm.h"
 #include "http/QueryString.h"
 
@@ -63,18 +65,104 @@ bool URIPath(strarg_t const URI, strarg_t const path, strarg_t *const qs) {
 	FREE(&cookie);
 	return 0;
 }*/
-static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
-	int len = 0;
+// Files are immutable, so the content hash makes a strong validator.
+// Only the client's list is parsed; weak tags match for If-None-Match.
+static bool etag_match(strarg_t const list, strarg_t const etag, bool const weak) {
+	if(!list) return false;
+	size_t const elen = strlen(etag);
+	strarg_t p = list;
+	for(;;) {
+		while(' ' == *p || '\t' == *p || ',' == *p) p++;
+		if('\0' == *p) return false;
+		if('*' == *p) return true;
+		bool const isweak = 0 == strncmp(p, "W/", 2);
+		if(isweak) p += 2;
+		strarg_t const tag = p;
+		if('"' == *p) for(p++; '\0' != *p && '"' != *p; p++);
+		if('"' == *p) p++;
+		if((weak || !isweak) && p-tag == elen && 0 == memcmp(tag, etag, elen)) return true;
+		for(; '\0' != *p && ',' != *p; p++);
+	}
+}
+
+#define RANGES_MAX 8
+typedef struct {
+	uint64_t start;
+	uint64_t end; // Inclusive.
+} byte_range_t;
+
+// Returns the number of satisfiable ranges (0 means 416), or -1 if the
+// header should be ignored and the whole file sent.
+static int parse_ranges(strarg_t const str, uint64_t const size, byte_range_t *const ranges, size_t const max) {
+	if(!str) return -1;
+	if(0 != strncasecmp(str, "bytes=", 6)) return -1;
+	strarg_t p = str+6;
+	size_t parsed = 0;
+	int count = 0;
+	for(;;) {
+		while(' ' == *p || '\t' == *p || ',' == *p) p++;
+		if('\0' == *p) break;
+		uint64_t start, end;
+		char *x;
+		if('-' == *p) {
+			if(!isdigit(p[1])) return -1;
+			uint64_t const suffix = strtoull(p+1, &x, 10);
+			p = x;
+			start = suffix >= size ? 0 : size - suffix;
+			end = size - 1;
+			if(!suffix || !size) start = UINT64_MAX; // Unsatisfiable.
+		} else {
+			if(!isdigit(*p)) return -1;
+			start = strtoull(p, &x, 10);
+			p = x;
+			if('-' != *p++) return -1;
+			end = UINT64_MAX;
+			if(isdigit(*p)) {
+				end = strtoull(p, &x, 10);
+				p = x;
+				if(end < start) return -1;
+			}
+			if(end >= size) end = size - 1;
+		}
+		while(' ' == *p || '\t' == *p) p++;
+		if('\0' != *p && ',' != *p) return -1;
+		parsed++;
+		if(start >= size) continue;
+		if(count >= max) return -1;
+		ranges[count].start = start;
+		ranges[count].end = end;
+		count++;
+	}
+	if(!parsed) return -1;
+	return count;
+}
+static int range_part(str_t *const out, size_t const max, strarg_t const boundary, strarg_t const type, byte_range_t const *const range, uint64_t const size) {
+	int const len = snprintf(out, max,
+		"\r\n--%s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Range: bytes %llu-%llu/%llu\r\n"
+		"\r\n",
+		boundary, type,
+		(unsigned long long)range->start,
+		(unsigned long long)range->end,
+		(unsigned long long)size);
+	if(len < 0 || len >= max) return UV_EMSGSIZE;
+	return len;
+}
+
+// Same character sets as SLN_ALGO_FMT and SLN_HASH_FMT.
+#define ALGO_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-"
+#define HASH_CHARS ALGO_CHARS "%_"
+static int match_hash(HTTPRouteMatch const *const match, str_t *const algo, str_t *const hash) {
+	int rc = HTTPRouteParamCopy(match, 0, ALGO_CHARS, algo, SLN_ALGO_SIZE);
+	if(rc < 0) return rc;
+	return HTTPRouteParamCopy(match, 1, HASH_CHARS, hash, SLN_HASH_SIZE);
+}
+
+static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 	str_t algo[SLN_ALGO_SIZE];
 	str_t hash[SLN_HASH_SIZE];
-	algo[0] = '\0';
-	hash[0] = '\0';
-	sscanf(URI, "/sln/file/" SLN_ALGO_FMT "/" SLN_HASH_FMT "%n", algo, hash, &len);
-	if(!algo[0] || !hash[0]) return -1;
-	if('\0' != URI[len] && '?' != URI[len]) return -1;
-
-	// TODO: Check for conditional get headers and return 304 Not Modified.
+	if(match_hash(match, algo, hash) < 0) return 400; // Bad Request
 
 	str_t fileURI[SLN_URI_MAX];
 	int rc = snprintf(fileURI, sizeof(fileURI), "hash://%s/%s", algo, hash);
@@ -86,6 +174,42 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	if(DB_NOTFOUND == rc) return 404;
 	if(rc < 0) return 500;
 
+	str_t etag[1+SLN_HASH_SIZE+1];
+	rc = snprintf(etag, sizeof(etag), "\"%s\"", hash);
+	if(rc < 0 || rc >= sizeof(etag)) {
+		SLNFileInfoCleanup(info);
+		return 500;
+	}
+
+	if(etag_match(HTTPHeadersGet(headers, "If-None-Match"), etag, true)) {
+		HTTPConnectionWriteResponse(conn, 304, "Not Modified");
+		HTTPConnectionWriteHeader(conn, "ETag", etag);
+		HTTPConnectionWriteHeader(conn, "Cache-Control", "max-age=31536000");
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		SLNFileInfoCleanup(info);
+		return 0;
+	}
+
+	byte_range_t ranges[RANGES_MAX];
+	int nranges = -1;
+	strarg_t const ifrange = HTTPHeadersGet(headers, "If-Range");
+	if(!ifrange || etag_match(ifrange, etag, false)) {
+		nranges = parse_ranges(HTTPHeadersGet(headers, "Range"), info->size, ranges, numberof(ranges));
+	}
+
+	str_t crange[64];
+	if(0 == nranges) {
+		snprintf(crange, sizeof(crange), "bytes */%llu", (unsigned long long)info->size);
+		HTTPConnectionWriteResponse(conn, 416, "Requested Range Not Satisfiable");
+		HTTPConnectionWriteHeader(conn, "Content-Range", crange);
+		HTTPConnectionWriteContentLength(conn, 0);
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		SLNFileInfoCleanup(info);
+		return 0;
+	}
+
 	uv_file file = async_fs_open(info->path, O_RDONLY, 0000);
 	if(UV_ENOENT == file) {
 		SLNFileInfoCleanup(info);
@@ -110,20 +234,78 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	// TODO: Use Content-Disposition to suggest a filename, for file types
 	// that aren't useful to view inline.
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
-	HTTPConnectionWriteContentLength(conn, info->size);
-	HTTPConnectionWriteHeader(conn, "Content-Type", info->type);
+	// Multipart boundaries must not occur in the content. The hash of
+	// the file itself is a safe bet. We use the internal hash because
+	// it's always hex, whereas the requested one might contain `%`,
+	// which isn't allowed in a boundary.
+	str_t boundary[64];
+	str_t type[100];
+	str_t part[64+255+128];
+	if(nranges > 1) {
+		snprintf(boundary, sizeof(boundary), "sln-%.59s", info->hash);
+		snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s", boundary);
+	}
+
+	uint64_t length = info->size;
+	if(1 == nranges) {
+		length = ranges[0].end - ranges[0].start + 1;
+		snprintf(crange, sizeof(crange), "bytes %llu-%llu/%llu",
+			(unsigned long long)ranges[0].start,
+			(unsigned long long)ranges[0].end,
+			(unsigned long long)info->size);
+	} else if(nranges > 1) {
+		length = 0;
+		for(size_t i = 0; i < nranges; i++) {
+			rc = range_part(part, sizeof(part), boundary, info->type, &ranges[i], info->size);
+			if(rc < 0) {
+				SLNFileInfoCleanup(info);
+				async_fs_close(file);
+				return 500;
+			}
+			length += rc + ranges[i].end - ranges[i].start + 1;
+		}
+		length += sizeof("\r\n--")-1 + strlen(boundary) + sizeof("--\r\n")-1;
+	}
+
+	if(nranges > 0) {
+		HTTPConnectionWriteResponse(conn, 206, "Partial Content");
+	} else {
+		HTTPConnectionWriteResponse(conn, 200, "OK");
+	}
+	HTTPConnectionWriteContentLength(conn, length);
+	if(nranges > 1) {
+		HTTPConnectionWriteHeader(conn, "Content-Type", type);
+	} else {
+		HTTPConnectionWriteHeader(conn, "Content-Type", info->type);
+	}
+	if(1 == nranges) {
+		HTTPConnectionWriteHeader(conn, "Content-Range", crange);
+	}
 	HTTPConnectionWriteHeader(conn, "Cache-Control", "max-age=31536000");
-	HTTPConnectionWriteHeader(conn, "ETag", "1");
-//	HTTPConnectionWriteHeader(conn, "Accept-Ranges", "bytes"); // TODO
+	HTTPConnectionWriteHeader(conn, "ETag", etag);
+	HTTPConnectionWriteHeader(conn, "Accept-Ranges", "bytes");
 	HTTPConnectionWriteHeader(conn, "Content-Security-Policy", "'none'");
 	HTTPConnectionWriteHeader(conn, "X-Content-Type-Options", "nosniff");
-//	HTTPConnectionWriteHeader(conn, "Vary", "Accept, Accept-Ranges");
-	// TODO: Double check Vary header syntax.
-	// Also do we need to change the ETag?
 	HTTPConnectionBeginBody(conn);
 	if(HTTP_HEAD != method) {
-		HTTPConnectionWriteFile(conn, file);
+		if(nranges < 0) {
+			HTTPConnectionSendfile(conn, file, 0, info->size);
+		} else if(1 == nranges) {
+			HTTPConnectionSendfile(conn, file, ranges[0].start, length);
+		} else for(size_t i = 0; i < nranges; i++) {
+			rc = range_part(part, sizeof(part), boundary, info->type, &ranges[i], info->size);
+			if(rc >= 0) rc = HTTPConnectionWrite(conn, (byte_t const *)part, rc);
+			if(rc < 0) break;
+			rc = HTTPConnectionSendfile(conn, file, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+			if(rc < 0) break;
+			if(i+1 < nranges) continue;
+			uv_buf_t const end[] = {
+				uv_buf_init((char *)STR_LEN("\r\n--")),
+				uv_buf_init(boundary, strlen(boundary)),
+				uv_buf_init((char *)STR_LEN("--\r\n")),
+			};
+			HTTPConnectionWritev(conn, end, numberof(end));
+		}
 	}
 	HTTPConnectionEnd(conn);
 
@@ -131,32 +313,18 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	async_fs_close(file);
 	return 0;
 }
-static int GET_meta(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	// TODO: This is pretty much copy and pasted from above.
-	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
-	int len = 0;
+static int GET_meta(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 	str_t algo[SLN_ALGO_SIZE];
 	str_t hash[SLN_HASH_SIZE];
-	algo[0] = '\0';
-	hash[0] = '\0';
-	sscanf(URI, "/sln/meta/" SLN_ALGO_FMT "/" SLN_HASH_FMT "%n", algo, hash, &len);
-	if(!algo[0] || !hash[0]) return -1;
-	if('\0' != URI[len] && '?' != URI[len]) return -1;
+	if(match_hash(match, algo, hash) < 0) return 400; // Bad Request
 
 	// TODO
 	return 501; // Not Implemented
 }
-static int GET_alts(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	// TODO: This is pretty much copy and pasted from above.
-	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
-	int len = 0;
+static int GET_alts(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 	str_t algo[SLN_ALGO_SIZE];
 	str_t hash[SLN_HASH_SIZE];
-	algo[0] = '\0';
-	hash[0] = '\0';
-	sscanf(URI, "/sln/alts/" SLN_ALGO_FMT "/" SLN_HASH_FMT "%n", algo, hash, &len);
-	if(!algo[0] || !hash[0]) return -1;
-	if('\0' != URI[len] && '?' != URI[len]) return -1;
+	if(match_hash(match, algo, hash) < 0) return 400; // Bad Request
 
 	// TODO
 	return 501; // Not Implemented
@@ -203,31 +371,23 @@ cleanup:
 	if(rc < 0) return 500;
 	return 0;
 }
-static int POST_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_POST != method) return -1;
-	int len = 0;
-	sscanf(URI, "/sln/file%n", &len);
-	if(!len) return -1;
-	if('\0' != URI[len] && '?' != URI[len]) return -1;
-
+static int POST_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 	return accept_sub(session, NULL, conn, headers);
 }
-static int PUT_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	// TODO: This is pretty much copy and pasted from above.
-	if(HTTP_PUT != method) return -1;
-	int len = 0;
+static int PUT_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 	str_t algo[SLN_ALGO_SIZE];
 	str_t hash[SLN_HASH_SIZE];
-	algo[0] = '\0';
-	hash[0] = '\0';
-	sscanf(URI, "/sln/file/" SLN_ALGO_FMT "/" SLN_HASH_FMT "%n", algo, hash, &len);
-	if(!algo[0] || !hash[0]) return -1;
-	if('\0' != URI[len] && '?' != URI[len]) return -1;
+	if(match_hash(match, algo, hash) < 0) return 400; // Bad Request
 
 	str_t *knownURI = SLNFormatURI(algo, hash);
 	if(!knownURI) return 500;
 
 	int rc = SLNSessionGetFileInfo(session, knownURI, NULL);
+	if(DB_NOTFOUND == rc && !SLNHashAlgoFromName(algo, strlen(algo))) {
+		// We can't verify a hash we don't support.
+		FREE(&knownURI);
+		return 400;
+	}
 	if(DB_NOTFOUND == rc) {
 		rc = accept_sub(session, knownURI, conn, headers);
 		FREE(&knownURI);
@@ -244,11 +404,137 @@ cleanup:
 	return 0;
 }
 
-static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter, strarg_t const qs, bool const meta, HTTPConnectionRef const conn) {
+// Small files are copied into the output buffer so that a batch full
+// of meta-files goes out in a few large writes.
+#define BATCH_INLINE_MAX (1024 * 8)
+
+static int send_frame(SLNSessionRef const session, strarg_t const URI, byte_t *const buf, HTTPConnectionRef const conn) {
+	SLNFileInfo info[1] = {};
+	uv_file file = -1;
+	int status = 200;
+	int rc = SLNSessionGetFileInfo(session, URI, info);
+	if(DB_EACCES == rc) status = 403;
+	else if(DB_NOTFOUND == rc) status = 404;
+	else if(rc < 0) status = 500;
+	if(200 == status) {
+		file = async_fs_open(info->path, O_RDONLY, 0000);
+		if(UV_ENOENT == file) status = 410; // Gone
+		else if(file < 0) status = 500;
+	}
+
+	uint64_t const size = 200 == status ? info->size : 0;
+	str_t *head = 200 == status ?
+		aasprintf("%s %d %llu %s\n", URI, status, (unsigned long long)size, info->type) :
+		aasprintf("%s %d\n", URI, status);
+	if(!head) {
+		rc = UV_ENOMEM;
+		goto cleanup;
+	}
+	rc = 0;
+
+	size_t const len = strlen(head);
+	rc = rc < 0 ? rc : HTTPConnectionWriteChunkLength(conn, len + size);
+	rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)head, len);
+	if(size && size <= BATCH_INLINE_MAX) {
+		uv_buf_t const part = uv_buf_init((char *)buf, size);
+		ssize_t const x = rc < 0 ? rc : async_fs_readall_simple(file, &part);
+		if(x >= 0 && x < size) rc = UV_EOF; // File was truncated.
+		else if(x < 0) rc = (int)x;
+		rc = rc < 0 ? rc : HTTPConnectionWrite(conn, buf, size);
+	} else if(size) {
+		rc = rc < 0 ? rc : HTTPConnectionSendfile(conn, file, 0, size);
+	}
+	rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)STR_LEN("\r\n"));
+
+cleanup:
+	FREE(&head);
+	if(file >= 0) async_fs_close(file);
+	SLNFileInfoCleanup(info);
+	return rc;
+}
+static int POST_batch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return 403;
+
+	// Request body is a text/uri-list.
+	str_t *URIs[SLN_BATCH_MAX] = {};
+	size_t count = 0;
+	byte_t *buf = NULL;
+	int status = 0;
+	int rc;
+	for(;;) {
+		str_t line[URI_MAX];
+		rc = HTTPConnectionReadBodyLine(conn, line, sizeof(line));
+		if(UV_EOF == rc) break;
+		if(rc < 0) {
+			status = 400;
+			goto cleanup;
+		}
+		if('\0' == line[0] || '#' == line[0]) continue;
+		if(count >= numberof(URIs)) {
+			status = 413; // Request Entity Too Large
+			continue;
+		}
+		URIs[count] = strdup(line);
+		if(!URIs[count]) status = 500;
+		count++;
+	}
+	if(status) goto cleanup;
+
+	buf = malloc(BATCH_INLINE_MAX);
+	if(!buf) {
+		status = 500;
+		goto cleanup;
+	}
+
+	HTTPConnectionWriteResponse(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn, "Content-Type", SLN_BATCH_TYPE);
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionBeginBody(conn);
+	for(size_t i = 0; i < count; i++) {
+		rc = send_frame(session, URIs[i], buf, conn);
+		if(rc < 0) break;
+	}
+	if(rc < 0) {
+		// We've already promised more data than we can send, so the
+		// client can't use this response or connection any more.
+		fprintf(stderr, "Batch response error %s\n", sln_strerror(rc));
+		HTTPConnectionAbort(conn);
+	} else {
+		HTTPConnectionWriteChunkEnd(conn);
+		HTTPConnectionEnd(conn);
+	}
+
+cleanup:
+	for(size_t i = 0; i < count; i++) FREE(&URIs[i]);
+	FREE(&buf);
+	return status;
+}
+
+// Only an explicit media type counts, since records aren't a URI list
+// that other clients could make sense of.
+static bool accepts_records(strarg_t const accept) {
+	if(!accept) return false;
+	strarg_t pos = accept;
+	for(;;) {
+		pos += strspn(pos, " \t,");
+		if('\0' == *pos) return false;
+		size_t const len = strcspn(pos, " \t,;");
+		if(len == sizeof(SLN_URI_RECORDS_TYPE)-1 &&
+			0 == strncasecmp(pos, SLN_URI_RECORDS_TYPE, len)) return true;
+		pos += len;
+		pos += strcspn(pos, ",");
+	}
+}
+static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter, strarg_t const qs, bool const meta, HTTPConnectionRef const conn, HTTPHeadersRef const headers) {
 	SLNFilterPosition pos[1] = {{ .dir = +1 }};
 	uint64_t count = UINT64_MAX;
 	bool wait = true;
 	SLNFilterParseOptions(qs, pos, &count, NULL, &wait);
+	int format = meta ? SLN_URI_LIST_META : SLN_URI_LIST_TEXT;
+	if(!meta && accepts_records(HTTPHeadersGet(headers, "Accept"))) {
+		format = SLN_URI_LIST_RECORDS;
+	}
 
 	// I'm aware that we're abusing HTTP for sending real-time push data.
 	// I'd also like to support WebSocket at some point, but this is simpler
@@ -259,13 +545,19 @@ static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter,
 	// such proxies still exist in 2015.
 	HTTPConnectionWriteResponse(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
-	HTTPConnectionWriteHeader(conn,
-		"Content-Type", "text/uri-list; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Content-Type",
+		SLN_URI_LIST_RECORDS == format ? SLN_URI_RECORDS_TYPE :
+		"text/uri-list; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
-	HTTPConnectionWriteHeader(conn, "Vary", "*");
+	// URI lists are very repetitive, so they compress well. This also
+	// sends the only Vary header; since the response isn't stored, it
+	// doesn't need `Vary: *` on top.
+	HTTPConnectionWriteContentEncoding(conn, HTTPHeadersGet(headers, "Accept-Encoding"));
 	HTTPConnectionBeginBody(conn);
+	// Long-polling clients shouldn't wait for the headers.
+	if(wait) HTTPConnectionFlush(conn);
 
-	int rc = SLNFilterWriteURIs(filter, session, pos, meta, count, wait, (SLNFilterWriteCB)HTTPConnectionWriteChunkv, conn);
+	int rc = SLNFilterWriteURIs(filter, session, pos, format, count, wait, (SLNFilterWriteCB)HTTPConnectionWriteChunkv, conn);
 	if(rc < 0) {
 		fprintf(stderr, "Query response error %s\n", sln_strerror(rc));
 	}
@@ -296,10 +588,8 @@ static int parseFilter(SLNSessionRef const session, HTTPConnectionRef const conn
 	if(!*out) return DB_ENOMEM;
 	return 0;
 }
-static int GET_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
-	strarg_t qs;
-	if(!URIPath(URI, "/sln/query", &qs)) return -1;
+static int GET_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	strarg_t const qs = match->qs;
 
 	SLNFilterRef filter = NULL;
 	int rc;
@@ -313,64 +603,178 @@ static int GET_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPCon
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
 
-	sendURIList(session, filter, qs, false, conn);
+	sendURIList(session, filter, qs, false, conn, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
-static int POST_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_POST != method) return -1;
-	strarg_t qs;
-	if(!URIPath(URI, "/sln/query", &qs)) return -1;
+static int POST_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	strarg_t const qs = match->qs;
 
 	SLNFilterRef filter;
 	int rc = parseFilter(session, conn, method, headers, &filter);
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, false, conn);
+	sendURIList(session, filter, qs, false, conn, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
-static int GET_metafiles(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method) return -1;
-	strarg_t qs;
-	if(!URIPath(URI, "/sln/metafiles", &qs)) return -1;
+static int GET_metafiles(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	strarg_t const qs = match->qs;
 
 	SLNFilterRef filter;
 	int rc = SLNFilterCreate(session, SLNMetaFileFilterType, &filter);
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, true, conn);
+	sendURIList(session, filter, qs, true, conn, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
-static int GET_all(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method) return -1;
-	strarg_t qs;
-	if(!URIPath(URI, "/sln/all", &qs)) return -1;
+static int GET_all(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	strarg_t const qs = match->qs;
 
 	SLNFilterRef filter;
 	int rc = SLNFilterCreate(session, SLNAllFilterType, &filter);
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, false, conn);
+	sendURIList(session, filter, qs, false, conn, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
 
 
+// Server-Sent Events. URIs arrive as (URI, CRLF) pairs, and a lone CRLF
+// is a keep-alive, which we send as a comment.
+static int write_events(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count) {
+	if(count < 2) {
+		uv_buf_t const ping[] = { uv_buf_init((char *)STR_LEN(":\n\n")) };
+		return HTTPConnectionWriteChunkv(conn, ping, numberof(ping));
+	}
+	static str_t const id[] = "id: ";
+	static str_t const data[] = "\ndata: ";
+	static str_t const end[] = "\n\n";
+	size_t len = 0;
+	for(size_t i = 0; i+1 < count; i += 2) {
+		len += sizeof(id)-1 + sizeof(data)-1 + sizeof(end)-1 + parts[i].len*2;
+	}
+	str_t *const buf = malloc(len);
+	if(!buf) return UV_ENOMEM;
+	str_t *pos = buf;
+	for(size_t i = 0; i+1 < count; i += 2) {
+		uv_buf_t const *const URI = &parts[i];
+		memcpy(pos, id, sizeof(id)-1); pos += sizeof(id)-1;
+		memcpy(pos, URI->base, URI->len); pos += URI->len;
+		memcpy(pos, data, sizeof(data)-1); pos += sizeof(data)-1;
+		memcpy(pos, URI->base, URI->len); pos += URI->len;
+		memcpy(pos, end, sizeof(end)-1); pos += sizeof(end)-1;
+	}
+	uv_buf_t const events[] = { uv_buf_init(buf, len) };
+	int rc = HTTPConnectionWriteChunkv(conn, events, numberof(events));
+	free(buf);
+	return rc;
+}
+static int GET_subscribe(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	strarg_t const qs = match->qs;
+
+	SLNFilterRef filter = NULL;
+	int rc;
+
+	static strarg_t const fields[] = { "q" };
+	str_t *values[numberof(fields)] = {};
+	QSValuesParse(qs, values, fields, numberof(fields));
+	rc = SLNUserFilterParse(session, values[0], &filter);
+	QSValuesCleanup(values, numberof(values));
+	if(DB_EINVAL == rc) rc = SLNFilterCreate(session, SLNVisibleFilterType, &filter);
+	if(DB_EACCES == rc) return 403;
+	if(rc < 0) return 500;
+
+	SLNFilterPosition pos[1] = {{ .dir = +1 }};
+	uint64_t count = UINT64_MAX;
+	SLNFilterParseOptions(qs, pos, &count, NULL, NULL);
+	// EventSource sends the last ID it saw when it reconnects.
+	strarg_t const last = HTTPHeadersGet(headers, "Last-Event-ID");
+	if(last && '\0' != last[0] && !pos->URI && pos->dir > 0) {
+		pos->URI = strdup(last);
+		if(!pos->URI) rc = 500;
+	}
+	if(rc >= 0 && pos->dir < 0) rc = 400; // Only new files can be pushed.
+	if(rc > 0) {
+		SLNFilterPositionCleanup(pos);
+		SLNFilterFree(&filter);
+		return rc;
+	}
+
+	// Subscribers watching the same query share a single evaluation of
+	// it per commit (see SLNFilterWriteURIs).
+	HTTPConnectionWriteResponse(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn, "Content-Type", "text/event-stream");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionWriteHeader(conn, "Vary", "*");
+	HTTPConnectionBeginBody(conn);
+	HTTPConnectionFlush(conn);
+
+	rc = SLNFilterWriteURIs(filter, session, pos, SLN_URI_LIST_TEXT, count, true, (SLNFilterWriteCB)write_events, conn);
+	if(rc < 0) {
+		fprintf(stderr, "Subscription error %s\n", sln_strerror(rc));
+	}
+
+	HTTPConnectionWriteChunkEnd(conn);
+	HTTPConnectionEnd(conn);
+	SLNFilterPositionCleanup(pos);
+	SLNFilterFree(&filter);
+	return 0;
+}
+
+#define GET HTTP_ROUTE_METHOD(HTTP_GET)
+#define HEAD HTTP_ROUTE_METHOD(HTTP_HEAD)
+#define POST HTTP_ROUTE_METHOD(HTTP_POST)
+#define PUT HTTP_ROUTE_METHOD(HTTP_PUT)
+typedef int (*SLNRouteHandler)(SLNRepoRef const, SLNSessionRef const, HTTPConnectionRef const, HTTPMethod const, HTTPRouteMatch const *const, HTTPHeadersRef const);
+static HTTPRoute const routes[] = {
+//	{ POST, "/sln/auth" },
+	{ GET | HEAD, "/sln/file/*/*" },
+	{ GET | HEAD, "/sln/meta/*/*" },
+	{ GET | HEAD, "/sln/alts/*/*" },
+	{ POST, "/sln/file" },
+	{ PUT, "/sln/file/*/*" },
+	{ GET | HEAD, "/sln/query" },
+	{ POST, "/sln/query" },
+	{ GET, "/sln/metafiles" },
+	{ GET, "/sln/all" },
+	{ GET, "/sln/subscribe" },
+	{ POST, "/sln/batch" },
+};
+static SLNRouteHandler const handlers[numberof(routes)] = {
+//	POST_auth,
+	GET_file,
+	GET_meta,
+	GET_alts,
+	POST_file,
+	PUT_file,
+	GET_query,
+	POST_query,
+	GET_metafiles,
+	GET_all,
+	GET_subscribe,
+	POST_batch,
+};
+#undef GET
+#undef HEAD
+#undef POST
+#undef PUT
+
+static HTTPRouterRef router = NULL;
+static uv_once_t router_once = UV_ONCE_INIT;
+static void router_init(void) {
+	int rc = HTTPRouterCreate(routes, numberof(routes), &router);
+	assertf(rc >= 0, "Invalid route table: %s", uv_strerror(rc));
+}
+
 int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	int rc = -1;
-//	rc = rc >= 0 ? rc : POST_auth(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_file(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_meta(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_alts(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : POST_file(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : PUT_file(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_query(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : POST_query(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_metafiles(repo, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_all(repo, session, conn, method, URI, headers);
-	if(rc >= 0) return rc;
+	uv_once(&router_once, router_init);
+	HTTPRouteMatch match[1];
+	int rc = HTTPRouterMatch(router, method, URI, match);
+	if(rc >= 0) return handlers[match->route](repo, session, conn, method, match, headers);
 
 	// We "own" the /sln prefix.
 	// Any other paths within it are invalid.
@@ -60,14 +60,14 @@ SLNSessionRef SLNSessionCreateInternal(SLNSessionCacheRef const cache, uint64_t
 SLNSessionRef SLNSessionRetain(SLNSessionRef const session) {
 	if(!session) return NULL;
 	assert(session->refcount);
-	session->refcount++;
+	__sync_fetch_and_add(&session->refcount, 1);
 	return session;
 }
 void SLNSessionRelease(SLNSessionRef *const sessionptr) {
 	SLNSessionRef session = *sessionptr;
 	if(!session) return;
 	assert(session->refcount);
-	if(--session->refcount) {
+	if(__sync_sub_and_fetch(&session->refcount, 1)) {
 		*sessionptr = NULL;
 		return;
 	}
@@ -110,19 +110,23 @@ static void session_cache(SLNSessionCacheRef const cache, SLNSessionRef const se
 	uint64_t const id = SLNSessionGetID(session);
 	uint16_t const pos = session_pos(cache, id);
 	uint16_t i = pos;
+	SLNSessionRef old = NULL;
+	async_mutex_lock(cache->lock);
 //	for(; i < pos+SEARCH_DIST; i++) {
 		uint16_t const x = i % cache->size;
-		if(id == cache->ids[x]) return;
+		if(id == cache->ids[x]) goto cleanup;
 //		if(0 != cache->ids[x]) continue; // TODO: Hack to work without session expiration.
 		cache->ids[x] = id;
-		SLNSessionRelease(&cache->sessions[x]);
+		old = cache->sessions[x];
 		cache->sessions[x] = SLNSessionRetain(session);
 		cache->active[cache->pos] = x;
 		cache->timeouts[cache->pos] = uv_now(async_loop) + EXPIRE_TIMEOUT;
 //		cache->pos++; // TODO: Is this a ring buffer?
 		// TODO: Start timer if necessary.
-		return;
 //	}
+cleanup:
+	async_mutex_unlock(cache->lock);
+	SLNSessionRelease(&old);
 }
 
 
@@ -238,16 +242,23 @@ static int cookie_parse(strarg_t const cookie, uint64_t *const sessionID, byte_t
 }
 static int session_lookup(SLNSessionCacheRef const cache, uint64_t const id, byte_t const key[SESSION_KEY_LEN], SLNSessionRef *const out) {
 	uint16_t const pos = session_pos(cache, id);
-	// TODO: Locking (not really necessary but just good practice).
+	int rc = DB_NOTFOUND;
+	// Sessions are shared between event loops.
+	async_mutex_lock(cache->lock);
 	for(uint16_t i = pos; i < pos+SEARCH_DIST; i++) {
 		uint16_t const x = i % cache->size;
 		if(id != cache->ids[x]) continue;
 		SLNSessionRef const s = cache->sessions[x];
-		if(0 != SLNSessionKeyCmp(s, key)) return DB_EACCES;
+		if(0 != SLNSessionKeyCmp(s, key)) {
+			rc = DB_EACCES;
+			break;
+		}
 		*out = SLNSessionRetain(s);
-		return 0;
+		rc = 0;
+		break;
 	}
-	return DB_NOTFOUND;
+	async_mutex_unlock(cache->lock);
+	return rc;
 }
 static int session_load(SLNSessionCacheRef const cache, uint64_t const id, byte_t const *const key, SLNSessionRef *const out) {
 	SLNRepoRef const repo = cache->repo;
@@ -17,14 +17,13 @@ struct SLNSubmission {
 	uint64_t size;
 
 	SLNHasherRef hasher;
+	SLNMetaFileRef meta;
 	uint64_t metaFileID;
 
 	str_t **URIs;
 	str_t *internalHash;
 };
 
-int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, DB_txn *const txn, uint64_t *const out);
-
 int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, strarg_t const type, SLNSubmissionRef *const out) {
 	assert(out);
 	if(!SLNSessionHasPermission(session, SLN_WRONLY)) return UV_EACCES;
@@ -51,10 +50,22 @@ int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, st
 	if(rc < 0) goto cleanup;
 	sub->tmpfile = rc;
 
-	sub->hasher = SLNHasherCreate(sub->type);
+	// Also compute the known URI's algorithm, if we have it, so that it
+	// can be verified even if the repo doesn't normally index it. Its URIs
+	// are dropped again after verification (see prune).
+	unsigned algos = SLNRepoGetHashAlgos(SLNSessionGetRepo(session));
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	if(knownURI && SLNParseURI(knownURI, algo, hash) >= 0) {
+		algos |= SLNHashAlgoFromName(algo, strlen(algo));
+	}
+	sub->hasher = SLNHasherCreate(sub->type, algos);
 	if(!sub->hasher) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
 
+	rc = SLNMetaFileCreate(sub->type, &sub->meta);
+	if(rc < 0) goto cleanup;
+
 	sub->metaFileID = 0;
 
 	*out = sub; sub = NULL;
@@ -85,6 +96,7 @@ void SLNSubmissionFree(SLNSubmissionRef *const subptr) {
 	sub->size = 0;
 
 	SLNHasherFree(&sub->hasher);
+	SLNMetaFileFree(&sub->meta);
 	sub->metaFileID = 0;
 
 	if(sub->URIs) for(size_t i = 0; sub->URIs[i]; ++i) FREE(&sub->URIs[i]);
@@ -112,17 +124,27 @@ int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size
 	if(!sub) return 0;
 	assert(sub->tmpfile >= 0);
 
+	// Hashing happens in the background and is only waited on when its
+	// buffer comes around again (or at the end), so it overlaps with this
+	// write and with receiving the next chunk.
+	int rc = SLNHasherWrite(sub->hasher, buf, len);
+	if(rc < 0) return rc;
+
 	uv_buf_t parts[] = { uv_buf_init((char *)buf, len) };
-	int rc = async_fs_writeall(sub->tmpfile, parts, numberof(parts), -1);
+	rc = async_fs_writeall(sub->tmpfile, parts, numberof(parts), -1);
 	if(rc < 0) {
 		fprintf(stderr, "SLNSubmission write error %s\n", sln_strerror(rc));
 		return rc;
 	}
 
 	sub->size += len;
-	SLNHasherWrite(sub->hasher, buf, len);
+	SLNMetaFileWrite(sub->meta, buf, len);
 	return 0;
 }
+int SLNSubmissionWait(SLNSubmissionRef const sub) {
+	if(!sub) return 0;
+	return SLNHasherWait(sub->hasher);
+}
 static int verify(SLNSubmissionRef const sub) {
 	assert(sub->URIs);
 	if(!sub->knownURI) return 0;
@@ -130,60 +152,166 @@ static int verify(SLNSubmissionRef const sub) {
 		// Note: this comparison assumes knownURI is normalized.
 		if(0 == strcmp(sub->knownURI, sub->URIs[i])) return 0;
 	}
-	// TODO: In the event where we do not have the hash algorithm
-	// available, we should probably pass verification, although
-	// it's a little questionable.
+	// Note: if we don't have the algorithm, we can't verify it, so
+	// it's treated as a mismatch. SLNServer rejects those early.
 	return SLN_HASHMISMATCH;
 }
+// Only the repo's own algorithms get indexed.
+static void prune(SLNSubmissionRef const sub) {
+	unsigned const algos = SLNRepoGetHashAlgos(SLNSubmissionGetRepo(sub));
+	size_t n = 0;
+	for(size_t i = 0; sub->URIs[i]; i++) {
+		str_t algo[SLN_ALGO_SIZE];
+		str_t hash[SLN_HASH_SIZE];
+		int const rc = SLNParseURI(sub->URIs[i], algo, hash);
+		if(rc >= 0 && !(algos & SLNHashAlgoFromName(algo, strlen(algo)))) {
+			FREE(&sub->URIs[i]);
+			continue;
+		}
+		sub->URIs[n++] = sub->URIs[i];
+	}
+	sub->URIs[n] = NULL;
+}
 int SLNSubmissionEnd(SLNSubmissionRef const sub) {
+	if(!sub) return 0;
+	int rc = SLNSubmissionEndNoSync(sub);
+	if(rc >= 0) rc = SLNSubmissionSyncBatch(&sub, 1);
+	if(rc < 0 && sub->tmppath) {
+		async_fs_unlink(sub->tmppath);
+		FREE(&sub->tmppath);
+	}
+	return rc;
+}
+int SLNSubmissionEndNoSync(SLNSubmissionRef const sub) {
 	if(!sub) return 0;
 	if(sub->size <= 0) return UV_EINVAL;
 	assert(sub->tmppath);
 	assert(sub->tmpfile >= 0);
 
 	sub->URIs = SLNHasherEnd(sub->hasher);
-	sub->internalHash = strdup(SLNHasherGetInternalHash(sub->hasher));
+	strarg_t const internalHash = SLNHasherGetInternalHash(sub->hasher);
+	if(sub->URIs && internalHash) sub->internalHash = strdup(internalHash);
 	SLNHasherFree(&sub->hasher);
 	if(!sub->URIs || !sub->internalHash) return UV_ENOMEM;
+	SLNMetaFileEnd(sub->meta);
 
-	SLNRepoRef const repo = SLNSubmissionGetRepo(sub);
-	str_t *internalPath = NULL;
-	bool worker = false;
-	int rc = 0;
-
-	rc = verify(sub);
-	if(rc < 0) goto cleanup;
-
-	internalPath = SLNRepoCopyInternalPath(repo, sub->internalHash);
-	if(!internalPath) rc = UV_ENOMEM;
-	if(rc < 0) goto cleanup;
+	int rc = verify(sub);
+	if(rc < 0) return rc;
+	prune(sub);
+	return 0;
+}
 
-	async_pool_enter(NULL); worker = true;
+// Number of fibers issuing fdatasync(2) at once in SLNSubmissionSyncBatch.
+#define SYNC_FIBERS 8
 
-	rc = async_fs_fdatasync(sub->tmpfile);
-	if(rc < 0) goto cleanup;
+typedef struct {
+	SLNSubmissionRef const *list;
+	size_t count;
+	size_t offset;
+	int rc;
+	async_sem_t *done;
+} sync_slice;
+static void sync_files(sync_slice *const slice) {
+	async_pool_enter(NULL);
+	for(size_t i = slice->offset; i < slice->count; i += SYNC_FIBERS) {
+		SLNSubmissionRef const sub = slice->list[i];
+		if(!sub || !sub->tmppath) continue;
+		int rc = async_fs_fdatasync(sub->tmpfile);
+		if(rc < 0) {
+			slice->rc = rc;
+			break;
+		}
+	}
+	async_pool_leave(NULL);
+	async_sem_post(slice->done);
+}
+// Links the file into place, but leaves syncing its directory to the
+// caller. Each directory that needs it is kept in `dirs` by hash prefix.
+static int link_file(SLNSubmissionRef const sub, str_t *dirs[]) {
+	SLNRepoRef const repo = SLNSubmissionGetRepo(sub);
+	str_t *internalPath = SLNRepoCopyInternalPath(repo, sub->internalHash);
+	if(!internalPath) return UV_ENOMEM;
 
 	// We use link(2) rather than rename(2) because link gives an error
 	// if there's a name collision, rather than overwriting. We want to
 	// keep the oldest file for any given hash, rather than the newest.
-	rc = async_fs_link_mkdirp(sub->tmppath, internalPath);
-	if(UV_EEXIST == rc) {
-		rc = 0;
-		goto cleanup;
-	}
+	// The file might have been linked by an earlier attempt at this
+	// batch that failed to sync, so its directory still gets synced.
+	int rc = async_fs_link_mkdirp(sub->tmppath, internalPath);
+	if(UV_EEXIST == rc) rc = 0;
 	if(rc < 0) {
 		fprintf(stderr, "SLNSubmission couldn't move '%s' to '%s' (%s)\n", sub->tmppath, internalPath, sln_strerror(rc));
 		goto cleanup;
 	}
 
-	rc = async_fs_sync_dirname(internalPath);
+	// Files are spread over 256 directories by hash prefix, so a big
+	// batch only needs to sync each of them once.
+	str_t prefix[3] = {};
+	memcpy(prefix, sub->internalHash, MIN(strlen(sub->internalHash), 2));
+	unsigned long const dir = strtoul(prefix, NULL, 16);
+	if(dir >= 0x100) {
+		rc = async_fs_sync_dirname(internalPath);
+	} else if(!dirs[dir]) {
+		dirs[dir] = internalPath; internalPath = NULL;
+	}
 
 cleanup:
-	if(worker) { async_pool_leave(NULL); worker = false; }
 	FREE(&internalPath);
+	return rc;
+}
+int SLNSubmissionSyncBatch(SLNSubmissionRef const *const list, size_t const count) {
+	if(!count) return 0;
+	async_sem_t done[1];
+	sync_slice slices[SYNC_FIBERS] = {};
+	size_t const nslices = MIN(count, SYNC_FIBERS);
+	str_t *dirs[0x100] = {};
+	int rc = 0;
 
-	async_fs_unlink(sub->tmppath);
-	FREE(&sub->tmppath);
+	// The data has to be on disk before it gets a permanent name,
+	// otherwise a crash could leave a truncated file that later
+	// submissions of the same hash would silently keep.
+	async_sem_init(done, 0, 0);
+	for(size_t i = 0; i < nslices; i++) {
+		slices[i].list = list;
+		slices[i].count = count;
+		slices[i].offset = i;
+		slices[i].done = done;
+		if(1 == nslices) sync_files(&slices[i]);
+		else if(async_spawn(STACK_MINIMUM, (void (*)())sync_files, &slices[i]) < 0) {
+			slices[i].rc = UV_ENOMEM;
+			async_sem_post(done);
+		}
+	}
+	for(size_t i = 0; i < nslices; i++) {
+		async_sem_wait(done);
+	}
+	async_sem_destroy(done);
+	for(size_t i = 0; i < nslices; i++) {
+		if(slices[i].rc < 0) rc = slices[i].rc;
+	}
+	if(rc < 0) return rc;
+
+	// Every file is linked before any directory is synced, so that
+	// each sync covers all of the files linked into that directory.
+	// If anything fails, the files keep their temp paths so the batch
+	// can be retried.
+	async_pool_enter(NULL);
+	for(size_t i = 0; i < count; i++) {
+		if(!list[i] || !list[i]->tmppath) continue;
+		rc = link_file(list[i], dirs);
+		if(rc < 0) break;
+	}
+	for(size_t i = 0; i < numberof(dirs); i++) {
+		if(!dirs[i]) continue;
+		if(rc >= 0) rc = async_fs_sync_dirname(dirs[i]);
+		FREE(&dirs[i]);
+	}
+	for(size_t i = 0; rc >= 0 && i < count; i++) {
+		if(!list[i] || !list[i]->tmppath) continue;
+		async_fs_unlink(list[i]->tmppath);
+		FREE(&list[i]->tmppath);
+	}
+	async_pool_leave(NULL);
 	return rc;
 }
 int SLNSubmissionWriteFrom(SLNSubmissionRef const sub, ssize_t (*read)(void *, byte_t const **), void *const context) {
@@ -226,7 +354,9 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 	assert(!sub->tmppath);
 	// Session permissions were already checked when the sub was created.
 
-	int64_t fileID = db_next_id(SLNFileByID, txn);
+	SLNRepoRef const repo = SLNSessionGetRepo(sub->session);
+	DB_ids *const fileIDs = SLNRepoGetIDs(repo, SLNFileByID);
+	int64_t fileID = db_ids_next(fileIDs);
 	int rc;
 
 	DB_val dupFileID_val[1];
@@ -242,6 +372,7 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 		SLNFileByIDValPack(file_val, txn, sub->internalHash, sub->type, sub->size);
 		rc = db_put(txn, fileID_key, file_val, DB_NOOVERWRITE_FAST);
 		if(rc < 0) return rc;
+		db_ids_claim(fileIDs, fileID);
 	} else if(DB_KEYEXIST == rc) {
 		fileID = db_read_uint64(dupFileID_val);
 	} else return rc;
@@ -261,7 +392,8 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 		if(rc < 0 && DB_KEYEXIST != rc) return rc;
 	}
 
-	rc = SLNSubmissionParseMetaFile(sub, fileID, txn, &sub->metaFileID);
+	DB_ids *const metaFileIDs = SLNRepoGetIDs(repo, SLNMetaFileByID);
+	rc = SLNMetaFileStore(sub->meta, fileID, metaFileIDs, txn, &sub->metaFileID);
 	if(rc < 0) {
 		fprintf(stderr, "Submission meta-file error %s\n", sln_strerror(rc));
 		return rc;
@@ -269,11 +401,27 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 
 	return 0;
 }
-int SLNSubmissionStoreBatch(SLNSubmissionRef const *const list, size_t const count) {
-	if(!count) return 0;
-	// Session permissions were already checked when the sub was created.
+// Group commit: concurrent calls to SLNSubmissionStoreBatch are merged into
+// a single write transaction (and therefore a single synced write). The first
+// caller becomes the leader and stores everything queued behind it, while
+// later callers just wait for their result.
+// Note: the queue must only be touched from the main thread, never while
+// we're on a pool worker.
+typedef struct SLNCommit SLNCommit;
+struct SLNCommit {
+	SLNRepoRef repo;
+	SLNSubmissionRef const *list;
+	size_t count;
+	async_t *thread;
+	int rc;
+	bool done;
+	SLNCommit *next;
+};
+static thread_local SLNCommit *commit_head = NULL;
+static thread_local SLNCommit *commit_tail = NULL;
+static thread_local bool commit_leader = false;
 
-	SLNRepoRef const repo = SLNSessionGetRepo(list[0]->session);
+static int store_commits(SLNRepoRef const repo, SLNCommit *const group, SLNCommit *const last) {
 	DB_env *db = NULL;
 	SLNRepoDBOpen(repo, &db);
 	DB_txn *txn = NULL;
@@ -284,21 +432,112 @@ int SLNSubmissionStoreBatch(SLNSubmissionRef const *const list, size_t const cou
 	}
 	uint64_t sortID = 0;
 	rc = DB_NOTFOUND;
-	for(size_t i = 0; i < count; i++) {
-		if(!list[i]) continue;
-		assert(repo == SLNSessionGetRepo(list[i]->session));
-		rc = SLNSubmissionStore(list[i], txn);
+	for(SLNCommit *c = group; c; c = c == last ? NULL : c->next) {
+		for(size_t i = 0; i < c->count; i++) {
+			if(!c->list[i]) continue;
+			assert(repo == SLNSessionGetRepo(c->list[i]->session));
+			rc = SLNSubmissionStore(c->list[i], txn);
+			if(rc < 0) break;
+			uint64_t const metaFileID = c->list[i]->metaFileID;
+			if(metaFileID > sortID) sortID = metaFileID;
+		}
 		if(rc < 0) break;
-		uint64_t const metaFileID = list[i]->metaFileID;
-		if(metaFileID > sortID) sortID = metaFileID;
 	}
 	if(rc >= 0) {
 		rc = db_txn_commit(txn); txn = NULL;
 	} else {
 		db_txn_abort(txn); txn = NULL;
 	}
+	DB_ids *const fileIDs = SLNRepoGetIDs(repo, SLNFileByID);
+	DB_ids *const metaFileIDs = SLNRepoGetIDs(repo, SLNMetaFileByID);
+	if(rc >= 0) {
+		db_ids_commit(fileIDs);
+		db_ids_commit(metaFileIDs);
+	} else {
+		db_ids_abort(fileIDs);
+		db_ids_abort(metaFileIDs);
+	}
 	SLNRepoDBClose(repo, &db);
 	if(rc >= 0) SLNRepoSubmissionEmit(repo, sortID);
 	return rc;
 }
+int SLNSubmissionStoreBatch(SLNSubmissionRef const *const list, size_t const count) {
+	if(!count) return 0;
+	// Session permissions were already checked when the sub was created.
 
+	SLNRepoRef repo = NULL;
+	for(size_t i = 0; i < count && !repo; i++) {
+		if(list[i]) repo = SLNSessionGetRepo(list[i]->session);
+	}
+	if(!repo) return DB_NOTFOUND;
+
+	SLNCommit commit[1] = {{
+		.repo = repo,
+		.list = list,
+		.count = count,
+		.thread = async_active(),
+	}};
+	if(commit_tail) commit_tail->next = commit;
+	else commit_head = commit;
+	commit_tail = commit;
+
+	if(commit_leader) {
+		// Woken once, either with our result or to lead the next group.
+		async_yield();
+		if(commit->done) return commit->rc;
+	}
+	commit_leader = true;
+	assert(commit_head == commit);
+
+	uint64_t const delay = SLNRepoGetCommitDelay(repo);
+	if(delay) async_sleep(delay);
+
+	// Take every queued commit for this repo. Commits for other repos
+	// (if any) stay queued for the next leader.
+	SLNCommit *group = NULL, *last = NULL;
+	SLNCommit *rest = NULL, *resttail = NULL;
+	size_t members = 0;
+	for(SLNCommit *c = commit_head, *next; c; c = next) {
+		next = c->next;
+		c->next = NULL;
+		if(repo == c->repo) {
+			if(last) last->next = c;
+			else group = c;
+			last = c;
+			members++;
+		} else {
+			if(resttail) resttail->next = c;
+			else rest = c;
+			resttail = c;
+		}
+	}
+	commit_head = rest;
+	commit_tail = resttail;
+
+	SLNRepoCommitLock(repo);
+	int rc = store_commits(repo, group, last);
+	if(rc < 0 && members > 1) {
+		// Don't let one bad submission fail everyone else's.
+		for(SLNCommit *c = group; c; c = c->next) {
+			c->rc = store_commits(repo, c, c);
+			c->done = true;
+		}
+	} else {
+		for(SLNCommit *c = group; c; c = c->next) {
+			c->rc = rc;
+			c->done = true;
+		}
+	}
+	SLNRepoCommitUnlock(repo);
+
+	// Hand off leadership before waking anyone, so that followers who
+	// immediately submit again get queued instead of racing the next leader.
+	SLNCommit *const successor = commit_head;
+	commit_leader = !!successor;
+	for(SLNCommit *c = group, *next; c; c = next) {
+		next = c->next;
+		if(c != commit) async_wakeup(c->thread);
+	}
+	if(successor) async_wakeup(successor->thread);
+	return commit->rc;
+}
@@ -6,135 +6,202 @@
 #include "StrongLink.h"
 #include "SLNDB.h"
 
-#define BUF_LEN (1024 * 8)
 #define PARSE_MAX (1024 * 1024 * 1)
 
 #define DEPTH_MAX 1 // TODO
 #define IGNORE_MAX 1023 // Just to prevent overflow.
 
 typedef struct {
-	DB_txn *txn;
-	int64_t metaFileID;
-	strarg_t targetURI;
+	str_t *token;
+	uint64_t position;
+} term_t;
+
+typedef struct {
+	str_t *field;
+	str_t *value;
+} pair_t;
+
+typedef struct {
 	str_t *fields[DEPTH_MAX];
 	int depth;
+	uint64_t position; // Next fulltext token position, from 1.
+	term_t *terms;
+	size_t nterms;
+	size_t tsize;
+	pair_t *pairs;
+	size_t npairs;
+	size_t psize;
 } parser_t;
 
+// Meta-files are parsed as they're uploaded. Everything is buffered
+// until the submission is stored, since that's when we get a file ID
+// and a transaction.
+struct SLNMetaFile {
+	str_t targetURI[URI_MAX];
+	size_t urilen;
+	bool haveURI;
+	size_t total; // Only the first PARSE_MAX bytes are indexed.
+	yajl_handle parser;
+	parser_t ctx[1];
+	int status;
+};
+
 static yajl_callbacks const callbacks;
 
 // TODO: Error handling.
-static uint64_t add_metafile(DB_txn *const txn, uint64_t const fileID, strarg_t const targetURI);
+static uint64_t add_metafile(DB_txn *const txn, DB_ids *const metaFileIDs, uint64_t const fileID, strarg_t const targetURI);
 static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value);
-static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len);
+static int add_fulltext(parser_t *const ctx, strarg_t const str, size_t const len);
+static int add_terms(DB_txn *const txn, uint64_t const metaFileID, term_t *const terms, size_t const count);
 
 
-int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, DB_txn *const txn, uint64_t *const out) {
+int SLNMetaFileCreate(strarg_t const type, SLNMetaFileRef *const out) {
 	assert(out);
-	if(!sub) return DB_EINVAL;
-	if(!fileID) return DB_EINVAL;
-	if(!txn) return DB_EINVAL;
-
-	strarg_t const type = SLNSubmissionGetType(sub);
+	*out = NULL;
 	if(!type) return 0;
 	if(0 != strcasecmp(SLN_META_TYPE, type) &&
 	   0 != strcasecmp("text/x-sln-meta+json; charset=utf-8", type) &&
 	   0 != strcasecmp("text/efs-meta+json; charset=utf-8", type)) return 0;
 	// TODO: Get rid of these obsolete types.
 
-	uv_file const fd = SLNSubmissionGetFile(sub);
-	if(fd < 0) return DB_EINVAL;
-
-	int rc = 0;
-	uv_buf_t buf[1] = {};
-	DB_txn *subtxn = NULL;
-	parser_t ctx[1] = {};
-	yajl_handle parser = NULL;
-
-	buf->base = malloc(BUF_LEN);
-	if(!buf->base) { rc = DB_ENOMEM; goto cleanup; }
-
-	buf->len = URI_MAX;
-	int64_t pos = 0;
-	ssize_t len = async_fs_read(fd, buf, 1, pos);
-	if(len < 0) {
-		fprintf(stderr, "Submission meta-file read error (%s)\n", sln_strerror(len));
-		rc = DB_EIO;
-		goto cleanup;
+	SLNMetaFileRef meta = calloc(1, sizeof(struct SLNMetaFile));
+	if(!meta) return DB_ENOMEM;
+	meta->ctx->depth = -1;
+	// Position 0 is left for postings migrated from older repos, which
+	// didn't record positions (see migrate_terms).
+	meta->ctx->position = 1;
+	meta->parser = yajl_alloc(&callbacks, NULL, meta->ctx);
+	if(!meta->parser) {
+		SLNMetaFileFree(&meta);
+		return DB_ENOMEM;
 	}
-
-	size_t i;
-	for(i = 0; i < len; i++) {
-		char const c = buf->base[i];
-		if('\r' == c || '\n' == c) break;
+	yajl_config(meta->parser, yajl_allow_partial_values, (int)true);
+	*out = meta;
+	return 0;
+}
+void SLNMetaFileFree(SLNMetaFileRef *const metaptr) {
+	SLNMetaFileRef meta = *metaptr;
+	if(!meta) return;
+	memset(meta->targetURI, 0, sizeof(meta->targetURI));
+	meta->urilen = 0;
+	meta->haveURI = false;
+	meta->total = 0;
+	if(meta->parser) yajl_free(meta->parser);
+	meta->parser = NULL;
+	parser_t *const ctx = meta->ctx;
+	for(size_t i = 0; i < DEPTH_MAX; ++i) FREE(&ctx->fields[i]);
+	ctx->depth = 0;
+	ctx->position = 0;
+	for(size_t i = 0; i < ctx->nterms; ++i) FREE(&ctx->terms[i].token);
+	FREE(&ctx->terms);
+	ctx->nterms = 0;
+	ctx->tsize = 0;
+	for(size_t i = 0; i < ctx->npairs; ++i) {
+		FREE(&ctx->pairs[i].field);
+		FREE(&ctx->pairs[i].value);
 	}
-	if(i >= len) {
+	FREE(&ctx->pairs);
+	ctx->npairs = 0;
+	ctx->psize = 0;
+	meta->status = 0;
+	assert_zeroed(meta, 1);
+	FREE(metaptr); meta = NULL;
+}
+int SLNMetaFileWrite(SLNMetaFileRef const meta, byte_t const *const buf, size_t const len) {
+	if(!meta) return 0;
+	if(meta->status < 0) return 0; // Reported when stored.
+	size_t const x = MIN(len, PARSE_MAX - meta->total);
+	meta->total += x;
+	size_t i = 0;
+	if(!meta->haveURI) {
+		for(; i < x; i++) {
+			char const c = buf[i];
+			if('\r' == c || '\n' == c) break;
+			if(meta->urilen+1 >= URI_MAX) break;
+			meta->targetURI[meta->urilen++] = c;
+		}
+		if(meta->urilen+1 >= URI_MAX) {
+			fprintf(stderr, "Submission meta-file parse error (invalid target URI)\n");
+			meta->status = DB_EIO;
+			return 0;
+		}
+		if(i >= x) return 0;
+		meta->targetURI[meta->urilen] = '\0';
+		meta->haveURI = true;
+	}
+	if(i >= x) return 0;
+	yajl_status const status = yajl_parse(meta->parser, buf+i, x-i);
+	if(yajl_status_ok != status) {
+		unsigned char *msg = yajl_get_error(meta->parser, true, buf+i, x-i);
+		fprintf(stderr, "%s", msg);
+		yajl_free_error(meta->parser, msg); msg = NULL;
+		meta->status = DB_EIO;
+	}
+	return 0;
+}
+int SLNMetaFileEnd(SLNMetaFileRef const meta) {
+	if(!meta) return 0;
+	if(meta->status < 0) return 0;
+	if(!meta->haveURI) {
 		fprintf(stderr, "Submission meta-file parse error (invalid target URI)\n");
-		rc = DB_EIO;
-		goto cleanup;
+		meta->status = DB_EIO;
+		return 0;
 	}
-	assert(i < len);
-	str_t targetURI[URI_MAX];
-	memcpy(targetURI, buf->base, i);
-	targetURI[i] = '\0';
-	pos += i;
+	yajl_status const status = yajl_complete_parse(meta->parser);
+	if(yajl_status_ok != status) {
+		unsigned char *msg = yajl_get_error(meta->parser, false, NULL, 0);
+		fprintf(stderr, "%s", msg);
+		yajl_free_error(meta->parser, msg); msg = NULL;
+		meta->status = DB_EIO;
+		return 0;
+	}
+	assert(-1 == meta->ctx->depth);
+	return 0;
+}
+int SLNMetaFileStore(SLNMetaFileRef const meta, uint64_t const fileID, DB_ids *const metaFileIDs, DB_txn *const txn, uint64_t *const out) {
+	assert(out);
+	if(!meta) return 0;
+	if(!fileID) return DB_EINVAL;
+	if(!txn) return DB_EINVAL;
+	if(meta->status < 0) return meta->status;
+	assert(meta->haveURI);
 
 	// TODO: Support sub-transactions in LevelDB backend.
-	// TODO: db_txn_begin should support NULL env.
-//	rc = db_txn_begin(NULL, txn, DB_RDWR, &subtxn);
-//	if(rc < 0) goto cleanup;
-	subtxn = txn;
-
-	uint64_t const metaFileID = add_metafile(subtxn, fileID, targetURI);
-	if(!metaFileID) goto cleanup;
+	uint64_t const metaFileID = add_metafile(txn, metaFileIDs, fileID, meta->targetURI);
+	if(!metaFileID) return 0;
 	// Duplicate meta-file, not an error.
 	// TODO: Unless the previous version wasn't actually a meta-file.
 
-	ctx->txn = subtxn;
-	ctx->metaFileID = metaFileID;
-	ctx->targetURI = targetURI;
-	ctx->depth = -1;
-	parser = yajl_alloc(&callbacks, NULL, ctx);
-	if(!parser) rc = DB_ENOMEM;
-	if(rc < 0) goto cleanup;
-	yajl_config(parser, yajl_allow_partial_values, (int)true);
-
-	yajl_status status = yajl_status_ok;
-	for(;;) {
-		buf->len = MIN(BUF_LEN, PARSE_MAX-pos);
-		if(!buf->len) break;
-		len = async_fs_read(fd, buf, 1, pos);
-		if(len < 0) {
-			fprintf(stderr, "Submission meta-file read error (%s)\n", sln_strerror(len));
-			rc = DB_EIO;
-			goto cleanup;
-		}
-		if(0 == len) break;
-		status = yajl_parse(parser, (byte_t const *)buf->base, len);
-		if(yajl_status_ok != status) break;
-		pos += len;
-	}
-	status = yajl_complete_parse(parser);
-	if(yajl_status_ok != status) {
-		unsigned char *msg = yajl_get_error(parser, true, (byte_t const *)buf->base, len);
-		fprintf(stderr, "%s", msg);
-		yajl_free_error(parser, msg); msg = NULL;
-		rc = DB_EIO;
-		goto cleanup;
+	parser_t *const ctx = meta->ctx;
+	for(size_t i = 0; i < ctx->npairs; ++i) {
+		add_metadata(txn, metaFileID, ctx->pairs[i].field, ctx->pairs[i].value);
 	}
-
-	assert(-1 == ctx->depth);
-
-//	rc = db_txn_commit(subtxn); subtxn = NULL;
-	if(rc < 0) goto cleanup;
+	int rc = add_terms(txn, metaFileID, ctx->terms, ctx->nterms);
+	if(rc < 0) return rc;
 
 	*out = metaFileID;
+	return 0;
+}
 
-cleanup:
-//	db_txn_abort(subtxn); subtxn = NULL;
-	FREE(&buf->base);
-	if(parser) yajl_free(parser); parser = NULL;
-	assert_zeroed(ctx->fields, DEPTH_MAX);
-	return rc;
+static int add_pair(parser_t *const ctx, strarg_t const field, strarg_t const value, size_t const len) {
+	if(0 == len) return 0;
+	if(ctx->npairs >= ctx->psize) {
+		size_t const psize = MAX(16, ctx->psize * 2);
+		pair_t *const pairs = realloc(ctx->pairs, sizeof(pair_t) * psize);
+		if(!pairs) return DB_ENOMEM;
+		ctx->pairs = pairs;
+		ctx->psize = psize;
+	}
+	pair_t *const pair = &ctx->pairs[ctx->npairs];
+	pair->field = strdup(field);
+	pair->value = strndup(value, len);
+	if(!pair->field || !pair->value) {
+		FREE(&pair->field);
+		FREE(&pair->value);
+		return DB_ENOMEM;
+	}
+	ctx->npairs++;
+	return 0;
 }
 
 
@@ -152,12 +219,9 @@ static int yajl_map_key(parser_t *const ctx, strarg_t const key, size_t const le
 		strarg_t const field = ctx->fields[ctx->depth-1];
 		assert(field);
 		if(0 == strcmp("fulltext", field)) {
-			add_fulltext(ctx->txn, ctx->metaFileID, key, len);
+			if(add_fulltext(ctx, key, len) < 0) return false;
 		} else {
-			str_t *x = strndup(key, len);
-			if(!x) return false;
-			add_metadata(ctx->txn, ctx->metaFileID, field, x);
-			FREE(&x);
+			if(add_pair(ctx, field, key, len) < 0) return false;
 		}
 	}
 	if(ctx->depth < DEPTH_MAX) {
@@ -212,9 +276,9 @@ static yajl_callbacks const callbacks = {
 	.yajl_end_array = (int (*)())yajl_end_array,
 };
 
-static uint64_t add_metafile(DB_txn *const txn, uint64_t const fileID, strarg_t const targetURI) {
+static uint64_t add_metafile(DB_txn *const txn, DB_ids *const metaFileIDs, uint64_t const fileID, strarg_t const targetURI) {
 	uint64_t const metaFileID = fileID;
-	uint64_t const latestMetaFileID = db_next_id(SLNMetaFileByID, txn);
+	uint64_t const latestMetaFileID = db_ids_next(metaFileIDs);
 	if(metaFileID < latestMetaFileID) return 0;
 	// If it's not a new file, then it's not a new meta-file.
 	// Note that ordinary files can't be "promoted" to meta-files later
@@ -231,6 +295,7 @@ static uint64_t add_metafile(DB_txn *const txn, uint64_t const fileID, strarg_t
 	SLNMetaFileByIDValPack(metaFile_val, txn, fileID, targetURI);
 	rc = db_put(txn, metaFileID_key, metaFile_val, DB_NOOVERWRITE_FAST);
 	assert(rc >= 0);
+	db_ids_claim(metaFileIDs, metaFileID);
 
 	DB_range alts[1];
 	SLNTargetURIAndMetaFileIDRange1(alts, txn, targetURI);
@@ -263,13 +328,13 @@ static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t
 	rc = db_put(txn, fwd, &null, DB_NOOVERWRITE_FAST);
 	assertf(rc >= 0 || DB_KEYEXIST == rc, "Database error %s", sln_strerror(rc));
 
-	DB_val rev[1];
-	SLNFieldValueAndMetaFileIDKeyPack(rev, txn, field, value, metaFileID);
-	rc = db_put(txn, rev, &null, DB_NOOVERWRITE_FAST);
+	DB_range rev[1];
+	SLNFieldValuePostingsRange2(rev, txn, field, value);
+	rc = db_postings_append(txn, rev, metaFileID, NULL, 0);
 	assertf(rc >= 0 || DB_KEYEXIST == rc, "Database error %s", sln_strerror(rc));
 }
-static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len) {
-	if(0 == len) return;
+static int add_fulltext(parser_t *const ctx, strarg_t const str, size_t const len) {
+	if(0 == len) return 0;
 	assert(str);
 
 	int rc;
@@ -282,29 +347,67 @@ static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t
 	rc = fts->xOpen(tokenizer, str, len, &tcur);
 	assert(SQLITE_OK == rc);
 
-	DB_cursor *cursor = NULL;
-	rc = db_cursor_open(txn, &cursor);
-	assert(rc >= 0);
-
+	// Positions continue across fulltext strings in the same meta-file,
+	// leaving a gap so that phrases can't match across the boundary.
+	uint64_t const base = ctx->position;
 	for(;;) {
 		strarg_t token;
 		int tlen;
-		int tpos; // TODO
+		int tpos;
 		int ignored1, ignored2;
 		rc = fts->xNext(tcur, &token, &tlen, &ignored1, &ignored2, &tpos);
 		if(SQLITE_OK != rc) break;
 
 		assert('\0' == token[tlen]); // Assumption
-		DB_val token_val[1];
-		SLNTermMetaFileIDAndPositionKeyPack(token_val, txn, token, metaFileID, 0);
-		// TODO: Record tpos. Requires changes to SLNFulltextFilter so that each document only gets returned once, no matter how many times the token appears within it.
-		DB_val null = { 0, NULL };
-		rc = db_cursor_put(cursor, token_val, &null, DB_NOOVERWRITE_FAST);
-		assert(rc >= 0 || DB_KEYEXIST == rc);
+		assert(tpos >= 0);
+		if(ctx->nterms >= ctx->tsize) {
+			size_t const tsize = MAX(64, ctx->tsize * 2);
+			term_t *const terms = realloc(ctx->terms, sizeof(term_t) * tsize);
+			if(!terms) { rc = DB_ENOMEM; goto cleanup; }
+			ctx->terms = terms;
+			ctx->tsize = tsize;
+		}
+		str_t *const x = strndup(token, tlen);
+		if(!x) { rc = DB_ENOMEM; goto cleanup; }
+		ctx->terms[ctx->nterms++] = (term_t){ x, base+tpos };
+		ctx->position = MAX(ctx->position, base+tpos+2);
 	}
+	rc = 0;
 
-	db_cursor_close(cursor); cursor = NULL;
-
+cleanup:
 	fts->xClose(tcur); tcur = NULL;
+	return rc;
+}
+static int term_cmp(term_t const *const a, term_t const *const b) {
+	int const x = strcmp(a->token, b->token);
+	if(x) return x;
+	if(a->position < b->position) return -1;
+	if(a->position > b->position) return +1;
+	return 0;
 }
+static int add_terms(DB_txn *const txn, uint64_t const metaFileID, term_t *const terms, size_t const count) {
+	if(!count) return 0;
+	qsort(terms, count, sizeof(*terms), (int (*)(void const *, void const *))term_cmp);
 
+	uint64_t *positions = malloc(sizeof(uint64_t) * count);
+	if(!positions) return DB_ENOMEM;
+	int rc = 0;
+	size_t i = 0;
+	while(i < count) {
+		size_t n = 0;
+		positions[n++] = terms[i].position;
+		size_t j = i+1;
+		for(; j < count && 0 == strcmp(terms[i].token, terms[j].token); ++j) {
+			if(terms[j].position == positions[n-1]) continue;
+			positions[n++] = terms[j].position;
+		}
+		DB_range range[1];
+		SLNTermPostingsRange1(range, txn, terms[i].token);
+		rc = db_postings_append(txn, range, metaFileID, positions, n);
+		if(DB_KEYEXIST == rc) rc = 0;
+		if(rc < 0) break;
+		i = j;
+	}
+	FREE(&positions);
+	return rc;
+}
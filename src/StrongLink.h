@@ -12,6 +12,30 @@
 
 #define SLN_META_TYPE "application/vnd.stronglink.meta"
 
+// Many files in one response (see POST /sln/batch). Each one is framed as:
+//   <URI> <status>[ <size> <type>]\n
+//   <size bytes of data>
+// The status is an HTTP status code and only 200 has a size and data.
+#define SLN_BATCH_TYPE "application/vnd.stronglink.batch"
+#define SLN_BATCH_MAX 64 // Files per request
+
+// Compact URI lists for syncing (see GET /sln/all). Each record is:
+//   <length> <algo> <digest> <sortID> <fileID>
+// The length (one byte) counts everything after itself. The algo is one
+// byte: 0 is sha256, 1 is sha1 and 2 is blake2b. These are fixed, even if
+// a build doesn't support some of them (see SLNRecordAlgoName). The IDs
+// are big-endian uint64s and make up the position to resume from. A
+// record with a length of zero is a keep-alive.
+#define SLN_URI_RECORDS_TYPE "application/vnd.stronglink.uri-records"
+#define SLN_URI_RECORD_MAX (1+1+64+8+8)
+
+// Output formats for URI lists.
+enum {
+	SLN_URI_LIST_TEXT = 0,
+	SLN_URI_LIST_META = 1, // "[meta-file URI] -> [target URI]"
+	SLN_URI_LIST_RECORDS = 2, // SLN_URI_RECORDS_TYPE
+};
+
 extern uint32_t SLNSeed;
 
 typedef uint32_t SLNMode;
@@ -27,7 +51,9 @@ typedef struct SLNSessionCache* SLNSessionCacheRef;
 typedef struct SLNSession* SLNSessionRef;
 typedef struct SLNSubmission* SLNSubmissionRef;
 typedef struct SLNHasher* SLNHasherRef;
+typedef struct SLNMetaFile* SLNMetaFileRef;
 typedef struct SLNFilter* SLNFilterRef;
+typedef struct SLNQueryCache* SLNQueryCacheRef;
 typedef struct SLNJSONFilterParser* SLNJSONFilterParserRef;
 typedef struct SLNPull* SLNPullRef;
 
@@ -46,7 +72,7 @@ static strarg_t sln_strerror(int const rc) {
 	return x;
 }
 
-SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name);
+SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name, strarg_t const algos);
 void SLNRepoFree(SLNRepoRef *const repoptr);
 strarg_t SLNRepoGetDir(SLNRepoRef const repo);
 strarg_t SLNRepoGetDataDir(SLNRepoRef const repo);
@@ -57,11 +83,18 @@ strarg_t SLNRepoGetCacheDir(SLNRepoRef const repo);
 strarg_t SLNRepoGetName(SLNRepoRef const repo);
 SLNMode SLNRepoGetPublicMode(SLNRepoRef const repo);
 SLNMode SLNRepoGetRegistrationMode(SLNRepoRef const repo);
+unsigned SLNRepoGetHashAlgos(SLNRepoRef const repo);
 SLNSessionCacheRef SLNRepoGetSessionCache(SLNRepoRef const repo);
+SLNQueryCacheRef SLNRepoGetQueryCache(SLNRepoRef const repo);
 void SLNRepoDBOpen(SLNRepoRef const repo, DB_env **const dbptr);
 void SLNRepoDBClose(SLNRepoRef const repo, DB_env **const dbptr);
 void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID);
 int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t const sortID, uint64_t const future);
+uint64_t SLNRepoGetCommitDelay(SLNRepoRef const repo);
+void SLNRepoSetCommitDelay(SLNRepoRef const repo, uint64_t const milliseconds);
+void SLNRepoCommitLock(SLNRepoRef const repo);
+void SLNRepoCommitUnlock(SLNRepoRef const repo);
+bool SLNRepoCommitPending(SLNRepoRef const repo);
 void SLNRepoPullsStart(SLNRepoRef const repo);
 void SLNRepoPullsStop(SLNRepoRef const repo);
 
@@ -110,16 +143,43 @@ SLNRepoRef SLNSubmissionGetRepo(SLNSubmissionRef const sub);
 strarg_t SLNSubmissionGetType(SLNSubmissionRef const sub);
 uv_file SLNSubmissionGetFile(SLNSubmissionRef const sub);
 int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len);
+int SLNSubmissionWait(SLNSubmissionRef const sub); // Before writing from a pool worker
 int SLNSubmissionEnd(SLNSubmissionRef const sub);
+// Hashes and verifies, but leaves the file in the temp dir until it's
+// passed to SLNSubmissionSyncBatch (which SLNSubmissionEnd does for you).
+int SLNSubmissionEndNoSync(SLNSubmissionRef const sub);
+int SLNSubmissionSyncBatch(SLNSubmissionRef const *const list, size_t const count);
 int SLNSubmissionWriteFrom(SLNSubmissionRef const sub, ssize_t (*read)(void *, byte_t const **), void *const context);
 strarg_t SLNSubmissionGetPrimaryURI(SLNSubmissionRef const sub);
 int SLNSubmissionGetFileInfo(SLNSubmissionRef const sub, SLNFileInfo *const info);
 int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn);
 int SLNSubmissionStoreBatch(SLNSubmissionRef const *const list, size_t const count);
 
-SLNHasherRef SLNHasherCreate(strarg_t const type);
+// Used by SLNSubmission to index meta-files while they're uploaded.
+int SLNMetaFileCreate(strarg_t const type, SLNMetaFileRef *const out);
+void SLNMetaFileFree(SLNMetaFileRef *const metaptr);
+int SLNMetaFileWrite(SLNMetaFileRef const meta, byte_t const *const buf, size_t const len);
+int SLNMetaFileEnd(SLNMetaFileRef const meta);
+
+// Hash algorithms are identified by bits in a mask. Each repo stores the
+// set of algorithms it computes and indexes when it's created.
+#define SLN_HASH_ALGO_MAX 8
+#define SLN_HASH_INTERNAL (1 << 0) // SLN_INTERNAL_ALGO, always enabled
+#define SLN_HASH_ALGOS_DEFAULT "sha256,sha1"
+// Environment variable with comma-separated hash algorithms for new repos,
+// e.g. "sha256" or "sha256,sha1,blake2b". Existing repos keep the
+// algorithms they were created with. SHA-256 is always included.
+#define SLN_HASH_ALGOS_ENV "STRONGLINK_HASH_ALGOS"
+unsigned SLNHashAlgoFromName(strarg_t const name, size_t const len);
+strarg_t SLNHashAlgoName(unsigned const algo); // NULL if unknown
+strarg_t SLNRecordAlgoName(unsigned const id); // NULL if unknown
+int SLNRecordAlgoID(strarg_t const name); // Negative if unknown
+int SLNHashAlgosParse(strarg_t const list, unsigned *const out);
+
+SLNHasherRef SLNHasherCreate(strarg_t const type, unsigned const algos);
 void SLNHasherFree(SLNHasherRef *const hasherptr);
 int SLNHasherWrite(SLNHasherRef const hasher, byte_t const *const buf, size_t const len);
+int SLNHasherWait(SLNHasherRef const hasher);
 str_t **SLNHasherEnd(SLNHasherRef const hasher);
 strarg_t SLNHasherGetInternalHash(SLNHasherRef const hasher);
 
@@ -170,6 +230,7 @@ strarg_t SLNFilterGetStringArg(SLNFilterRef const filter, size_t const i);
 int SLNFilterAddStringArg(SLNFilterRef const filter, strarg_t const str, ssize_t const len);
 int SLNFilterAddFilterArg(SLNFilterRef const filter, SLNFilterRef const subfilter);
 void SLNFilterPrint(SLNFilterRef const filter, size_t const depth);
+str_t *SLNFilterCopyKey(SLNFilterRef const filter); // Canonical form of SLNFilterPrint
 size_t SLNFilterToUserFilterString(SLNFilterRef const filter, str_t *const data, size_t const size, size_t const depth);
 int SLNFilterPrepare(SLNFilterRef const filter, DB_txn *const txn);
 void SLNFilterSeek(SLNFilterRef const filter, int const dir, uint64_t const sortID, uint64_t const fileID);
@@ -195,9 +256,13 @@ int SLNFilterSeekToPosition(SLNFilterRef const filter, SLNFilterPosition const *
 int SLNFilterGetPosition(SLNFilterRef const filter, SLNFilterPosition *const pos, DB_txn *const txn);
 int SLNFilterCopyNextURI(SLNFilterRef const filter, int const dir, bool const meta, DB_txn *const txn, str_t **const out);
 
-ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max);
-ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx);
-int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, void *ctx);
+SLNQueryCacheRef SLNQueryCacheCreate(void);
+void SLNQueryCacheFree(SLNQueryCacheRef *const cacheptr);
+void SLNQueryCacheInvalidate(SLNQueryCacheRef const cache);
+
+ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, int const format, str_t *URIs[], size_t const max);
+ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const format, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx);
+int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const format, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, void *ctx);
 
 
 int SLNJSONFilterParserCreate(SLNSessionRef const session, SLNJSONFilterParserRef *const out);
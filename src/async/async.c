@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <stdio.h> /* For debugging */
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/rand.h>
 #include "async.h"
@@ -13,6 +14,14 @@ thread_local async_t *async_main = NULL;
 static thread_local async_t master[1] = {};
 static thread_local async_t *active = NULL;
 
+struct async_remote_s {
+	uv_async_t async[1];
+	uv_mutex_t lock[1];
+	async_t *head;
+	async_t *tail;
+};
+static thread_local async_remote_t *remote = NULL;
+
 static thread_local cothread_t trampoline = NULL;
 static thread_local void (*arg_func)(void *) = NULL;
 static thread_local void *arg_arg = NULL;
@@ -24,6 +33,7 @@ int async_init(void) {
 	if(rc < 0) return rc;
 	master->fiber = co_active();
 	master->flags = 0;
+	master->next = NULL;
 	active = master;
 	async_main = master;
 	trampoline = co_create(STACK_DEFAULT, trampoline_fn);
@@ -32,6 +42,15 @@ int async_init(void) {
 }
 void async_destroy(void) {
 	assert(async_loop);
+	async_buf_trim();
+	async_fs_destroy();
+	if(remote) {
+		uv_close((uv_handle_t *)remote->async, NULL);
+		uv_run(async_loop, UV_RUN_NOWAIT);
+		uv_mutex_destroy(remote->lock);
+		assert(!remote->head);
+		free(remote); remote = NULL;
+	}
 	co_delete(trampoline); trampoline = NULL;
 	uv_loop_close(async_loop);
 	memset(async_loop, 0, sizeof(async_loop));
@@ -50,6 +69,7 @@ static void async_start(void) {
 	async_t thread[1];
 	thread->fiber = co_active();
 	thread->flags = 0;
+	thread->next = NULL;
 	active = thread;
 	void (*const func)(void *) = arg_func;
 	void *arg = arg_arg;
@@ -135,6 +155,45 @@ void async_cancel(async_t *const thread) {
 }
 
 
+static void remote_cb(uv_async_t *const async) {
+	async_remote_t *const r = async->data;
+	uv_mutex_lock(r->lock);
+	async_t *thread = r->head;
+	r->head = NULL;
+	r->tail = NULL;
+	uv_mutex_unlock(r->lock);
+	while(thread) {
+		async_t *const next = thread->next;
+		thread->next = NULL;
+		async_switch(thread);
+		thread = next;
+	}
+}
+async_remote_t *async_remote_current(void) {
+	if(!async_main) return NULL;
+	if(remote) return remote;
+	async_remote_t *const r = calloc(1, sizeof(struct async_remote_s));
+	assert(r); // TODO
+	uv_mutex_init(r->lock);
+	r->async->data = r;
+	uv_async_init(async_loop, r->async, remote_cb);
+	uv_unref((uv_handle_t *)r->async);
+	remote = r;
+	return remote;
+}
+void async_remote_wakeup(async_remote_t *const r, async_t *const thread) {
+	assert(r);
+	assert(thread);
+	assert(!thread->next);
+	uv_mutex_lock(r->lock);
+	if(r->tail) r->tail->next = thread;
+	else r->head = thread;
+	r->tail = thread;
+	uv_mutex_unlock(r->lock);
+	uv_async_send(r->async);
+}
+
+
 int async_random(unsigned char *const buf, size_t const len) {
 	// TODO: Come up with a thread-safe and lock-free RNG. Maybe just read from /dev/urandom ourselves on appropriate platforms.
 //	async_pool_enter(NULL);
@@ -26,10 +26,12 @@ enum {
 	ASYNC_CANCELED = 1 << 0,
 	ASYNC_CANCELABLE = 1 << 1,
 };
-typedef struct {
+typedef struct async_s async_t;
+struct async_s {
 	cothread_t fiber;
 	unsigned flags;
-} async_t;
+	async_t *next; // For async_remote_wakeup.
+};
 
 extern thread_local uv_loop_t async_loop[1];
 extern thread_local async_t *async_main;
@@ -49,6 +51,12 @@ int async_yield_flags(unsigned const flags);
 int async_canceled(void);
 void async_cancel(async_t *const thread);
 
+// Each thread running a loop gets an inbox for waking its fibers from other
+// threads. async_remote_current returns NULL on pool worker threads.
+typedef struct async_remote_s async_remote_t;
+async_remote_t *async_remote_current(void);
+void async_remote_wakeup(async_remote_t *const remote, async_t *const thread);
+
 
 int async_random(unsigned char *const buf, size_t const len);
 int async_getaddrinfo(char const *const node, char const *const service, struct addrinfo const *const hints, struct addrinfo **const res);
@@ -57,6 +65,12 @@ int async_sleep(uint64_t const milliseconds);
 void async_close(uv_handle_t *const handle);
 
 // async_stream.c
+#define ASYNC_BUF_SIZE (1024 * 8)
+void *async_buf_get(void);
+void async_buf_put(void *const buf);
+void async_buf_trim(void); // Frees the current thread's cache.
+
+// Buffers from async_read must be released with async_buf_put.
 int async_read(uv_stream_t *const stream, uv_buf_t *const out);
 
 int async_write(uv_stream_t *const stream, uv_buf_t const bufs[], unsigned const nbufs);
@@ -67,8 +81,10 @@ uv_file async_fs_open(const char* path, int flags, int mode);
 int async_fs_close(uv_file file);
 ssize_t async_fs_read(uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset);
 ssize_t async_fs_write(uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset);
+ssize_t async_fs_sendfile(uv_file out_fd, uv_file in_fd, int64_t in_offset, size_t length);
 int async_fs_unlink(const char* path);
 int async_fs_link(const char* path, const char* new_path);
+int async_fs_rename(const char* path, const char* new_path);
 int async_fs_fsync(uv_file file);
 int async_fs_fdatasync(uv_file file);
 int async_fs_mkdir_nosync(const char* path, int mode); // Warning: unsafe!
@@ -94,13 +110,21 @@ int async_fs_link_mkdirp(const char* path, const char* new_path);
 
 char *async_fs_tempnam(char const *dir, char const *prefix);
 
+// Built with ASYNC_USE_IO_URING, the basic operations (open, close, read,
+// write, fsync, fdatasync, link, rename and mkdir) go through a per-loop
+// io_uring instead of the thread pool when the kernel supports it.
+void async_fs_destroy(void); // Frees the current thread's io_uring.
+
 // async_sem.c
 typedef struct async_thread_list async_thread_list;
+// Semaphores (and the mutexes and conditions built on them) may be shared
+// between loop threads. Waiters on other loops are woken remotely.
 typedef struct {
 	async_thread_list *head;
 	async_thread_list *tail;
 	unsigned value;
 	unsigned flags;
+	uv_mutex_t lock[1];
 } async_sem_t;
 void async_sem_init(async_sem_t *const sem, unsigned const value, unsigned const flags);
 void async_sem_destroy(async_sem_t *const sem);
@@ -123,6 +147,7 @@ void async_mutex_unlock(async_mutex_t *const mutex);
 int async_mutex_check(async_mutex_t *const mutex);
 
 // async_rwlock.c
+// Not safe to share between loop threads.
 typedef struct {
 	int state;
 	async_thread_list *rdhead;
@@ -167,6 +192,7 @@ void async_worker_leave(async_worker_t *const worker);
 typedef struct async_pool_s async_pool_t;
 async_pool_t *async_pool_get_shared(void);
 void async_pool_destroy_shared(void); // Note: async
+void async_pool_set_size(unsigned const size); // Before creating any pools
 async_pool_t *async_pool_create(void);
 void async_pool_free(async_pool_t *const pool); // Note: async
 void async_pool_enter(async_pool_t *const pool);
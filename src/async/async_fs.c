@@ -1,6 +1,9 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#ifdef ASYNC_USE_IO_URING
+#define _DEFAULT_SOURCE // For syscall(2)
+#endif
 #include <stdio.h> /* For debugging */
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +13,250 @@
 
 #define ENTROPY_BYTES 8
 
+#ifdef ASYNC_USE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Operations are queued in the submission ring by fibers on a loop thread,
+// and submitted together from an idle handle once per loop iteration.
+// Completions are signaled through an eventfd polled by the loop. This
+// way, the common operations don't need a pool thread at all.
+// If the kernel doesn't support io_uring or a given operation, we fall
+// back to the thread pool.
+
+#define URING_ENTRIES 256
+
+struct uring_req {
+	async_t *thread;
+	int result;
+	bool done;
+};
+struct uring {
+	int fd;
+	int efd;
+	unsigned features;
+	bool ops[IORING_OP_LAST];
+	void *ring;
+	size_t ringsize;
+	struct io_uring_sqe *sqes;
+	size_t sqesize;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned tail; // Not yet visible to the kernel
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+	unsigned cq_entries;
+	unsigned inflight;
+	uv_poll_t poll[1];
+	uv_idle_t idle[1];
+};
+
+static thread_local struct uring *uring = NULL;
+static thread_local bool uring_tried = false;
+
+static void uring_flush(uv_idle_t *const idle) {
+	struct uring *const u = idle->data;
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	for(;;) {
+		unsigned const head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		unsigned const count = u->tail - head;
+		if(!count) break;
+		long const rc = syscall(__NR_io_uring_enter, u->fd, count, 0, 0, NULL, 0);
+		if(rc > 0) continue;
+		if(rc < 0 && EINTR == errno) continue;
+		// Out of resources. The idle handle stays active, so we'll
+		// try again on the next iteration.
+		return;
+	}
+	uv_idle_stop(u->idle);
+}
+static void uring_complete(uv_poll_t *const poll, int const status, int const events) {
+	struct uring *const u = poll->data;
+	uint64_t x;
+	ssize_t const len = read(u->efd, &x, sizeof(x)); // Reset
+	(void)len;
+	for(;;) {
+		unsigned const head = *u->cq_head;
+		if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) break;
+		struct io_uring_cqe const *const cqe = &u->cqes[head & u->cq_mask];
+		struct uring_req *const req = (struct uring_req *)(uintptr_t)cqe->user_data;
+		req->result = cqe->res;
+		req->done = true;
+		__atomic_store_n(u->cq_head, head+1, __ATOMIC_RELEASE);
+		if(0 == --u->inflight) uv_unref((uv_handle_t *)u->poll);
+		async_switch(req->thread);
+	}
+}
+
+static void uring_free(struct uring *const u) {
+	if(u->ring) munmap(u->ring, u->ringsize);
+	if(u->sqes) munmap(u->sqes, u->sqesize);
+	if(u->efd >= 0) close(u->efd);
+	if(u->fd >= 0) close(u->fd);
+	free(u);
+}
+static struct uring *uring_create(void) {
+	struct uring *u = calloc(1, sizeof(struct uring));
+	if(!u) return NULL;
+	u->efd = -1;
+	struct io_uring_params params[1] = {};
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, params);
+	if(u->fd < 0) goto fail;
+	// Kernels without these are too old for most of our operations anyway.
+	u->features = params->features;
+	if(!(IORING_FEAT_SINGLE_MMAP & u->features)) goto fail;
+
+	size_t const sqsize = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+	size_t const cqsize = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+	u->ringsize = sqsize > cqsize ? sqsize : cqsize;
+	u->ring = mmap(NULL, u->ringsize, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQ_RING);
+	if(MAP_FAILED == u->ring) { u->ring = NULL; goto fail; }
+	u->sqesize = params->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQES);
+	if(MAP_FAILED == u->sqes) { u->sqes = NULL; goto fail; }
+
+	char *const ring = u->ring;
+	u->sq_head = (unsigned *)(ring + params->sq_off.head);
+	u->sq_tail = (unsigned *)(ring + params->sq_off.tail);
+	u->sq_array = (unsigned *)(ring + params->sq_off.array);
+	u->sq_mask = *(unsigned *)(ring + params->sq_off.ring_mask);
+	u->sq_entries = params->sq_entries;
+	u->tail = *u->sq_tail;
+	u->cq_head = (unsigned *)(ring + params->cq_off.head);
+	u->cq_tail = (unsigned *)(ring + params->cq_off.tail);
+	u->cqes = (struct io_uring_cqe *)(ring + params->cq_off.cqes);
+	u->cq_mask = *(unsigned *)(ring + params->cq_off.ring_mask);
+	u->cq_entries = params->cq_entries;
+
+	size_t const probesize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *const probe = calloc(1, probesize);
+	if(!probe) goto fail;
+	long rc = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+	for(unsigned i = 0; rc >= 0 && i < probe->ops_len && i < IORING_OP_LAST; i++) {
+		u->ops[i] = !!(IO_URING_OP_SUPPORTED & probe->ops[i].flags);
+	}
+	free(probe);
+	if(rc < 0) goto fail;
+
+	u->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(u->efd < 0) goto fail;
+	rc = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1);
+	if(rc < 0) goto fail;
+	if(uv_poll_init(async_loop, u->poll, u->efd) < 0) goto fail;
+	u->poll->data = u;
+	uv_poll_start(u->poll, UV_READABLE, uring_complete);
+	uv_unref((uv_handle_t *)u->poll);
+	uv_idle_init(async_loop, u->idle);
+	u->idle->data = u;
+	return u;
+
+fail:
+	uring_free(u);
+	return NULL;
+}
+// Returns NULL unless the calling fiber can wait on io_uring.
+static struct uring *uring_get(void) {
+	// Pool workers don't run a loop, and the main fiber can't yield.
+	if(!async_main || async_active() == async_main) return NULL;
+	if(!uring_tried) {
+		uring_tried = true;
+		uring = uring_create();
+	}
+	return uring;
+}
+static struct io_uring_sqe *uring_sqe(unsigned const op) {
+	struct uring *const u = uring_get();
+	if(!u || !u->ops[op]) return NULL;
+	// Don't let completions outrun the completion ring.
+	if(u->inflight >= u->cq_entries) return NULL;
+	if(u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		uring_flush(u->idle);
+		if(u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) return NULL;
+	}
+	unsigned const i = u->tail & u->sq_mask;
+	struct io_uring_sqe *const sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	u->sq_array[i] = i;
+	return sqe;
+}
+static int uring_wait(struct io_uring_sqe *const sqe) {
+	struct uring *const u = uring;
+	struct uring_req req[1] = {{ async_active(), 0, false }};
+	sqe->user_data = (uintptr_t)req;
+	u->tail++;
+	if(0 == u->inflight++) uv_ref((uv_handle_t *)u->poll);
+	uv_idle_start(u->idle, uring_flush);
+	// The kernel may still be using our arguments, so we can't stop
+	// waiting early.
+	while(!req->done) async_yield();
+	return req->result;
+}
+static struct io_uring_sqe *uring_rw_sqe(unsigned const op, uv_file const file, uv_buf_t const bufs[], unsigned int const nbufs, int64_t const offset) {
+	struct uring *const u = uring_get();
+	if(!u) return NULL;
+	if(offset < 0 && !(IORING_FEAT_RW_CUR_POS & u->features)) return NULL;
+	struct io_uring_sqe *const sqe = uring_sqe(op);
+	if(!sqe) return NULL;
+	sqe->fd = file;
+	sqe->addr = (uintptr_t)bufs; // On Unix, uv_buf_t is laid out like struct iovec.
+	sqe->len = nbufs;
+	sqe->off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset;
+	return sqe;
+}
+static struct io_uring_sqe *uring_path_sqe(unsigned const op, const char* path, const char* new_path) {
+	struct io_uring_sqe *const sqe = uring_sqe(op);
+	if(!sqe) return NULL;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	if(new_path) {
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = (uintptr_t)new_path;
+	}
+	return sqe;
+}
+
+void async_fs_destroy(void) {
+	struct uring *const u = uring;
+	uring = NULL;
+	uring_tried = false;
+	if(!u) return;
+	assert(!u->inflight);
+	uv_close((uv_handle_t *)u->poll, NULL);
+	uv_close((uv_handle_t *)u->idle, NULL);
+	uv_run(async_loop, UV_RUN_NOWAIT);
+	uring_free(u);
+}
+#else
+void async_fs_destroy(void) {}
+#endif
+
+// Compound operations hop to the pool once for all of their steps, unless
+// the steps can use io_uring from here.
+static void fs_enter(void) {
+#ifdef ASYNC_USE_IO_URING
+	if(uring_get()) return;
+#endif
+	async_pool_enter(NULL);
+}
+static void fs_leave(void) {
+#ifdef ASYNC_USE_IO_URING
+	if(uring_get()) return;
+#endif
+	async_pool_leave(NULL);
+}
+
 static void fs_cb(uv_fs_t *const req) {
 	async_switch(req->data);
 }
@@ -47,33 +294,92 @@ static void fs_cb(uv_fs_t *const req) {
 #endif
 
 uv_file async_fs_open(const char* path, int flags, int mode) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_path_sqe(IORING_OP_OPENAT, path, NULL);
+	if(sqe) {
+		sqe->len = mode;
+		sqe->open_flags = flags | O_CLOEXEC; // Same as libuv
+		return uring_wait(sqe);
+	}
+#endif
 	ASYNC_FS_WRAP(open, path, flags, mode)
 }
 int async_fs_close(uv_file file) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_sqe(IORING_OP_CLOSE);
+	if(sqe) {
+		sqe->fd = file;
+		return uring_wait(sqe);
+	}
+#endif
 	ASYNC_FS_WRAP(close, file)
 }
 ssize_t async_fs_read(uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_rw_sqe(IORING_OP_READV, file, bufs, nbufs, offset);
+	if(sqe) return uring_wait(sqe);
+#endif
 	ASYNC_FS_WRAP(read, file, bufs, nbufs, offset)
 }
 ssize_t async_fs_write(uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_rw_sqe(IORING_OP_WRITEV, file, bufs, nbufs, offset);
+	if(sqe) return uring_wait(sqe);
+#endif
 	ASYNC_FS_WRAP(write, file, bufs, nbufs, offset)
 }
+ssize_t async_fs_sendfile(uv_file out_fd, uv_file in_fd, int64_t in_offset, size_t length) {
+	ASYNC_FS_WRAP(sendfile, out_fd, in_fd, in_offset, length)
+}
 int async_fs_unlink(const char* path) {
 	ASYNC_FS_WRAP(unlink, path)
 }
 int async_fs_link(const char* path, const char* new_path) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_path_sqe(IORING_OP_LINKAT, path, new_path);
+	if(sqe) return uring_wait(sqe);
+#endif
 	ASYNC_FS_WRAP(link, path, new_path)
 }
+int async_fs_rename(const char* path, const char* new_path) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_path_sqe(IORING_OP_RENAMEAT, path, new_path);
+	if(sqe) return uring_wait(sqe);
+#endif
+	ASYNC_FS_WRAP(rename, path, new_path)
+}
 int async_fs_fsync(uv_file file) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_sqe(IORING_OP_FSYNC);
+	if(sqe) {
+		sqe->fd = file;
+		return uring_wait(sqe);
+	}
+#endif
 	ASYNC_FS_WRAP(fsync, file)
 }
 int async_fs_fdatasync(uv_file file) {
 	// TODO: Apparently fdatasync(2) is broken on some versions of
 	// Linux 3.x when the file size grows. Make sure that either libuv
 	// takes care of it or that it doesn't affect us. Cf. MDB changelog.
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_sqe(IORING_OP_FSYNC);
+	if(sqe) {
+		sqe->fd = file;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		return uring_wait(sqe);
+	}
+#endif
 	ASYNC_FS_WRAP(fdatasync, file)
 }
 int async_fs_mkdir_nosync(const char* path, int mode) {
+#ifdef ASYNC_USE_IO_URING
+	struct io_uring_sqe *const sqe = uring_path_sqe(IORING_OP_MKDIRAT, path, NULL);
+	if(sqe) {
+		sqe->len = mode;
+		return uring_wait(sqe);
+	}
+#endif
 	ASYNC_FS_WRAP(mkdir, path, mode)
 }
 int async_fs_ftruncate(uv_file file, int64_t offset) {
@@ -85,7 +391,7 @@ int async_fs_symlink(const char* path, const char* new_path, int flags) {
 }
 
 ssize_t async_fs_readall_simple(uv_file const file, uv_buf_t const *const buf) {
-	async_pool_enter(NULL);
+	fs_enter();
 	size_t pos = 0;
 	ssize_t rc;
 	for(;;) {
@@ -96,11 +402,11 @@ ssize_t async_fs_readall_simple(uv_file const file, uv_buf_t const *const buf) {
 		pos += rc;
 		if(pos >= buf->len) { rc = pos; break; }
 	}
-	async_pool_leave(NULL);
+	fs_leave();
 	return rc;
 }
 int async_fs_writeall(uv_file const file, uv_buf_t bufs[], unsigned int const nbufs, int64_t const offset) {
-	async_pool_enter(NULL);
+	fs_enter();
 	int64_t pos = offset;
 	unsigned used = 0;
 	int rc = 0;
@@ -125,7 +431,7 @@ int async_fs_writeall(uv_file const file, uv_buf_t bufs[], unsigned int const nb
 		}
 	}
 cleanup:
-	async_pool_leave(NULL);
+	fs_leave();
 	return rc;
 }
 
@@ -172,23 +478,23 @@ int async_fs_open_dirname(const char* path, int flags, int mode) {
 	return rc;
 }
 int async_fs_sync_dirname(const char* path) {
-	async_pool_enter(NULL);
+	fs_enter();
 	int rc = async_fs_open_dirname(path, O_RDONLY, 0000);
 	if(rc >= 0) {
 		uv_file parent = rc;
 		rc = async_fs_fdatasync(parent);
 		async_fs_close(parent); parent = -1;
 	}
-	async_pool_leave(NULL);
+	fs_leave();
 	return rc;
 }
 int async_fs_mkdir_sync(const char* path, int mode) {
-	async_pool_enter(NULL);
+	fs_enter();
 	int rc = async_fs_mkdir_nosync(path, mode);
 	if(rc >= 0) {
 		rc = async_fs_sync_dirname(path);
 	}
-	async_pool_leave(NULL);
+	fs_leave();
 	return rc;
 }
 
@@ -14,11 +14,17 @@
 // because it never locks (AKA blocks) the main thread.
 
 struct async_pool_s {
-	async_worker_t *workers[WORKER_COUNT];
+	unsigned size;
 	unsigned count;
 	async_sem_t sem[1];
+	async_worker_t *workers[];
 };
 
+// Applies to pools created afterwards. Every thread with an event loop gets
+// its own shared pool, so programs running several loops should divide
+// the workers between them.
+static unsigned pool_size = WORKER_COUNT;
+
 static thread_local async_pool_t *shared = NULL;
 static thread_local async_worker_t *worker = NULL;
 static thread_local unsigned depth = 0;
@@ -31,24 +37,30 @@ void async_pool_destroy_shared(void) {
 	async_pool_free(shared); shared = NULL;
 }
 
+void async_pool_set_size(unsigned const size) {
+	assert(size);
+	pool_size = size;
+}
 async_pool_t *async_pool_create(void) {
-	async_pool_t *const pool = calloc(1, sizeof(struct async_pool_s));
+	unsigned const size = pool_size;
+	async_pool_t *const pool = calloc(1, sizeof(struct async_pool_s) + sizeof(async_worker_t *) * size);
 	if(!pool) return NULL;
-	for(unsigned i = 0; i < WORKER_COUNT; ++i) {
+	pool->size = size;
+	for(unsigned i = 0; i < size; ++i) {
 		pool->workers[i] = async_worker_create();
 		if(!pool->workers[i]) {
 			async_pool_free(pool);
 			return NULL;
 		}
 	}
-	pool->count = WORKER_COUNT;
+	pool->count = size;
 	async_sem_init(pool->sem, 1, 0);
 	return pool;
 }
 void async_pool_free(async_pool_t *const pool) {
 	if(!pool) return;
-	assert(WORKER_COUNT == pool->count);
-	for(unsigned i = 0; i < WORKER_COUNT; ++i) {
+	assert(pool->size == pool->count);
+	for(unsigned i = 0; i < pool->size; ++i) {
 		async_worker_free(pool->workers[i]); pool->workers[i] = NULL;
 	}
 	async_sem_destroy(pool->sem);
@@ -82,7 +94,7 @@ void async_pool_leave(async_pool_t *const p) {
 	async_worker_t *const w = worker;
 	assert(w);
 	async_worker_leave(w);
-	assert(pool->count < WORKER_COUNT);
+	assert(pool->count < pool->size);
 	pool->workers[pool->count++] = w;
 	if(1 == pool->count) async_sem_post(pool->sem);
 }
@@ -8,9 +8,11 @@
 struct async_thread_list {
 	async_sem_t *sem;
 	async_t *thread;
+	async_remote_t *remote;
 	async_thread_list *prev;
 	async_thread_list *next;
 	int res;
+	int woken; // Removed from the list, wakeup pending or done.
 };
 
 void async_sem_init(async_sem_t *const sem, unsigned const value, unsigned const flags) {
@@ -19,6 +21,7 @@ void async_sem_init(async_sem_t *const sem, unsigned const value, unsigned const
 	sem->tail = NULL;
 	sem->value = value;
 	sem->flags = flags;
+	uv_mutex_init(sem->lock);
 }
 void async_sem_destroy(async_sem_t *const sem) {
 	if(!sem) return;
@@ -26,30 +29,49 @@ void async_sem_destroy(async_sem_t *const sem) {
 	assert(!sem->tail);
 	sem->value = 0;
 	sem->flags = 0;
+	uv_mutex_destroy(sem->lock);
+}
+
+// Must be called with the lock held.
+static void sem_remove(async_sem_t *const sem, async_thread_list *const us) {
+	if(us->prev) us->prev->next = us->next;
+	if(us->next) us->next->prev = us->prev;
+	if(us == sem->head) sem->head = us->next;
+	if(us == sem->tail) sem->tail = us->prev;
+	us->woken = 1;
 }
 
 void async_sem_post(async_sem_t *const sem) {
 	assert(sem);
-	if(!sem->head) {
+	uv_mutex_lock(sem->lock);
+	async_thread_list *const us = sem->head;
+	if(!us) {
 		++sem->value;
+		uv_mutex_unlock(sem->lock);
 		return;
 	}
 	assert(0 == sem->value && "Thread shouldn't have been waiting");
 	assert(sem->tail && "Tail not set");
-	async_thread_list *const us = sem->head;
-	sem->head = us->next;
-	if(sem->head) sem->head->prev = NULL;
-	if(!sem->head) sem->tail = NULL;
-	async_wakeup(us->thread);
+	sem_remove(sem, us);
+	// Once we unlock, `us` can go away.
+	async_t *const thread = us->thread;
+	async_remote_t *const remote = us->remote;
+	uv_mutex_unlock(sem->lock);
+	if(remote == async_remote_current()) async_wakeup(thread);
+	else async_remote_wakeup(remote, thread);
 }
 static void timeout_cb(uv_timer_t *const timer) {
 	async_thread_list *const us = timer->data;
 	async_sem_t *const sem = us->sem;
-	if(us->prev) us->prev->next = us->next;
-	if(us->next) us->next->prev = us->prev;
-	if(us == sem->head) sem->head = us->next;
-	if(us == sem->tail) sem->tail = NULL;
+	uv_mutex_lock(sem->lock);
+	if(us->woken) {
+		// Lost the race with a post from another thread.
+		uv_mutex_unlock(sem->lock);
+		return;
+	}
+	sem_remove(sem, us);
 	us->res = UV_ETIMEDOUT;
+	uv_mutex_unlock(sem->lock);
 	async_switch(us->thread);
 }
 
@@ -58,32 +80,45 @@ int async_sem_wait(async_sem_t *const sem) {
 }
 int async_sem_trywait(async_sem_t *const sem) {
 	assert(sem);
-	if(0 == sem->value) return -1;
-	--sem->value;
-	return 0;
+	uv_mutex_lock(sem->lock);
+	int rc = -1;
+	if(sem->value) {
+		--sem->value;
+		rc = 0;
+	}
+	uv_mutex_unlock(sem->lock);
+	return rc;
 }
 int async_sem_timedwait(async_sem_t *const sem, uint64_t const future) {
 	assert(sem);
 	assert(async_main);
 	assert(async_active() != async_main); // TODO: Seems to be triggering...?
+	uv_mutex_lock(sem->lock);
 	if(sem->value) {
 		--sem->value;
+		uv_mutex_unlock(sem->lock);
 		return 0;
 	}
 	uint64_t now = 0;
 	if(future < UINT64_MAX) {
 		now = uv_now(async_loop);
-		if(now >= future) return UV_ETIMEDOUT;
+		if(now >= future) {
+			uv_mutex_unlock(sem->lock);
+			return UV_ETIMEDOUT;
+		}
 	}
 	async_thread_list us[1];
 	us->sem = sem;
 	us->thread = async_active();
+	us->remote = async_remote_current();
 	us->prev = sem->tail;
 	us->next = NULL;
 	us->res = 0;
+	us->woken = 0;
 	if(!sem->head) sem->head = us;
 	if(sem->tail) sem->tail->next = us;
 	sem->tail = us;
+	uv_mutex_unlock(sem->lock);
 
 	uv_timer_t timer[1];
 	if(future < UINT64_MAX) {
@@ -92,10 +127,17 @@ int async_sem_timedwait(async_sem_t *const sem, uint64_t const future) {
 		uv_timer_start(timer, timeout_cb, future - now, 0);
 	}
 	int rc = async_yield_flags(sem->flags);
+	if(rc < 0) {
+		// Canceled. Note that cancelable semaphores shouldn't be
+		// shared between threads, because a remote wakeup could
+		// still be pending.
+		uv_mutex_lock(sem->lock);
+		if(!us->woken) sem_remove(sem, us);
+		uv_mutex_unlock(sem->lock);
+	}
 	if(future < UINT64_MAX) {
 		async_close((uv_handle_t *)timer);
 	}
 	if(rc < 0) return rc;
 	return us->res;
 }
-
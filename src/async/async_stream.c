@@ -6,21 +6,61 @@
 #include <string.h> /* DEBUG */
 #include "async.h"
 
+// Free buffers beyond this many per thread are returned to malloc.
+// 8K * 256 = 2MB per thread at most.
+#define BUF_CACHE_MAX 256
+
 typedef struct {
 	async_t *thread;
 	int status;
 	uv_buf_t buf[1];
 } async_state;
 
+// Read buffers are recycled through a per-thread free list, linked
+// through the first bytes of each buffer.
+typedef struct async_buf_free async_buf_free;
+struct async_buf_free {
+	async_buf_free *next;
+};
+static thread_local async_buf_free *buf_cache = NULL;
+static thread_local size_t buf_cached = 0;
+
+void *async_buf_get(void) {
+	async_buf_free *const buf = buf_cache;
+	if(!buf) return malloc(ASYNC_BUF_SIZE);
+	buf_cache = buf->next;
+	buf_cached--;
+	return buf;
+}
+void async_buf_put(void *const ptr) {
+	if(!ptr) return;
+	if(buf_cached >= BUF_CACHE_MAX) {
+		free(ptr);
+		return;
+	}
+	async_buf_free *const buf = ptr;
+	buf->next = buf_cache;
+	buf_cache = buf;
+	buf_cached++;
+}
+void async_buf_trim(void) {
+	while(buf_cache) {
+		async_buf_free *const buf = buf_cache;
+		buf_cache = buf->next;
+		free(buf);
+	}
+	buf_cached = 0;
+}
+
 static void alloc_cb(uv_handle_t *const handle, size_t const suggested_size, uv_buf_t *const buf) {
-	buf->len = 1024 * 8; // suggested_size is hardcoded at 64k, which seems large
-	buf->base = malloc(buf->len);
-	assert(buf->base); // TODO
+	// suggested_size is hardcoded at 64k, which seems large
+	buf->base = async_buf_get();
+	buf->len = buf->base ? ASYNC_BUF_SIZE : 0; // libuv reports UV_ENOBUFS
 }
 static void read_cb(uv_stream_t *const stream, ssize_t const nread, uv_buf_t const *const buf) {
 	async_state *const state = stream->data;
 	if(nread < 0) {
-		free(buf->base); // buf->base = NULL;
+		async_buf_put(buf->base);
 		state->buf->base = NULL;
 		state->buf->len = 0;
 		state->status = nread;
@@ -44,7 +84,7 @@ int async_read(uv_stream_t *const stream, uv_buf_t *const out) {
 	rc = async_yield_cancelable();
 	uv_read_stop(stream);
 	if(rc < 0) {
-		free(state->buf->base);
+		async_buf_put(state->buf->base);
 		return rc;
 	}
 	out->base = state->buf->base;
@@ -12,9 +12,6 @@
 #define BUFFER_SIZE (1024 * 8)
 #define AUTH_FORM_MAX (1023+1)
 
-// TODO: Real public API.
-bool URIPath(strarg_t const URI, strarg_t const path, strarg_t *const qs);
-
 static bool emptystr(strarg_t const str) {
 	return !str || '\0' == str[0];
 }
@@ -107,10 +104,8 @@ static int send_preview(BlogRef const blog, HTTPConnectionRef const conn, SLNSes
 	return 0;
 }
 
-static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method) return -1;
-	strarg_t qs = NULL;
-	if(!URIPath(URI, "/", &qs)) return -1;
+static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
+	strarg_t const qs = match->qs;
 
 	// TODO: This is the most complicated function in the whole program.
 	// It's unbearable.
@@ -173,7 +168,7 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	uint64_t const t1 = uv_hrtime();
 
 	str_t *URIs[RESULTS_MAX];
-	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, outdir, false, URIs, (size_t)max);
+	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, outdir, SLN_URI_LIST_TEXT, URIs, (size_t)max);
 	SLNFilterPositionCleanup(pos);
 	if(count < 0) {
 		fprintf(stderr, "Filter error: %s\n", sln_strerror(count));
@@ -249,6 +244,7 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	} else {
 		HTTPConnectionWriteHeader(conn, "Cache-Control", "no-cache, private");
 	}
+	HTTPConnectionWriteContentEncoding(conn, HTTPHeadersGet(headers, "Accept-Encoding"));
 	HTTPConnectionBeginBody(conn);
 	TemplateWriteHTTPChunk(blog->header, &TemplateStaticCBs, args, conn);
 
@@ -308,9 +304,7 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 }
 
 // TODO: Lots of duplication here
-static int GET_compose(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method) return -1;
-	if(!URIPath(URI, "/compose", NULL)) return -1;
+static int GET_compose(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 
 	if(!SLNSessionHasPermission(session, SLN_WRONLY)) return 403;
 
@@ -325,6 +319,7 @@ static int GET_compose(BlogRef const blog, SLNSessionRef const session, HTTPConn
 	HTTPConnectionWriteResponse(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteContentEncoding(conn, HTTPHeadersGet(headers, "Accept-Encoding"));
 	HTTPConnectionBeginBody(conn);
 	TemplateWriteHTTPChunk(blog->compose, &TemplateStaticCBs, args, conn);
 	HTTPConnectionWriteChunkEnd(conn);
@@ -333,9 +328,7 @@ static int GET_compose(BlogRef const blog, SLNSessionRef const session, HTTPConn
 	FREE(&reponame_HTMLSafe);
 	return 0;
 }
-static int GET_upload(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method) return -1;
-	if(!URIPath(URI, "/upload", NULL)) return -1;
+static int GET_upload(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 
 	if(!SLNSessionHasPermission(session, SLN_WRONLY)) return 403;
 
@@ -350,6 +343,7 @@ static int GET_upload(BlogRef const blog, SLNSessionRef const session, HTTPConne
 	HTTPConnectionWriteResponse(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteContentEncoding(conn, HTTPHeadersGet(headers, "Accept-Encoding"));
 	HTTPConnectionBeginBody(conn);
 	TemplateWriteHTTPChunk(blog->upload, &TemplateStaticCBs, args, conn);
 	HTTPConnectionWriteChunkEnd(conn);
@@ -450,11 +444,9 @@ static int POST_post(BlogRef const blog,
                      SLNSessionRef const session,
                      HTTPConnectionRef const conn,
                      HTTPMethod const method,
-                     strarg_t const URI,
+                     HTTPRouteMatch const *const match,
                      HTTPHeadersRef const headers)
 {
-	if(HTTP_POST != method) return -1;
-	if(!URIPath(URI, "/post", NULL)) return -1;
 
 	// TODO: CSRF token
 	strarg_t const formtype = HTTPHeadersGet(headers, "content-type"); 
@@ -578,9 +570,7 @@ cleanup:
 	return 0;
 }
 
-static int GET_account(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_GET != method) return -1;
-	if(!URIPath(URI, "/account", NULL)) return -1;
+static int GET_account(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 
 	str_t *reponame_HTMLSafe = htmlenc(SLNRepoGetName(blog->repo));
 	if(!reponame_HTMLSafe) return 500;
@@ -595,6 +585,7 @@ static int GET_account(BlogRef const blog, SLNSessionRef const session, HTTPConn
 	HTTPConnectionWriteResponse(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteContentEncoding(conn, HTTPHeadersGet(headers, "Accept-Encoding"));
 	HTTPConnectionBeginBody(conn);
 	TemplateWriteHTTPChunk(blog->login, &TemplateStaticCBs, args, conn);
 	HTTPConnectionWriteChunkEnd(conn);
@@ -603,9 +594,7 @@ static int GET_account(BlogRef const blog, SLNSessionRef const session, HTTPConn
 	FREE(&reponame_HTMLSafe);
 	return 0;
 }
-static int POST_auth(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	if(HTTP_POST != method) return -1;
-	if(!URIPath(URI, "/auth", NULL)) return -1;
+static int POST_auth(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPRouteMatch const *const match, HTTPHeadersRef const headers) {
 
 	// TODO: Check that Content-Type is application/x-www-form-urlencoded.
 
@@ -657,6 +646,28 @@ static int POST_auth(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	return 0;
 }
 
+#define GET HTTP_ROUTE_METHOD(HTTP_GET)
+#define POST HTTP_ROUTE_METHOD(HTTP_POST)
+typedef int (*BlogRouteHandler)(BlogRef const, SLNSessionRef const, HTTPConnectionRef const, HTTPMethod const, HTTPRouteMatch const *const, HTTPHeadersRef const);
+static HTTPRoute const routes[] = {
+	{ GET, "/" },
+	{ GET, "/compose" },
+	{ GET, "/upload" },
+	{ POST, "/post" },
+	{ GET, "/account" },
+	{ POST, "/auth" },
+};
+static BlogRouteHandler const handlers[numberof(routes)] = {
+	GET_query,
+	GET_compose,
+	GET_upload,
+	POST_post,
+	GET_account,
+	POST_auth,
+};
+#undef GET
+#undef POST
+
 void BlogFree(BlogRef *const blogptr);
 
 static bool load_template(BlogRef const blog, strarg_t const name, TemplateRef *const out) {
@@ -692,6 +703,11 @@ BlogRef BlogCreate(SLNRepoRef const repo) {
 	// If not, we'll find out when we try to load a template.
 	(void)async_fs_symlink(INSTALL_PREFIX "/share/stronglink/blog", blog->dir, 0);
 
+	if(HTTPRouterCreate(routes, numberof(routes), &blog->router) < 0) {
+		BlogFree(&blog);
+		return NULL;
+	}
+
 	if(
 		!load_template(blog, "header.html", &blog->header) ||
 		!load_template(blog, "footer.html", &blog->footer) ||
@@ -724,6 +740,7 @@ void BlogFree(BlogRef *const blogptr) {
 
 	FREE(&blog->dir);
 	FREE(&blog->cacheDir);
+	HTTPRouterFree(&blog->router);
 
 	TemplateFree(&blog->header);
 	TemplateFree(&blog->footer);
@@ -761,13 +778,10 @@ static strarg_t exttype(strarg_t const ext) {
 	return NULL;
 }
 int BlogDispatch(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
-	int rc = -1;
-	rc = rc >= 0 ? rc : GET_query(blog, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_compose(blog, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_upload(blog, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : POST_post(blog, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : GET_account(blog, session, conn, method, URI, headers);
-	rc = rc >= 0 ? rc : POST_auth(blog, session, conn, method, URI, headers);
+	HTTPRouteMatch match[1];
+	int rc = HTTPRouterMatch(blog->router, method, URI, match);
+	if(rc >= 0) rc = handlers[match->route](blog, session, conn, method, match, headers);
+	else rc = -1;
 
 	if(403 == rc) {
 		HTTPConnectionSendRedirect(conn, 303, "/account");
@@ -3,6 +3,7 @@
 
 #include "../http/HTTPServer.h"
 #include "../http/HTTPHeaders.h"
+#include "../http/HTTPRouter.h"
 #include "../http/MultipartForm.h"
 #include "../http/QueryString.h"
 #include "../StrongLink.h"
@@ -17,6 +18,7 @@ struct Blog {
 
 	str_t *dir;
 	str_t *cacheDir;
+	HTTPRouterRef router;
 
 	TemplateRef header;
 	TemplateRef footer;
@@ -86,6 +86,9 @@ static int convert(BlogRef const blog,
 	yajl_gen_config(json, yajl_gen_print_callback, (void (*)())SLNSubmissionWrite, meta);
 	yajl_gen_config(json, yajl_gen_beautify, (int)true);
 
+	// The converter writes from a worker, where hashing can't be waited on.
+	rc = SLNSubmissionWait(meta);
+	if(rc < 0) goto cleanup;
 	async_pool_enter(NULL);
 	yajl_gen_map_open(json);
 	rc = converter(html, json, buf, src->size, src->type);
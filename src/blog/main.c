@@ -12,6 +12,15 @@
 
 #define SERVER_ADDRESS NULL // NULL = public, "localhost" = private
 #define SERVER_PORT "8000"
+#define SERVER_LOOPS 0 // 0 = one per CPU
+// Each loop has its own worker pool, so the workers are divided between
+// them instead of every loop getting this many.
+#define SERVER_WORKERS 16
+#define SERVER_WORKERS_MIN 4 // Per loop
+
+// Milliseconds to hold each commit open for other uploads to join. Trades
+// upload latency for fewer syncs under heavy write load. Default 0.
+#define REPO_COMMIT_DELAY_ENV "STRONGLINK_COMMIT_DELAY"
 
 int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
 
@@ -22,6 +31,7 @@ static HTTPServerRef server = NULL;
 static uv_signal_t sigpipe[1] = {};
 static uv_signal_t sigint[1] = {};
 static int sig = 0;
+static unsigned loops = 1;
 
 static void listener(void *ctx, HTTPConnectionRef const conn) {
 	HTTPMethod method;
@@ -69,12 +79,14 @@ static void init(void *const unused) {
 
 	str_t *tmp = strdup(path);
 	strarg_t const reponame = basename(tmp); // TODO
-	repo = SLNRepoCreate(path, reponame);
+	repo = SLNRepoCreate(path, reponame, getenv(SLN_HASH_ALGOS_ENV));
 	FREE(&tmp);
 	if(!repo) {
 		fprintf(stderr, "Repository could not be opened\n");
 		return;
 	}
+	strarg_t const delay = getenv(REPO_COMMIT_DELAY_ENV);
+	if(delay) SLNRepoSetCommitDelay(repo, strtoull(delay, NULL, 10));
 	blog = BlogCreate(repo);
 	if(!blog) {
 		fprintf(stderr, "Blog server could not be initialized\n");
@@ -85,7 +97,8 @@ static void init(void *const unused) {
 		fprintf(stderr, "Web server could not be initialized\n");
 		return;
 	}
-	int rc = HTTPServerListen(server, SERVER_ADDRESS, SERVER_PORT);
+	int rc = HTTPServerSetLoopCount(server, loops);
+	if(rc >= 0) rc = HTTPServerListen(server, SERVER_ADDRESS, SERVER_PORT);
 	if(rc < 0) {
 		fprintf(stderr, "Unable to start server (%d, %s)", rc, sln_strerror(rc));
 		return;
@@ -127,6 +140,19 @@ int main(int const argc, char const *const *const argv) {
 	if(!getenv("UV_THREADPOOL_SIZE")) putenv((char *)"UV_THREADPOOL_SIZE=4");
 
 	raiserlimit();
+
+	loops = SERVER_LOOPS;
+	if(!loops) {
+		uv_cpu_info_t *info;
+		int count;
+		if(uv_cpu_info(&info, &count) >= 0) {
+			loops = count;
+			uv_free_cpu_info(info, count);
+		}
+	}
+	if(!loops) loops = 1;
+	async_pool_set_size(MAX(SERVER_WORKERS / loops, SERVER_WORKERS_MIN));
+
 	async_init();
 
 	// TODO: Real option parsing.
@@ -70,6 +70,9 @@ int db_cursor_clear(DB_cursor *const cursor);
 int db_cursor_cmp(DB_cursor *const cursor, DB_val const *const a, DB_val const *const b);
 
 int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data);
+// The key must not point into the cursor's own current key or data
+// (e.g. from db_cursor_current on the same cursor), since some back-ends
+// invalidate those as soon as the cursor moves. Copy it first.
 int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir);
 int db_cursor_first(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir);
 int db_cursor_next(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir);
@@ -2,6 +2,7 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -113,11 +114,16 @@ static int mdb_cursor_seek(MDB_cursor *const cursor, MDB_val *const key, MDB_val
 	} else return rc;
 }
 
+// By default, keys and values point directly into the iterator and are only
+// valid until the cursor is moved. The transaction's shared cursor (used by
+// db_get and db_read_string) keeps copies in a small ring instead, because
+// callers there commonly hold onto several results at once.
 #define LDB_BUF_RECALL (10*2)
 struct LDB_cursor {
 	leveldb_iterator_t *iter;
 	MDB_cmp_func *cmp;
 	unsigned char valid;
+	unsigned char copy;
 	unsigned char offset;
 	char *bufs[LDB_BUF_RECALL];
 };
@@ -148,6 +154,7 @@ static void ldb_cursor_close(LDB_cursor *const cursor) {
 	leveldb_iter_destroy(cursor->iter); cursor->iter = NULL;
 	cursor->cmp = NULL;
 	cursor->valid = 0;
+	cursor->copy = 0;
 	cursor->offset = 0;
 	assert_zeroed(cursor, 1);
 	free(cursor);
@@ -169,42 +176,63 @@ static int ldb_cursor_renew(leveldb_t *const db, leveldb_readoptions_t *const ro
 	cursor->offset = 0;
 	return 0;
 }
+static int ldb_cursor_copy(LDB_cursor *const cursor, char const *const x, size_t const s, MDB_val *const out) {
+	leveldb_free(cursor->bufs[cursor->offset]); cursor->bufs[cursor->offset] = NULL;
+	char *const y = malloc(s);
+	if(!y) return DB_ENOMEM;
+	memcpy(y, x, s);
+	cursor->bufs[cursor->offset] = y;
+	out->mv_size = s;
+	out->mv_data = y;
+	cursor->offset = (cursor->offset + 1) % LDB_BUF_RECALL;
+	return 0;
+}
 static int ldb_cursor_current(LDB_cursor *const cursor, MDB_val *const key, MDB_val *const val) {
 	if(!cursor) return DB_EINVAL;
 	if(!cursor->valid) return DB_NOTFOUND;
 	if(key) {
-		leveldb_free(cursor->bufs[cursor->offset]); cursor->bufs[cursor->offset] = NULL;
-
 		size_t s;
-		char const *const x = (char *)leveldb_iter_key(cursor->iter, &s);
-		char *const y = malloc(s);
-		if(!y) return DB_ENOMEM;
-		memcpy(y, x, s);
-
-		cursor->bufs[cursor->offset] = y;
-		key->mv_size = s;
-		key->mv_data = y;
-		cursor->offset = (cursor->offset + 1) % LDB_BUF_RECALL;
+		char const *const x = leveldb_iter_key(cursor->iter, &s);
+		if(cursor->copy) {
+			int rc = ldb_cursor_copy(cursor, x, s, key);
+			if(rc < 0) return rc;
+		} else {
+			key->mv_size = s;
+			key->mv_data = (char *)x;
+		}
 	}
 	if(val) {
-		leveldb_free(cursor->bufs[cursor->offset]); cursor->bufs[cursor->offset] = NULL;
-
 		size_t s;
-		char const *const x = (char *)leveldb_iter_value(cursor->iter, &s);
-		char *const y = malloc(s);
-		if(!y) return DB_ENOMEM;
-		memcpy(y, x, s);
-
-		cursor->bufs[cursor->offset] = y;
-		val->mv_size = s;
-		val->mv_data = y;
-		cursor->offset = (cursor->offset + 1) % LDB_BUF_RECALL;
+		char const *const x = leveldb_iter_value(cursor->iter, &s);
+		if(cursor->copy) {
+			int rc = ldb_cursor_copy(cursor, x, s, val);
+			if(rc < 0) return rc;
+		} else {
+			val->mv_size = s;
+			val->mv_data = (char *)x;
+		}
 	}
 	return 0;
 }
+#ifndef NDEBUG
+static int ldb_cursor_aliases(LDB_cursor *const cursor, MDB_val const *const x) {
+	if(!cursor->valid || !x->mv_size) return 0;
+	uintptr_t const a = (uintptr_t)x->mv_data;
+	size_t ks, vs;
+	uintptr_t const k = (uintptr_t)leveldb_iter_key(cursor->iter, &ks);
+	uintptr_t const v = (uintptr_t)leveldb_iter_value(cursor->iter, &vs);
+	if(a < k+ks && k < a+x->mv_size) return 1;
+	if(a < v+vs && v < a+x->mv_size) return 1;
+	return 0;
+}
+#endif
 static int ldb_cursor_seek(LDB_cursor *const cursor, MDB_val *const key, MDB_val *const val, int const dir) {
 	if(!cursor) return DB_EINVAL;
 	if(!key) return DB_EINVAL;
+	// Note: the search key must not point into this cursor's own
+	// (uncopied) results, since we still need it after the iterator moves.
+	// Unlike MDB, seeking invalidates them.
+	assert(!ldb_cursor_aliases(cursor, key));
 	MDB_val const orig = *key;
 	leveldb_iter_seek(cursor->iter, key->mv_data, key->mv_size);
 	cursor->valid = !!leveldb_iter_valid(cursor->iter);
@@ -475,6 +503,7 @@ int db_txn_cursor(DB_txn *const txn, DB_cursor **const out) {
 	if(!txn->cursor) {
 		int rc = db_cursor_open(txn, &txn->cursor);
 		if(rc < 0) return rc;
+		txn->cursor->persist->copy = 1;
 	}
 	if(out) *out = txn->cursor;
 	return 0;
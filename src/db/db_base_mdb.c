@@ -27,7 +27,8 @@ int db_env_set_mapsize(DB_env *const env, size_t const size) {
 	return mdberr(mdb_env_set_mapsize((MDB_env *)env, size));
 }
 int db_env_open(DB_env *const env, char const *const name, unsigned const flags, unsigned const mode) {
-	int rc = mdberr(mdb_env_open((MDB_env *)env, name, flags | MDB_NOSUBDIR, mode));
+	// MDB_NOTLS because read transactions can move between pool threads.
+	int rc = mdberr(mdb_env_open((MDB_env *)env, name, flags | MDB_NOSUBDIR | MDB_NOTLS, mode));
 	if(rc < 0) return rc;
 	MDB_txn *txn;
 	rc = mdberr(mdb_txn_begin((MDB_env *)env, NULL, 0, &txn));
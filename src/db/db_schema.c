@@ -118,6 +118,33 @@ uint64_t db_next_id(dbid_t const table, DB_txn *const txn) {
 	return db_read_uint64(prev)+1;
 }
 
+int db_ids_seed(DB_ids *const ids, dbid_t const table, DB_txn *const txn) {
+	assert(ids);
+	uint64_t const next = db_next_id(table, txn);
+	if(!next) return DB_EIO;
+	ids->table = table;
+	ids->committed = next;
+	ids->pending = next;
+	return 0;
+}
+uint64_t db_ids_next(DB_ids const *const ids) {
+	assert(ids);
+	assert(ids->pending);
+	return ids->pending;
+}
+void db_ids_claim(DB_ids *const ids, uint64_t const id) {
+	assert(ids);
+	if(id >= ids->pending) ids->pending = id+1;
+}
+void db_ids_commit(DB_ids *const ids) {
+	assert(ids);
+	ids->committed = ids->pending;
+}
+void db_ids_abort(DB_ids *const ids) {
+	assert(ids);
+	ids->pending = ids->committed;
+}
+
 
 // Inline strings can be up to 96 bytes including nul. Longer strings are
 // truncated at 64 bytes (including nul), followed by the 32-byte SHA-256 hash.
@@ -217,6 +244,284 @@ void db_bind_string_len(DB_val *const val, char const *const str, size_t const l
 }
 
 
+// Block header is the entry count and last ID, so appending only needs to
+// look at the front of the last block.
+static void postings_header(DB_val *const val, uint64_t *const count, uint64_t *const last) {
+	*count = db_read_uint64(val);
+	*last = db_read_uint64(val);
+	db_assertf(*count && *count <= DB_POSTINGS_MAX, "Invalid postings block (%llu)", (unsigned long long)*count);
+}
+static void postings_bind_entry(DB_val *const val, uint64_t const delta, uint64_t const *const positions, size_t const count) {
+	db_bind_uint64(val, delta);
+	db_bind_uint64(val, count);
+	uint64_t prev = 0;
+	for(size_t i = 0; i < count; ++i) {
+		assert(!i || positions[i] > prev);
+		db_bind_uint64(val, positions[i] - prev);
+		prev = positions[i];
+	}
+}
+int db_postings_append(DB_txn *const txn, DB_range const *const range, uint64_t const id, uint64_t const *const positions, size_t const count) {
+	assert(txn);
+	assert(range);
+	assert(range->min->size <= DB_POSTINGS_PREFIX_MAX);
+	DB_cursor *cursor = NULL;
+	int rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+
+	DB_val key[1];
+	DB_VAL_STORAGE(key, DB_POSTINGS_PREFIX_MAX + DB_VARINT_MAX);
+	DB_val prev[1], old[1];
+	uint64_t total = 0, last = 0;
+	rc = db_cursor_firstr(cursor, range, prev, old, -1);
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	if(rc >= 0) {
+		postings_header(old, &total, &last);
+		if(id == last) return DB_KEYEXIST;
+		if(id < last) return DB_EINVAL;
+	}
+
+	size_t const entry = DB_VARINT_MAX * (2 + count);
+	bool const extend = total && total < DB_POSTINGS_MAX &&
+		old->size + entry <= DB_POSTINGS_BYTES;
+	DB_val val[1] = {{ 0, NULL }};
+	val->data = malloc(DB_VARINT_MAX * 2 + (extend ? old->size : 0) + entry);
+	if(!val->data) return DB_ENOMEM;
+	if(extend) {
+		memcpy(key->data, prev->data, prev->size);
+		key->size = prev->size;
+		db_bind_uint64(val, total+1);
+		db_bind_uint64(val, id);
+		memcpy((unsigned char *)val->data + val->size, old->data, old->size);
+		val->size += old->size;
+		postings_bind_entry(val, id - last, positions, count);
+	} else {
+		memcpy(key->data, range->min->data, range->min->size);
+		key->size = range->min->size;
+		db_bind_uint64(key, id);
+		db_bind_uint64(val, 1);
+		db_bind_uint64(val, id);
+		postings_bind_entry(val, 0, positions, count);
+	}
+	rc = db_put(txn, key, val, 0);
+	FREE(&val->data);
+	return rc;
+}
+
+struct DB_postings {
+	DB_cursor *cursor;
+	DB_range range[1];
+	unsigned char min[DB_POSTINGS_PREFIX_MAX];
+	unsigned char max[DB_POSTINGS_PREFIX_MAX];
+
+	unsigned char *block; // Copy of the current block
+	size_t size;
+	size_t asize;
+	uint64_t ids[DB_POSTINGS_MAX];
+	size_t offsets[DB_POSTINGS_MAX]; // Start of each entry's positions
+	size_t count;
+	size_t cur; // count if invalid
+
+	uint64_t *positions;
+	size_t psize;
+};
+
+int db_postings_renew(DB_txn *const txn, DB_range const *const range, DB_postings **const out) {
+	assert(range);
+	assert(out);
+	if(range->min->size > DB_POSTINGS_PREFIX_MAX) return DB_EINVAL;
+	if(range->max->size > DB_POSTINGS_PREFIX_MAX) return DB_EINVAL;
+	DB_postings *postings = *out;
+	if(!postings) {
+		postings = calloc(1, sizeof(DB_postings));
+		if(!postings) return DB_ENOMEM;
+		*out = postings;
+	}
+	int rc = db_cursor_renew(txn, &postings->cursor);
+	if(rc < 0) return rc;
+	memcpy(postings->min, range->min->data, range->min->size);
+	memcpy(postings->max, range->max->data, range->max->size);
+	*postings->range->min = (DB_val){ range->min->size, postings->min };
+	*postings->range->max = (DB_val){ range->max->size, postings->max };
+	postings->count = 0;
+	postings->cur = 0;
+	return 0;
+}
+void db_postings_close(DB_postings *const postings) {
+	if(!postings) return;
+	db_cursor_close(postings->cursor); postings->cursor = NULL;
+	FREE(&postings->block);
+	FREE(&postings->positions);
+	free(postings);
+}
+void db_postings_clear(DB_postings *const postings) {
+	if(!postings) return;
+	db_cursor_clear(postings->cursor);
+	postings->count = 0;
+	postings->cur = 0;
+}
+
+static int postings_load(DB_postings *const postings, int const rc, DB_val const *const key, DB_val const *const val) {
+	postings->count = 0;
+	postings->cur = 0;
+	if(rc < 0) return rc;
+	if(val->size > postings->asize) {
+		FREE(&postings->block);
+		postings->block = malloc(val->size);
+		if(!postings->block) {
+			postings->asize = 0;
+			return DB_ENOMEM;
+		}
+		postings->asize = val->size;
+	}
+	memcpy(postings->block, val->data, val->size);
+	postings->size = val->size;
+
+	DB_val k = { key->size, key->data };
+	db_assert(k.size > postings->range->min->size);
+	k.data = (unsigned char *)k.data + postings->range->min->size;
+	k.size -= postings->range->min->size;
+	uint64_t id = db_read_uint64(&k);
+
+	DB_val v = { postings->size, postings->block };
+	uint64_t count, last;
+	postings_header(&v, &count, &last);
+	for(size_t i = 0; i < count; ++i) {
+		id += db_read_uint64(&v);
+		postings->ids[i] = id;
+		postings->offsets[i] = postings->size - v.size;
+		uint64_t const n = db_read_uint64(&v);
+		for(uint64_t j = 0; j < n; ++j) db_read_uint64(&v);
+	}
+	db_assert(id == last);
+	postings->count = count;
+	return 0;
+}
+static void postings_key(DB_postings const *const postings, uint64_t const id, unsigned char *const buf, DB_val *const out) {
+	*out = (DB_val){ postings->range->min->size, buf };
+	memcpy(buf, postings->range->min->data, postings->range->min->size);
+	db_bind_uint64(out, id);
+}
+static int postings_result(DB_postings *const postings, uint64_t *const id) {
+	if(postings->cur >= postings->count) return DB_NOTFOUND;
+	if(id) *id = postings->ids[postings->cur];
+	return 0;
+}
+
+int db_postings_current(DB_postings *const postings, uint64_t *const id) {
+	assert(postings);
+	return postings_result(postings, id);
+}
+int db_postings_first(DB_postings *const postings, uint64_t *const id, int const dir) {
+	assert(postings);
+	if(0 == dir) return DB_EINVAL;
+	DB_val key[1], val[1];
+	int rc = db_cursor_firstr(postings->cursor, postings->range, key, val, dir);
+	rc = postings_load(postings, rc, key, val);
+	if(rc < 0) return rc;
+	postings->cur = dir > 0 ? 0 : postings->count-1;
+	return postings_result(postings, id);
+}
+int db_postings_seek(DB_postings *const postings, uint64_t *const id, int const dir) {
+	assert(postings);
+	assert(id);
+	uint64_t const target = *id;
+	unsigned char buf[DB_POSTINGS_PREFIX_MAX + DB_VARINT_MAX];
+	DB_val key[1], val[1];
+	postings_key(postings, target, buf, key);
+
+	// The block whose first ID is <= target is the only one that can hold it.
+	int rc = db_cursor_seekr(postings->cursor, postings->range, key, val, -1);
+	bool const found = rc >= 0;
+	rc = postings_load(postings, rc, key, val);
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	size_t i = 0;
+	if(found) {
+		size_t lo = 0, hi = postings->count;
+		while(lo < hi) {
+			size_t const mid = lo + (hi - lo) / 2;
+			if(postings->ids[mid] < target) lo = mid+1;
+			else hi = mid;
+		}
+		i = lo; // First entry >= target
+	}
+	if(found && i < postings->count && postings->ids[i] == target) {
+		postings->cur = i;
+		*id = target;
+		return 0;
+	}
+	if(0 == dir) {
+		db_postings_clear(postings);
+		return DB_NOTFOUND;
+	}
+	if(dir < 0) {
+		if(!found) return DB_NOTFOUND;
+		assert(i > 0);
+		postings->cur = i-1;
+		return postings_result(postings, id);
+	}
+	if(found && i < postings->count) {
+		postings->cur = i;
+		return postings_result(postings, id);
+	}
+	if(found) {
+		rc = db_cursor_nextr(postings->cursor, postings->range, key, val, +1);
+	} else {
+		postings_key(postings, target, buf, key);
+		rc = db_cursor_seekr(postings->cursor, postings->range, key, val, +1);
+	}
+	rc = postings_load(postings, rc, key, val);
+	if(rc < 0) return rc;
+	return postings_result(postings, id);
+}
+int db_postings_next(DB_postings *const postings, uint64_t *const id, int const dir) {
+	assert(postings);
+	if(0 == dir) return DB_EINVAL;
+	if(postings->cur >= postings->count) return DB_NOTFOUND;
+	if(dir > 0 && postings->cur+1 < postings->count) {
+		postings->cur++;
+		return postings_result(postings, id);
+	}
+	if(dir < 0 && postings->cur > 0) {
+		postings->cur--;
+		return postings_result(postings, id);
+	}
+	DB_val key[1], val[1];
+	int rc = db_cursor_nextr(postings->cursor, postings->range, key, val, dir);
+	rc = postings_load(postings, rc, key, val);
+	if(rc < 0) return rc;
+	postings->cur = dir > 0 ? 0 : postings->count-1;
+	return postings_result(postings, id);
+}
+int db_postings_positions(DB_postings *const postings, uint64_t const **const positions, size_t *const count) {
+	assert(postings);
+	assert(positions);
+	assert(count);
+	if(postings->cur >= postings->count) return DB_NOTFOUND;
+	DB_val v = {
+		postings->size - postings->offsets[postings->cur],
+		postings->block + postings->offsets[postings->cur],
+	};
+	uint64_t const n = db_read_uint64(&v);
+	if(n > postings->psize) {
+		FREE(&postings->positions);
+		postings->positions = malloc(sizeof(uint64_t) * n);
+		if(!postings->positions) {
+			postings->psize = 0;
+			return DB_ENOMEM;
+		}
+		postings->psize = n;
+	}
+	uint64_t x = 0;
+	for(uint64_t i = 0; i < n; ++i) {
+		x += db_read_uint64(&v);
+		postings->positions[i] = x;
+	}
+	*positions = postings->positions;
+	*count = n;
+	return 0;
+}
+
 void db_range_genmax(DB_range *const range) {
 	assert(range);
 	assert(range->min);
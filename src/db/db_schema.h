@@ -41,11 +41,47 @@ void db_bind_uint64(DB_val *const val, uint64_t const x);
 
 uint64_t db_next_id(dbid_t const table, DB_txn *const txn);
 
+// Cached version of db_next_id for hot tables. Seed it once, then use
+// db_ids_next/db_ids_claim within write transactions and call
+// db_ids_commit/db_ids_abort alongside db_txn_commit/db_txn_abort.
+// Not thread-safe: writers using the same DB_ids must be serialized.
+typedef struct {
+	dbid_t table;
+	uint64_t committed;
+	uint64_t pending;
+} DB_ids;
+int db_ids_seed(DB_ids *const ids, dbid_t const table, DB_txn *const txn);
+uint64_t db_ids_next(DB_ids const *const ids);
+void db_ids_claim(DB_ids *const ids, uint64_t const id);
+void db_ids_commit(DB_ids *const ids);
+void db_ids_abort(DB_ids *const ids);
+
 #define DB_INLINE_MAX 96
 char const *db_read_string(DB_val *const val, DB_txn *const txn);
 void db_bind_string(DB_val *const val, char const *const str, DB_txn *const txn);
 void db_bind_string_len(DB_val *const val, char const *const str, size_t const len, int const nulterm, DB_txn *const txn);
 
+// Posting lists: sorted, unique IDs, each with an optional list of sorted
+// positions, stored in blocks under a common key prefix (range->min).
+// Each block's key is the prefix followed by the first ID it holds, so the
+// block keys double as skip pointers. Blocks are delta+varint encoded:
+// entry count, last ID, then per entry the ID delta, position count and
+// position deltas. IDs must be appended in increasing order.
+#define DB_POSTINGS_MAX 128 // Entries per block
+#define DB_POSTINGS_BYTES (1024 * 4) // Blocks stop growing past this size
+#define DB_POSTINGS_PREFIX_MAX (DB_VARINT_MAX + DB_INLINE_MAX * 2)
+int db_postings_append(DB_txn *const txn, DB_range const *const range, uint64_t const id, uint64_t const *const positions, size_t const count);
+
+typedef struct DB_postings DB_postings;
+int db_postings_renew(DB_txn *const txn, DB_range const *const range, DB_postings **const out);
+void db_postings_close(DB_postings *const postings);
+void db_postings_clear(DB_postings *const postings);
+int db_postings_current(DB_postings *const postings, uint64_t *const id);
+int db_postings_first(DB_postings *const postings, uint64_t *const id, int const dir);
+int db_postings_seek(DB_postings *const postings, uint64_t *const id, int const dir);
+int db_postings_next(DB_postings *const postings, uint64_t *const id, int const dir);
+int db_postings_positions(DB_postings *const postings, uint64_t const **const positions, size_t *const count);
+
 // Increments range->min to fill in range->max.
 // Assumes lexicographic ordering. Don't use it if you changed cmp functions.
 void db_range_genmax(DB_range *const range);
@@ -13,11 +13,25 @@ static int filtercmp(SLNFilter *const a, SLNFilter *const b, int const dir) {
 	if(afile < bfile) return -dir;
 	return 0;
 }
-static int filtercmp_fwd(SLNFilter *const *const a, SLNFilter *const *const b) {
-	return filtercmp(*a, *b, +1);
-}
-static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
-	return filtercmp(*a, *b, -1);
+
+// Sub-filters are also kept in a binary heap ordered by current position, so
+// heap[0] is always the next result and each step costs O(log n) per
+// sub-filter that shared the old position. The filters array keeps parse
+// order so that printing (and therefore cache keys) doesn't depend on where
+// the filter was last positioned.
+static void heap_down(SLNFilter **const filters, size_t const count, size_t i, int const dir) {
+	for(;;) {
+		size_t const l = i*2+1;
+		size_t const r = i*2+2;
+		size_t x = i;
+		if(l < count && filtercmp(filters[l], filters[x], dir) < 0) x = l;
+		if(r < count && filtercmp(filters[r], filters[x], dir) < 0) x = r;
+		if(x == i) return;
+		SLNFilter *const tmp = filters[i];
+		filters[i] = filters[x];
+		filters[x] = tmp;
+		i = x;
+	}
 }
 
 @implementation SLNCollectionFilter
@@ -27,6 +41,7 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 	}
 	assert_zeroed(filters, count);
 	FREE(&filters); filters = NULL;
+	FREE(&heap); heap = NULL;
 	count = 0;
 	asize = 0;
 	sort = 0;
@@ -42,9 +57,13 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 	if(count+1 > asize) {
 		asize = MAX(8, asize * 2);
 		filters = reallocarray(filters, asize, sizeof(filters[0]));
+		heap = reallocarray(heap, asize, sizeof(heap[0]));
 		assert(filters); // TODO
+		assert(heap); // TODO
 	}
-	filters[count++] = filter;
+	filters[count] = filter;
+	heap[count] = filter;
+	count++;
 	return 0;
 }
 
@@ -71,34 +90,35 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 		if(sortID) *sortID = invalid(dir);
 		if(fileID) *fileID = invalid(dir);
 	}
-	[filters[0] current:dir :sortID :fileID];
+	[heap[0] current:dir :sortID :fileID];
 }
 - (void)step:(int const)dir {
 	assert(count);
 	assert(0 != dir);
 	assert(0 != sort); // Means we don't have a valid position.
 	uint64_t oldSortID, oldFileID;
-	[filters[0] current:dir :&oldSortID :&oldFileID];
+	[heap[0] current:dir :&oldSortID :&oldFileID];
 	if((dir > 0) != (sort > 0)) {
 		// Flip directions. Inexact sub-filters must be repositioned.
 		[self seek:dir :oldSortID :oldFileID];
 	}
-	[filters[0] step:dir];
-	for(size_t i = 1; i < count; i++) {
+	// Each sub-filter at the old position is stepped once. The bound only
+	// matters at the end, where exhausted sub-filters don't move.
+	for(size_t i = 0; i < count; i++) {
+		[heap[0] step:dir];
+		heap_down(heap, count, 0, dir);
 		uint64_t curSortID, curFileID;
-		[filters[i] current:dir :&curSortID :&curFileID];
+		[heap[0] current:dir :&curSortID :&curFileID];
 		if(curSortID != oldSortID || curFileID != oldFileID) break;
-		[filters[i] step:dir];
 	}
-	[self sort:dir];
+	sort = dir;
 }
 
 - (void)sort:(int const)dir {
 	assert(0 != dir);
-	int (*cmp)();
-	if(dir > 0) cmp = filtercmp_fwd;
-	if(dir < 0) cmp = filtercmp_rev;
-	qsort(filters, count, sizeof(filters[0]), cmp);
+	for(size_t i = count/2; i-- > 0;) {
+		heap_down(heap, count, i, dir);
+	}
 	sort = dir;
 }
 @end
@@ -107,12 +127,12 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 - (SLNFilterType)type {
 	return SLNIntersectionFilterType;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(intersection\n");
-	for(size_t i = 0; i < count; i++) [filters[i] print:depth+1];
-	indent(depth);
-	fprintf(stderr, ")\n");
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(intersection\n");
+	for(size_t i = 0; i < count; i++) [filters[i] print:file :depth+1];
+	indent(file, depth);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	if(!count) return wr(data, size, "");
@@ -151,12 +171,12 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 - (SLNFilterType)type {
 	return SLNUnionFilterType;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(union\n");
-	for(size_t i = 0; i < count; i++) [filters[i] print:depth+1];
-	indent(depth);
-	fprintf(stderr, ")\n");
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(union\n");
+	for(size_t i = 0; i < count; i++) [filters[i] print:file :depth+1];
+	indent(file, depth);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	size_t len = 0;
@@ -30,9 +30,11 @@
 	}
 	return DB_EINVAL;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(uri \"%s\")\n", URI);
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(uri ");
+	print_string(file, URI);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, URI);
@@ -120,9 +122,11 @@
 	}
 	return DB_EINVAL;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(target \"%s\")\n", targetURI);
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(target ");
+	print_string(file, targetURI);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	size_t len = 0;
@@ -195,9 +199,9 @@
 - (SLNFilterType)type {
 	return SLNAllFilterType;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(all)\n");
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(all)\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, "*");
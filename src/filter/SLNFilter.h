@@ -30,7 +30,7 @@
 - (strarg_t)stringArg:(size_t const)i;
 - (int)addStringArg:(strarg_t const)str :(size_t const)len;
 - (int)addFilterArg:(SLNFilter *const)filter;
-- (void)print:(size_t const)depth;
+- (void)print:(FILE *const)file :(size_t const)depth;
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth;
 
 - (int)prepare:(DB_txn *const)txn;
@@ -41,6 +41,14 @@
 - (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID;
 @end
 
+// One remembered -fastAge:: result. If earliest is valid, it's the
+// file's earliest matching meta-file overall. Otherwise there's no match at
+// or before bound.
+struct age_memo {
+	uint64_t fileID;
+	uint64_t earliest;
+	uint64_t bound;
+};
 @interface SLNIndirectFilter : SLNFilter
 {
 	DB_txn *curtxn;
@@ -48,6 +56,7 @@
 	DB_cursor *step_files;
 	DB_cursor *age_uris;
 	DB_cursor *age_metafiles;
+	struct age_memo *memo; // Cleared by -prepare:
 }
 - (int)prepare:(DB_txn *const)txn;
 - (void)seek:(int const)dir :(uint64_t const)sortID :(uint64_t const)fileID;
@@ -55,6 +64,7 @@
 - (void)step:(int const)dir;
 - (SLNAgeRange)fullAge:(uint64_t const)fileID;
 - (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID;
+- (uint64_t)uncachedAge:(uint64_t const)fileID :(uint64_t const)sortID;
 @end
 @interface SLNIndirectFilter (Abstract)
 - (uint64_t)seekMeta:(int const)dir :(uint64_t const)sortID;
@@ -71,32 +81,36 @@
 
 struct token {
 	str_t *str;
+	DB_postings *postings; // SLNTermPostings
 };
+// Multiple tokens are treated as a phrase: every token must appear in the
+// meta-file, at consecutive positions.
 @interface SLNFulltextFilter : SLNIndirectFilter
 {
 	str_t *term;
 	struct token *tokens;
 	size_t count;
 	size_t asize;
-	DB_cursor *metafiles;
-	DB_cursor *phrase; // TODO
-	DB_cursor *match;
+	DB_postings *metafiles;
 }
+- (uint64_t)align:(int const)dir :(uint64_t)sortID;
+- (bool)phrase:(uint64_t const)metaFileID;
 @end
 
 @interface SLNMetadataFilter : SLNIndirectFilter
 {
 	str_t *field;
 	str_t *value;
-	DB_cursor *metafiles;
-	DB_cursor *match;
+	DB_postings *metafiles; // SLNFieldValuePostings
+	DB_postings *match;
 }
 @end
 
 // SLNCollectionFilter.m
 @interface SLNCollectionFilter : SLNFilter
 {
-	SLNFilter **filters;
+	SLNFilter **filters; // In parse order
+	SLNFilter **heap; // Same filters, by current position
 	size_t count;
 	size_t asize;
 	int sort;
@@ -181,8 +195,19 @@ static uint64_t invalid(int const dir) {
 	return 0;
 }
 
-static void indent(size_t const depth) {
-	for(size_t i = 0; i < depth; i++) fputc('\t', stderr);
+static void indent(FILE *const file, size_t const depth) {
+	for(size_t i = 0; i < depth; i++) fputc('\t', file);
+}
+// Printed filters are used as cache keys, so strings have to be escaped
+// for different filters to never print the same.
+static void print_string(FILE *const file, strarg_t const str) {
+	if(!str) return (void)fputs("nil", file);
+	fputc('"', file);
+	for(size_t i = 0; '\0' != str[i]; i++) {
+		if('"' == str[i] || '\\' == str[i]) fputc('\\', file);
+		fputc(str[i], file);
+	}
+	fputc('"', file);
 }
 static bool needs_quotes(strarg_t const str) {
 	// TODO: Kind of a hack.
@@ -94,7 +94,17 @@ int SLNFilterAddFilterArg(SLNFilterRef const filter, SLNFilterRef const subfilte
 }
 void SLNFilterPrint(SLNFilterRef const filter, size_t const depth) {
 	assert(filter);
-	return [(SLNFilter *)filter print:depth];
+	return [(SLNFilter *)filter print:stderr :depth];
+}
+str_t *SLNFilterCopyKey(SLNFilterRef const filter) {
+	assert(filter);
+	str_t *key = NULL;
+	size_t len = 0;
+	FILE *const file = open_memstream(&key, &len);
+	if(!file) return NULL;
+	[(SLNFilter *)filter print:file :0];
+	if(0 != fclose(file)) FREE(&key);
+	return key;
 }
 size_t SLNFilterToUserFilterString(SLNFilterRef const filter, str_t *const data, size_t const size, size_t const depth) {
 	assert(filter);
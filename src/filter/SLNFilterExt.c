@@ -1,12 +1,28 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#include <ctype.h>
+#include "../../deps/smhasher/MurmurHash3.h"
 #include "../StrongLink.h"
 #include "../SLNDB.h"
 #include "../http/QueryString.h"
 
 #define BATCH_SIZE 50
 
+// Number of result pages kept per repo. Slots are chosen by hash, so
+// colliding queries simply replace each other.
+#define QUERY_CACHE_SIZE 64
+
+// How long (in milliseconds) a streaming query may hold one read
+// transaction before releasing it and re-seeking.
+#define SNAPSHOT_TIMEOUT (1000 * 1)
+
+// Results kept per feed for subscribers that haven't copied them yet.
+// Subscribers that fall further behind re-run the query themselves.
+#define FEED_SIZE 512
+
+#define KEEPALIVE_INTERVAL (1000 * 30)
+
 // TODO: Copy and pasted from SLNFilter.h.
 static bool valid(uint64_t const x) {
 	return 0 != x && UINT64_MAX != x;
@@ -18,6 +34,19 @@ static uint64_t invalid(int const dir) {
 	return 0;
 }
 
+// Positions from URI records ("<sortID>.<fileID>") can be used directly,
+// without looking up a URI.
+static void parse_token(SLNFilterPosition *const pos) {
+	if(!isdigit(pos->URI[0])) return;
+	unsigned long long sortID = 0, fileID = 0;
+	int len = 0;
+	sscanf(pos->URI, "%llu.%llu%n", &sortID, &fileID, &len);
+	if(!len || '\0' != pos->URI[len]) return;
+	if(!valid(sortID) || !valid(fileID)) return;
+	FREE(&pos->URI);
+	pos->sortID = sortID;
+	pos->fileID = fileID;
+}
 static void parse_start(strarg_t const str, SLNFilterPosition *const start) {
 	assert(!start->URI);
 	assert(0 != start->dir);
@@ -33,6 +62,7 @@ static void parse_start(strarg_t const str, SLNFilterPosition *const start) {
 	}
 	start->sortID = invalid(-start->dir);
 	start->fileID = invalid(-start->dir);
+	if(start->URI) parse_token(start);
 }
 static uint64_t parse_count(strarg_t const str, uint64_t const count) {
 	if(!str) return count;
@@ -79,20 +109,23 @@ void SLNFilterPositionCleanup(SLNFilterPosition *const pos) {
 	assert_zeroed(pos, 1);
 }
 
-int SLNFilterSeekToPosition(SLNFilterRef const filter, SLNFilterPosition const *const pos, DB_txn *const txn) {
-	if(!pos->URI) {
-		SLNFilterSeek(filter, pos->dir, pos->sortID, pos->fileID);
-		if(valid(pos->fileID)) SLNFilterStep(filter, pos->dir);
-		return 0;
-	}
-
+// Starts just before/after the given position. We only step if the seek
+// was a direct hit, otherwise it already landed on the next result.
+static void seek_past(SLNFilterRef const filter, int const dir, uint64_t const sortID, uint64_t const fileID) {
+	SLNFilterSeek(filter, dir, sortID, fileID);
+	uint64_t s, f;
+	SLNFilterCurrent(filter, dir, &s, &f);
+	if(s == sortID && f == fileID) SLNFilterStep(filter, dir);
+}
+// Finds where a URI sits in the filter's own sort order.
+static int uri_position(SLNFilterRef const filter, strarg_t const URI, DB_txn *const txn, uint64_t *const outSortID, uint64_t *const outFileID) {
 	DB_cursor *cursor = NULL;
 	int rc = db_txn_cursor(txn, &cursor);
 	if(rc < 0) return rc;
 
 	DB_range range[1];
 	DB_val key[1];
-	SLNURIAndFileIDRange1(range, txn, pos->URI);
+	SLNURIAndFileIDRange1(range, txn, URI);
 	rc = db_cursor_firstr(cursor, range, key, NULL, +1);
 	if(rc < 0) return rc;
 
@@ -107,17 +140,27 @@ int SLNFilterSeekToPosition(SLNFilterRef const filter, SLNFilterPosition const *
 	strarg_t u;
 	uint64_t fileID;
 	SLNURIAndFileIDKeyUnpack(key, txn, &u, &fileID);
-	assert(0 == strcmp(pos->URI, u));
+	assert(0 == strcmp(URI, u));
 
 	SLNAgeRange const ages = SLNFilterFullAge(filter, fileID);
 	if(!valid(ages.min) || ages.min > ages.max) return DB_NOTFOUND;
-	uint64_t const sortID = ages.min;
-
-	SLNFilterSeek(filter, pos->dir, sortID, fileID);
-	SLNFilterStep(filter, pos->dir); // Start just before/after the URI.
-	// TODO: Stepping is almost assuredly wrong if the URI doesn't match
-	// the filter. We should check if our seek was a direct hit, and
-	// only step if it was.
+	*outSortID = ages.min;
+	*outFileID = fileID;
+	return 0;
+}
+int SLNFilterSeekToPosition(SLNFilterRef const filter, SLNFilterPosition const *const pos, DB_txn *const txn) {
+	if(!pos->URI) {
+		if(!valid(pos->fileID)) {
+			SLNFilterSeek(filter, pos->dir, pos->sortID, pos->fileID);
+		} else {
+			seek_past(filter, pos->dir, pos->sortID, pos->fileID);
+		}
+		return 0;
+	}
+	uint64_t sortID, fileID;
+	int rc = uri_position(filter, pos->URI, txn, &sortID, &fileID);
+	if(rc < 0) return rc;
+	seek_past(filter, pos->dir, sortID, fileID);
 	return 0;
 }
 int SLNFilterGetPosition(SLNFilterRef const filter, SLNFilterPosition *const pos, DB_txn *const txn) {
@@ -166,29 +209,197 @@ int SLNFilterCopyURI(SLNFilterRef const filter, uint64_t const fileID, bool cons
 	return 0;
 }
 
-ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max) {
-	assert(URIs);
-	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return DB_EACCES;
-	if(0 == pos->dir) return DB_EINVAL;
-	if(0 == dir) return DB_EINVAL;
-	if(0 == max) return 0;
+static void put_uint64(byte_t *const buf, uint64_t const x) {
+	for(size_t i = 0; i < 8; i++) buf[i] = (byte_t)(x >> (56 - i*8));
+}
+// Records are built straight from the stored hash, so nobody has to
+// format a URI just for the client to parse it back.
+static int copy_record(uint64_t const sortID, uint64_t const fileID, DB_txn *const txn, str_t **const out) {
+	DB_val fileID_key[1], file_val[1];
+	SLNFileByIDKeyPack(fileID_key, txn, fileID);
+	int rc = db_get(txn, fileID_key, file_val);
+	if(rc < 0) return rc;
 
-	DB_env *db = NULL;
-	DB_txn *txn = NULL;
-	ssize_t rc = 0;
+	strarg_t const hash = db_read_string(file_val, txn);
+	db_assert(hash);
+	size_t const size = strlen(hash) / 2;
+	size_t const len = 1 + size + 8 + 8;
+	db_assert(1 + len <= SLN_URI_RECORD_MAX);
 
-	SLNRepoRef const repo = SLNSessionGetRepo(session);
-	SLNRepoDBOpen(repo, &db);
-	rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
-	if(rc < 0) goto cleanup;
+	byte_t *const rec = malloc(1 + len);
+	if(!rec) return DB_ENOMEM;
+	rec[0] = (byte_t)len;
+	rec[1] = (byte_t)SLNRecordAlgoID(SLN_INTERNAL_ALGO);
+	tobin(rec+2, hash, size*2);
+	put_uint64(rec+2+size, sortID);
+	put_uint64(rec+2+size+8, fileID);
+	*out = (str_t *)rec;
+	return 0;
+}
+static int copy_item(SLNFilterRef const filter, SLNFilterPosition const *const pos, int const format, DB_txn *const txn, str_t **const out) {
+	if(SLN_URI_LIST_RECORDS == format) {
+		return copy_record(pos->sortID, pos->fileID, txn, out);
+	}
+	return SLNFilterCopyURI(filter, pos->fileID, SLN_URI_LIST_META == format, txn, out);
+}
+// Records aren't nul-terminated, so everything that keeps results around
+// has to go through these.
+static size_t item_len(strarg_t const item, int const format) {
+	if(SLN_URI_LIST_RECORDS == format) return 1 + (byte_t)item[0];
+	return strlen(item);
+}
+static str_t *item_dup(strarg_t const item, int const format) {
+	size_t const len = item_len(item, format);
+	str_t *const x = malloc(len+1);
+	if(!x) return NULL;
+	memcpy(x, item, len);
+	x[len] = '\0';
+	return x;
+}
 
-	rc = SLNFilterPrepare(filter, txn);
-	if(rc < 0) goto cleanup;
-	rc = SLNFilterSeekToPosition(filter, pos, txn);
-	if(rc < 0) goto cleanup;
+// The query cache remembers pages of results by filter, start position and
+// options. Any commit can change any page: plain files can land anywhere in
+// filters sorted by meta-file, a file arriving after its meta-file shows up
+// at an old sort ID, and negation can drop results. So every commit clears
+// the whole cache, and it only helps between commits (e.g. many clients
+// polling the same query).
+typedef struct {
+	str_t *key;
+	uint64_t sortID;
+	uint64_t fileID;
+	size_t count;
+	str_t **URIs;
+} SLNQueryCacheEntry;
+typedef struct SLNFeed SLNFeed;
+struct SLNQueryCache {
+	async_mutex_t lock[1];
+	uint64_t commits; // Counts every commit, for staleness checks
+	SLNQueryCacheEntry entries[QUERY_CACHE_SIZE];
+	SLNFeed *feeds;
+};
 
+static void entry_clear(SLNQueryCacheEntry *const entry) {
+	FREE(&entry->key);
+	entry->sortID = 0;
+	entry->fileID = 0;
+	for(size_t i = 0; i < entry->count; i++) FREE(&entry->URIs[i]);
+	FREE(&entry->URIs);
+	entry->count = 0;
+	assert_zeroed(entry, 1);
+}
+SLNQueryCacheRef SLNQueryCacheCreate(void) {
+	SLNQueryCacheRef cache = calloc(1, sizeof(struct SLNQueryCache));
+	if(!cache) return NULL;
+	async_mutex_init(cache->lock, 0);
+	return cache;
+}
+void SLNQueryCacheFree(SLNQueryCacheRef *const cacheptr) {
+	SLNQueryCacheRef cache = *cacheptr;
+	if(!cache) return;
+	for(size_t i = 0; i < QUERY_CACHE_SIZE; i++) {
+		entry_clear(&cache->entries[i]);
+	}
+	assert(!cache->feeds); // Subscribers hold the repo open.
+	async_mutex_destroy(cache->lock);
+	cache->commits = 0;
+	assert_zeroed(cache, 1);
+	FREE(cacheptr); cache = NULL;
+}
+static void feeds_wake(SLNQueryCacheRef const cache);
+void SLNQueryCacheInvalidate(SLNQueryCacheRef const cache) {
+	if(!cache) return;
+	async_mutex_lock(cache->lock);
+	cache->commits++;
+	for(size_t i = 0; i < QUERY_CACHE_SIZE; i++) {
+		entry_clear(&cache->entries[i]);
+	}
+	feeds_wake(cache);
+	async_mutex_unlock(cache->lock);
+}
+
+static str_t *cache_key(SLNFilterRef const filter, SLNFilterPosition const *const pos, int const dir, int const format, size_t const max) {
+	str_t *filterkey = SLNFilterCopyKey(filter);
+	if(!filterkey) return NULL;
+	// The URI is length-prefixed so that it can't run into the filter.
+	strarg_t const URI = pos->URI ? pos->URI : "";
+	str_t *const key = aasprintf("%d %d %d %zu %llu %llu %zu %s\n%s",
+		pos->dir, dir, format, max,
+		(unsigned long long)pos->sortID, (unsigned long long)pos->fileID,
+		strlen(URI), URI, filterkey);
+	FREE(&filterkey);
+	return key;
+}
+static SLNQueryCacheEntry *cache_slot(SLNQueryCacheRef const cache, strarg_t const key) {
+	uint32_t hash;
+	MurmurHash3_x86_32(key, strlen(key), SLNSeed, &hash);
+	return &cache->entries[hash % QUERY_CACHE_SIZE];
+}
+static ssize_t cache_lookup(SLNQueryCacheRef const cache, strarg_t const key, int const format, SLNFilterPosition *const pos, str_t *URIs[], uint64_t *const latest) {
+	ssize_t rc = DB_NOTFOUND;
+	async_mutex_lock(cache->lock);
+	*latest = cache->commits;
+	SLNQueryCacheEntry *const entry = cache_slot(cache, key);
+	if(!entry->key || 0 != strcmp(key, entry->key)) goto cleanup;
+	size_t i = 0;
+	for(; i < entry->count; i++) {
+		URIs[i] = item_dup(entry->URIs[i], format);
+		if(!URIs[i]) break;
+	}
+	if(i < entry->count) {
+		for(; i > 0; i--) FREE(&URIs[i-1]);
+		rc = DB_ENOMEM;
+		goto cleanup;
+	}
+	if(entry->count) {
+		FREE(&pos->URI);
+		pos->sortID = entry->sortID;
+		pos->fileID = entry->fileID;
+	}
+	rc = entry->count;
+cleanup:
+	async_mutex_unlock(cache->lock);
+	return rc;
+}
+static void cache_store(SLNQueryCacheRef const cache, str_t **const keyptr, int const format, SLNFilterPosition const *const pos, str_t *const URIs[], size_t const count, uint64_t const latest) {
+	str_t **copies = NULL;
+	if(count) {
+		copies = calloc(count, sizeof(*copies));
+		if(!copies) return;
+		for(size_t i = 0; i < count; i++) {
+			copies[i] = item_dup(URIs[i], format);
+			if(copies[i]) continue;
+			for(; i > 0; i--) FREE(&copies[i-1]);
+			FREE(&copies);
+			return;
+		}
+	}
+	SLNQueryCacheEntry old[1] = {};
+	async_mutex_lock(cache->lock);
+	// If anything was committed while we were reading, our results may
+	// already be stale.
+	if(latest == cache->commits) {
+		SLNQueryCacheEntry *const entry = cache_slot(cache, *keyptr);
+		*old = *entry;
+		entry->key = *keyptr; *keyptr = NULL;
+		entry->sortID = pos->sortID;
+		entry->fileID = pos->fileID;
+		entry->count = count;
+		entry->URIs = copies; copies = NULL;
+	}
+	async_mutex_unlock(cache->lock);
+	entry_clear(old);
+	if(copies) {
+		for(size_t i = 0; i < count; i++) FREE(&copies[i]);
+		FREE(&copies);
+	}
+}
+
+// Fills URIs from a filter that has already been prepared and positioned.
+// Leaves the filter positioned just past the last result.
+static ssize_t copy_uris(SLNFilterRef const filter, DB_txn *const txn, SLNFilterPosition *const pos, int const dir, int const format, str_t *URIs[], size_t const max) {
 	int const stepdir = pos->dir * dir;
 	size_t i = 0;
+	int rc = 0;
 	for(; i < max; i++) {
 		size_t const x = stepdir > 0 ? i : max-1-i;
 		rc = SLNFilterGetPosition(filter, pos, txn);
@@ -196,8 +407,8 @@ ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session
 			rc = 0;
 			break;
 		}
-		rc = SLNFilterCopyURI(filter, pos->fileID, meta, txn, &URIs[x]);
-		if(rc < 0) goto cleanup;
+		rc = copy_item(filter, pos, format, txn, &URIs[x]);
+		if(rc < 0) return rc;
 		assert(URIs[x]);
 		SLNFilterStep(filter, pos->dir);
 	}
@@ -207,63 +418,436 @@ ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session
 	if(stepdir < 0) {
 		memmove(URIs+0, URIs+(max-i), sizeof(*URIs) * i);
 	}
+	return i;
+}
 
-	assert(rc >= 0);
-	rc = i;
+ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, int const format, str_t *URIs[], size_t const max) {
+	assert(URIs);
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return DB_EACCES;
+	if(0 == pos->dir) return DB_EINVAL;
+	if(0 == dir) return DB_EINVAL;
+	if(0 == max) return 0;
+
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	ssize_t rc = 0;
+
+	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	SLNQueryCacheRef const cache = SLNRepoGetQueryCache(repo);
+	uint64_t latest = 0;
+	str_t *key = cache_key(filter, pos, dir, format, max);
+	if(key) {
+		rc = cache_lookup(cache, key, format, pos, URIs, &latest);
+		if(DB_NOTFOUND != rc) {
+			FREE(&key);
+			return rc;
+		}
+		rc = 0;
+	}
+
+	SLNRepoDBOpen(repo, &db);
+	rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	rc = SLNFilterPrepare(filter, txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNFilterSeekToPosition(filter, pos, txn);
+	if(rc < 0) goto cleanup;
+	rc = copy_uris(filter, txn, pos, dir, format, URIs, max);
+	if(rc < 0) goto cleanup;
 
 cleanup:
 	db_txn_abort(txn); txn = NULL;
 	SLNRepoDBClose(repo, &db);
 
+	if(rc >= 0 && key) {
+		cache_store(cache, &key, format, pos, URIs, rc, latest);
+	}
+	FREE(&key);
 	return rc;
 }
-ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
-	str_t *URIs[BATCH_SIZE];
-	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, pos->dir, meta, URIs, MIN(max, BATCH_SIZE));
-	if(count <= 0) return count;
-	uv_buf_t parts[BATCH_SIZE*2];
+static int write_uris(str_t *URIs[], size_t const count, int const format, SLNFilterWriteCB const writecb, void *ctx) {
+	uv_buf_t parts[BATCH_SIZE*2] = {};
+	size_t n = 0;
+	assert(count <= BATCH_SIZE);
+	if(!count) return 0;
 	for(size_t i = 0; i < count; i++) {
-		parts[i*2+0] = uv_buf_init((char *)URIs[i], strlen(URIs[i]));
-		parts[i*2+1] = uv_buf_init((char *)STR_LEN("\r\n"));
+		parts[n++] = uv_buf_init((char *)URIs[i], item_len(URIs[i], format));
+		if(SLN_URI_LIST_RECORDS == format) continue;
+		parts[n++] = uv_buf_init((char *)STR_LEN("\r\n"));
 	}
-	int rc = writecb(ctx, parts, count*2);
+	int rc = writecb(ctx, parts, n);
 	for(size_t i = 0; i < count; i++) FREE(&URIs[i]);
 	assert_zeroed(URIs, count);
+	return rc;
+}
+ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const format, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
+	str_t *URIs[BATCH_SIZE];
+	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, pos->dir, format, URIs, MIN(max, BATCH_SIZE));
+	if(count <= 0) return count;
+	int rc = write_uris(URIs, count, format, writecb, ctx);
 	if(rc < 0) return rc;
 	return count;
 }
-int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, void *ctx) {
-	uint64_t remaining = max;
+
+// A read transaction held across batches of a streaming response, so that
+// long listings don't begin a transaction and re-seek every filter for
+// every batch. It's released after SNAPSHOT_TIMEOUT or when a commit is
+// waiting (so old versions can be reclaimed), checked before each write to
+// the client, and before waiting for new results.
+typedef struct {
+	SLNRepoRef repo;
+	SLNFilterRef filter;
+	DB_txn *txn;
+	uint64_t expires;
+} SLNFilterSnapshot;
+
+static void snapshot_release(SLNFilterSnapshot *const snap) {
+	if(!snap->txn) return;
+	db_txn_abort(snap->txn); snap->txn = NULL;
+	snap->expires = 0;
+}
+static ssize_t snapshot_write_batch(SLNFilterSnapshot *const snap, SLNFilterPosition *const pos, int const format, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
+	str_t *URIs[BATCH_SIZE];
+	DB_env *db = NULL;
+	ssize_t count = 0;
+	uint64_t const now = uv_now(async_loop);
+	bool const renew = !snap->txn;
+
+	SLNRepoDBOpen(snap->repo, &db);
+	if(renew) {
+		count = db_txn_begin(db, NULL, DB_RDONLY, &snap->txn);
+		if(count >= 0) count = SLNFilterPrepare(snap->filter, snap->txn);
+		if(count >= 0) count = SLNFilterSeekToPosition(snap->filter, pos, snap->txn);
+	}
+	if(count >= 0) count = copy_uris(snap->filter, snap->txn, pos, pos->dir, format, URIs, MIN(max, BATCH_SIZE));
+	if(renew) snap->expires = now + SNAPSHOT_TIMEOUT;
+	// Decide before writing, since the client can keep us blocked for
+	// as long as it likes. The next batch re-seeks from pos.
+	if(count < 0 || uv_now(async_loop) >= snap->expires || SLNRepoCommitPending(snap->repo)) {
+		snapshot_release(snap);
+	}
+	SLNRepoDBClose(snap->repo, &db);
+	if(count < 0) return count;
+
+	if(count > 0) {
+		int rc = write_uris(URIs, count, format, writecb, ctx);
+		if(rc < 0) return rc;
+	}
+	return count;
+}
+static int snapshot_write_all(SLNFilterSnapshot *const snap, SLNFilterPosition *const pos, int const format, uint64_t *const remaining, SLNFilterWriteCB const writecb, void *ctx) {
 	for(;;) {
-		ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, remaining, writecb, ctx);
+		ssize_t const count = snapshot_write_batch(snap, pos, format, *remaining, writecb, ctx);
 		if(count < 0) return count;
-		remaining -= count;
-		if(!remaining) return 0;
-		if(!count) break;
+		*remaining -= count;
+		if(!*remaining) return 0;
+		if(!count) return 0;
 	}
+}
 
-	if(!wait || pos->dir < 0) return 0;
+// Waiting queries with the same filter share a feed. After a commit, the
+// first subscriber to notice evaluates the filter once on behalf of all of
+// them and appends the new results, which the others just copy out.
+// Feeds are protected by the query cache lock.
+typedef struct {
+	uint64_t sortID;
+	uint64_t fileID;
+	str_t *URI;
+} SLNFeedItem;
+struct SLNFeed {
+	SLNFeed *next;
+	str_t *key;
+	unsigned refs;
+	bool busy; // Being evaluated
+	uint64_t latest; // Last commit evaluated
+	SLNFeedItem head; // Position of the newest result
+	SLNFeedItem base; // Position just before the oldest kept result
+	uint64_t count; // Results ever appended
+	SLNFeedItem items[FEED_SIZE]; // Indexed by count % FEED_SIZE
+	async_cond_t cond[1];
+};
+
+static int pos_cmp(uint64_t const s1, uint64_t const f1, uint64_t const s2, uint64_t const f2) {
+	if(s1 != s2) return s1 < s2 ? -1 : +1;
+	if(f1 != f2) return f1 < f2 ? -1 : +1;
+	return 0;
+}
+// Feed items are compared by position, so a subscriber that hasn't had any
+// results yet (and is still at its starting URI) needs a real one.
+static int resolve(SLNRepoRef const repo, SLNFilterRef const filter, SLNFilterPosition *const pos) {
+	if(!pos->URI) return 0;
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	uint64_t sortID, fileID;
+	SLNRepoDBOpen(repo, &db);
+	int rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNFilterPrepare(filter, txn);
+	if(rc < 0) goto cleanup;
+	rc = uri_position(filter, pos->URI, txn, &sortID, &fileID);
+	if(rc < 0) goto cleanup;
+	FREE(&pos->URI);
+	pos->sortID = sortID;
+	pos->fileID = fileID;
+cleanup:
+	db_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, &db);
+	return rc;
+}
 
+static void feeds_wake(SLNQueryCacheRef const cache) {
+	for(SLNFeed *feed = cache->feeds; feed; feed = feed->next) {
+		async_cond_broadcast(feed->cond);
+	}
+}
+static uint64_t feed_oldest(SLNFeed const *const feed) {
+	return feed->count > FEED_SIZE ? feed->count - FEED_SIZE : 0;
+}
+static SLNFeed *feed_join(SLNQueryCacheRef const cache, str_t **const keyptr, SLNFilterPosition const *const pos, uint64_t const latest) {
+	SLNFeed *feed = cache->feeds;
+	for(; feed; feed = feed->next) {
+		if(0 == strcmp(*keyptr, feed->key)) break;
+	}
+	if(!feed) {
+		feed = calloc(1, sizeof(SLNFeed));
+		if(!feed) return NULL;
+		feed->key = *keyptr; *keyptr = NULL;
+		feed->latest = latest;
+		feed->head.sortID = pos->sortID;
+		feed->head.fileID = pos->fileID;
+		feed->base = feed->head;
+		async_cond_init(feed->cond, 0);
+		feed->next = cache->feeds;
+		cache->feeds = feed;
+	}
+	feed->refs++;
+	return feed;
+}
+static void feed_leave(SLNQueryCacheRef const cache, SLNFeed **const feedptr) {
+	SLNFeed *feed = *feedptr;
+	if(!feed) return;
+	*feedptr = NULL;
+	if(--feed->refs) return;
+	SLNFeed **link = &cache->feeds;
+	while(feed != *link) link = &(*link)->next;
+	*link = feed->next;
+	for(uint64_t i = feed_oldest(feed); i < feed->count; i++) {
+		FREE(&feed->items[i % FEED_SIZE].URI);
+	}
+	FREE(&feed->key);
+	async_cond_destroy(feed->cond);
+	FREE(&feed);
+}
+// Finds where a subscriber at `pos` should start reading. Fails if the
+// results right after `pos` have already been dropped.
+static bool feed_find(SLNFeed const *const feed, SLNFilterPosition const *const pos, uint64_t *const seq) {
+	if(pos_cmp(pos->sortID, pos->fileID, feed->base.sortID, feed->base.fileID) < 0) return false;
+	uint64_t i = feed->count;
+	for(; i > feed_oldest(feed); i--) {
+		SLNFeedItem const *const item = &feed->items[(i-1) % FEED_SIZE];
+		if(pos_cmp(item->sortID, item->fileID, pos->sortID, pos->fileID) <= 0) break;
+	}
+	*seq = i;
+	return true;
+}
+static void feed_append(SLNFeed *const feed, SLNFeedItem *const item) {
+	SLNFeedItem *const slot = &feed->items[feed->count % FEED_SIZE];
+	if(feed->count >= FEED_SIZE) {
+		FREE(&slot->URI);
+		feed->base = *slot;
+	}
+	*slot = *item; item->URI = NULL;
+	feed->head = *slot;
+	feed->head.URI = NULL;
+	feed->count++;
+}
+// Called and returns with the cache lock held.
+static int feed_evaluate(SLNQueryCacheRef const cache, SLNFeed *const feed, SLNRepoRef const repo, SLNFilterRef const filter, int const format) {
+	uint64_t const latest = cache->commits;
+	SLNFilterPosition pos[1] = {{
+		.dir = +1,
+		.sortID = feed->head.sortID,
+		.fileID = feed->head.fileID,
+	}};
+	feed->busy = true;
+	async_mutex_unlock(cache->lock);
+
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	size_t count = 0;
+	SLNFeedItem *items = calloc(FEED_SIZE, sizeof(SLNFeedItem));
+	int rc = items ? 0 : DB_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	SLNRepoDBOpen(repo, &db);
+	rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNFilterPrepare(filter, txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNFilterSeekToPosition(filter, pos, txn);
+	if(rc < 0) goto cleanup;
+	for(; count < FEED_SIZE; count++) {
+		rc = SLNFilterGetPosition(filter, pos, txn);
+		if(DB_NOTFOUND == rc) {
+			rc = 0;
+			break;
+		}
+		if(rc < 0) goto cleanup;
+		rc = copy_item(filter, pos, format, txn, &items[count].URI);
+		if(rc < 0) goto cleanup;
+		items[count].sortID = pos->sortID;
+		items[count].fileID = pos->fileID;
+		SLNFilterStep(filter, pos->dir);
+	}
+
+cleanup:
+	db_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, &db);
+
+	async_mutex_lock(cache->lock);
+	feed->busy = false;
+	if(rc >= 0) {
+		for(size_t i = 0; i < count; i++) feed_append(feed, &items[i]);
+		// If we stopped early, there's more left for the next round.
+		if(count < FEED_SIZE && latest > feed->latest) feed->latest = latest;
+	}
+	for(size_t i = 0; items && i < FEED_SIZE; i++) FREE(&items[i].URI);
+	FREE(&items);
+	async_cond_broadcast(feed->cond);
+	return rc;
+}
+
+// Everything committed up to `latest` must already have been written.
+static int subscribe(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const format, uint64_t remaining, uint64_t latest, SLNFilterWriteCB const writecb, void *ctx) {
 	SLNRepoRef const repo = SLNSessionGetRepo(session);
-	for(;;) {
-		uint64_t const timeout = uv_now(async_loop)+(1000 * 30);
-		int rc = SLNRepoSubmissionWait(repo, pos->sortID, timeout);
-		if(UV_ETIMEDOUT == rc) {
-			uv_buf_t const parts[] = { uv_buf_init((char *)STR_LEN("\r\n")) };
-			rc = writecb(ctx, parts, numberof(parts));
-			if(rc < 0) break;
+	SLNQueryCacheRef const cache = SLNRepoGetQueryCache(repo);
+	SLNFilterSnapshot snap[1] = {{
+		.repo = repo,
+		.filter = filter,
+	}};
+	int rc = resolve(repo, filter, pos);
+	if(rc < 0) return rc;
+	str_t *filterkey = SLNFilterCopyKey(filter);
+	str_t *key = filterkey ? aasprintf("%d\n%s", format, filterkey) : NULL;
+	FREE(&filterkey);
+	if(!key) return DB_ENOMEM;
+
+	SLNFeed *feed = NULL;
+	uint64_t seq = 0;
+	bool synced = false;
+	// Commit as of which there's nothing after pos. Catching up again
+	// before the next commit would find nothing.
+	uint64_t idle = latest;
+	uint64_t timeout = uv_now(async_loop) + KEEPALIVE_INTERVAL;
+
+	async_mutex_lock(cache->lock);
+	feed = feed_join(cache, &key, pos, latest);
+	if(!feed) rc = DB_ENOMEM;
+	while(rc >= 0) {
+		if(!synced) {
+			synced = feed_find(feed, pos, &seq);
+			if(synced) continue;
+		}
+		if(!synced && idle != cache->commits) {
+			// The feed no longer has the results we need, so catch up
+			// on our own. That runs until there are no more results, so
+			// afterwards we can wait for the next commit even if the feed
+			// still can't take us (e.g. its results were negated).
+			uint64_t const commits = cache->commits;
+			async_mutex_unlock(cache->lock);
+			rc = snapshot_write_all(snap, pos, format, &remaining, writecb, ctx);
+			snapshot_release(snap);
+			async_mutex_lock(cache->lock);
+			if(!remaining) break;
+			idle = commits;
 			continue;
 		}
-		assert(rc >= 0); // TODO: Handle cancellation?
 
-		for(;;) {
-			ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, remaining, writecb, ctx);
-			if(count < 0) return count;
+		if(synced && seq < feed->count) {
+			if(seq < feed_oldest(feed)) {
+				// We fell behind and missed results.
+				synced = false;
+				idle = UINT64_MAX;
+				continue;
+			}
+			str_t *URIs[BATCH_SIZE];
+			size_t count = 0;
+			for(; seq < feed->count && count < MIN(remaining, BATCH_SIZE); seq++) {
+				SLNFeedItem const *const item = &feed->items[seq % FEED_SIZE];
+				if(pos_cmp(item->sortID, item->fileID, pos->sortID, pos->fileID) <= 0) continue;
+				URIs[count] = item_dup(item->URI, format);
+				if(!URIs[count]) {
+					rc = DB_ENOMEM;
+					break;
+				}
+				count++;
+				pos->sortID = item->sortID;
+				pos->fileID = item->fileID;
+			}
+			if(rc < 0) {
+				for(size_t i = 0; i < count; i++) FREE(&URIs[i]);
+				break;
+			}
+			if(!count) continue;
+			async_mutex_unlock(cache->lock);
+			rc = write_uris(URIs, count, format, writecb, ctx);
+			async_mutex_lock(cache->lock);
 			remaining -= count;
-			if(!remaining) return 0;
+			if(!remaining) break;
+			timeout = uv_now(async_loop) + KEEPALIVE_INTERVAL;
+			continue;
+		}
+
+		if(synced && feed->latest < cache->commits && !feed->busy) {
+			rc = feed_evaluate(cache, feed, repo, filter, format);
+			continue;
+		}
+
+		rc = async_cond_timedwait(feed->cond, cache->lock, timeout);
+		if(UV_ETIMEDOUT == rc) {
+			async_mutex_unlock(cache->lock);
+			uv_buf_t const parts[] = { SLN_URI_LIST_RECORDS == format ?
+				uv_buf_init((char *)"", 1) : // Zero length record
+				uv_buf_init((char *)STR_LEN("\r\n")) };
+			rc = writecb(ctx, parts, numberof(parts));
+			async_mutex_lock(cache->lock);
+			timeout = uv_now(async_loop) + KEEPALIVE_INTERVAL;
 		}
 	}
+	feed_leave(cache, &feed);
+	async_mutex_unlock(cache->lock);
+	FREE(&key);
+	return rc;
+}
 
-	return 0;
+int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const format, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, void *ctx) {
+	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	SLNQueryCacheRef const cache = SLNRepoGetQueryCache(repo);
+	async_mutex_lock(cache->lock);
+	uint64_t const latest = cache->commits;
+	async_mutex_unlock(cache->lock);
+
+	// The first batch goes through the query cache. Short responses
+	// (like most polls) never need a transaction of their own.
+	ssize_t const first = SLNFilterWriteURIBatch(filter, session, pos, format, max, writecb, ctx);
+	if(first < 0) return first;
+	uint64_t remaining = max - first;
+	if(!remaining) return 0;
+
+	SLNFilterSnapshot snap[1] = {{
+		.repo = repo,
+		.filter = filter,
+	}};
+	int rc = 0;
+	if(BATCH_SIZE == first) {
+		rc = snapshot_write_all(snap, pos, format, &remaining, writecb, ctx);
+		snapshot_release(snap);
+		if(rc < 0) return rc;
+		if(!remaining) return 0;
+	}
+
+	if(!wait || pos->dir < 0) return 0;
+	return subscribe(filter, session, pos, format, remaining, latest, writecb, ctx);
 }
 
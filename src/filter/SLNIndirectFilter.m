@@ -4,6 +4,10 @@
 #include "SLNFilter.h"
 #include "../util/fts.h"
 
+// Intersections and negations ask for the age of the same files over and
+// over while stepping, and each lookup walks every URI and meta-file.
+#define AGE_MEMO_SIZE 512
+
 @implementation SLNIndirectFilter
 - (void)free {
 	curtxn = NULL;
@@ -11,6 +15,7 @@
 	db_cursor_close(step_files); step_files = NULL;
 	db_cursor_close(age_uris); age_uris = NULL;
 	db_cursor_close(age_metafiles); age_metafiles = NULL;
+	FREE(&memo);
 	[super free];
 }
 
@@ -22,6 +27,9 @@
 	db_cursor_renew(txn, &age_uris); // SLNFileIDAndURI
 	db_cursor_renew(txn, &age_metafiles); // SLNTargetURIAndMetaFileID
 	curtxn = txn;
+	// Ages are only valid for a single snapshot.
+	if(!memo) memo = calloc(AGE_MEMO_SIZE, sizeof(*memo));
+	else memset(memo, 0, sizeof(*memo) * AGE_MEMO_SIZE);
 	return 0;
 }
 - (void)seek:(int const)dir :(uint64_t const)sortID :(uint64_t const)fileID {
@@ -107,6 +115,20 @@
 	return (SLNAgeRange){ [self fastAge:fileID :UINT64_MAX], UINT64_MAX };
 }
 - (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID {
+	struct age_memo *const m = memo ? &memo[fileID % AGE_MEMO_SIZE] : NULL;
+	if(m && fileID == m->fileID) {
+		if(valid(m->earliest)) return m->earliest <= sortID ? m->earliest : UINT64_MAX;
+		if(sortID <= m->bound) return UINT64_MAX;
+	}
+	uint64_t const earliest = [self uncachedAge:fileID :sortID];
+	if(m) {
+		m->fileID = fileID;
+		m->earliest = earliest;
+		m->bound = sortID;
+	}
+	return earliest;
+}
+- (uint64_t)uncachedAge:(uint64_t const)fileID :(uint64_t const)sortID {
 	uint64_t earliest = UINT64_MAX;
 	int rc;
 
@@ -152,9 +174,9 @@
 - (SLNFilterType)type {
 	return SLNVisibleFilterType;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(visible)\n");
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(visible)\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	if(depth) return wr(data, size, "*");
@@ -202,18 +224,44 @@
 }
 @end
 
+// Seeks to the first (or last, for dir < 0) meta-file at or past sortID
+// that contains the token. Returns its meta-file ID.
+static uint64_t seek_doc(DB_postings *const postings, int const dir, uint64_t const sortID) {
+	uint64_t x = sortID;
+	int rc = db_postings_seek(postings, &x, dir);
+	if(rc < 0) return invalid(dir);
+	return x;
+}
+static uint64_t step_doc(DB_postings *const postings, int const dir) {
+	uint64_t x;
+	int rc = db_postings_next(postings, &x, dir);
+	if(rc < 0) return invalid(dir);
+	return x;
+}
+// Positions are sorted, so a binary search is enough.
+static bool has_position(uint64_t const *const positions, size_t const count, uint64_t const x) {
+	size_t lo = 0, hi = count;
+	while(lo < hi) {
+		size_t const mid = lo + (hi - lo) / 2;
+		if(positions[mid] == x) return true;
+		if(positions[mid] < x) lo = mid+1;
+		else hi = mid;
+	}
+	return false;
+}
+
 @implementation SLNFulltextFilter
 - (void)free {
 	FREE(&term);
 	for(size_t i = 0; i < count; ++i) {
 		FREE(&tokens[i].str);
+		db_postings_close(tokens[i].postings); tokens[i].postings = NULL;
 	}
 	assert_zeroed(tokens, count);
 	FREE(&tokens);
 	count = 0;
 	asize = 0;
-	db_cursor_close(metafiles); metafiles = NULL;
-	db_cursor_close(match); match = NULL;
+	db_postings_close(metafiles); metafiles = NULL;
 	[super free];
 }
 
@@ -252,6 +300,7 @@
 			assert(tokens); // TODO
 		}
 		tokens[count].str = strndup(token, tlen);
+		tokens[count].postings = NULL;
 		assert(tokens[count].str); // TODO
 		count++;
 	}
@@ -261,9 +310,11 @@
 	if(!count) return DB_EINVAL;
 	return 0;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(fulltext %s)\n", term);
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(fulltext ");
+	print_string(file, term);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, term);
@@ -272,59 +323,90 @@
 - (int)prepare:(DB_txn *const)txn {
 	int rc = [super prepare:txn];
 	if(rc < 0) return rc;
-	db_cursor_renew(txn, &metafiles);
-	db_cursor_renew(txn, &match);
+	for(size_t i = 0; i < count; i++) {
+		DB_range range[1];
+		SLNTermPostingsRange1(range, txn, tokens[i].str);
+		if(0 == i) {
+			rc = db_postings_renew(txn, range, &metafiles);
+			if(rc < 0) return rc;
+		}
+		rc = db_postings_renew(txn, range, &tokens[i].postings);
+		if(rc < 0) return rc;
+	}
 	return 0;
 }
 
 - (uint64_t)seekMeta:(int const)dir :(uint64_t const)sortID {
 	assert(count);
-	DB_range range[1];
-	SLNTermMetaFileIDAndPositionRange1(range, curtxn, tokens[0].str);
-	DB_val sortID_key[1];
-	SLNTermMetaFileIDAndPositionKeyPack(sortID_key, curtxn, tokens[0].str, sortID, 0);
-	// TODO: In order to handle seeking backwards over document with several matching positions, we need to use sortID+1... But sortID might be UINT64_MAX, so be careful.
-	int rc = db_cursor_seekr(metafiles, range, sortID_key, NULL, dir);
-	if(rc < 0) return invalid(dir);
-	strarg_t token;
-	uint64_t actualSortID, position;
-	SLNTermMetaFileIDAndPositionKeyUnpack(sortID_key, curtxn, &token, &actualSortID, &position);
-	assert(0 == strcmp(tokens[0].str, token));
-	return actualSortID;
+	uint64_t const x = seek_doc(metafiles, dir, sortID);
+	return [self align:dir :x];
 }
 - (uint64_t)currentMeta:(int const)dir {
 	assert(count);
-	DB_val sortID_key[1];
-	int rc = db_cursor_current(metafiles, sortID_key, NULL);
+	uint64_t sortID;
+	int rc = db_postings_current(metafiles, &sortID);
 	if(rc < 0) return invalid(dir);
-	strarg_t token;
-	uint64_t sortID, position;
-	SLNTermMetaFileIDAndPositionKeyUnpack(sortID_key, curtxn, &token, &sortID, &position);
-	assert(0 == strcmp(tokens[0].str, token));
 	return sortID;
 }
 - (uint64_t)stepMeta:(int const)dir {
 	assert(count);
-	DB_range range[1];
-	SLNTermMetaFileIDAndPositionRange1(range, curtxn, tokens[0].str);
-	DB_val sortID_key[1];
-	int rc = db_cursor_nextr(metafiles, range, sortID_key, NULL, dir);
-	if(rc < 0) return invalid(dir);
-	strarg_t token;
-	uint64_t sortID, position;
-	SLNTermMetaFileIDAndPositionKeyUnpack(sortID_key, curtxn, &token, &sortID, &position);
-	assert(0 == strcmp(tokens[0].str, token));
-	return sortID;
+	uint64_t const x = step_doc(metafiles, dir);
+	return [self align:dir :x];
 }
 - (bool)match:(uint64_t const)metaFileID {
 	assert(count);
-	DB_range range[1];
-	SLNTermMetaFileIDAndPositionRange2(range, curtxn, tokens[0].str, metaFileID);
-	DB_val sortID_key[1];
-	int rc = db_cursor_firstr(match, range, sortID_key, NULL, +1);
-	if(rc >= 0) return true;
-	if(DB_NOTFOUND == rc) return false;
-	assertf(0, "Database error %s", sln_strerror(rc));
+	for(size_t i = 0; i < count; i++) {
+		uint64_t const x = seek_doc(tokens[i].postings, +1, metaFileID);
+		if(x != metaFileID) return false;
+	}
+	return [self phrase:metaFileID];
+}
+
+// Leapfrog intersection. Advances the metafiles cursor from sortID (which
+// it must already be positioned on) until every token appears in the same
+// meta-file and the phrase matches.
+- (uint64_t)align:(int const)dir :(uint64_t)sortID {
+	size_t i = 1;
+	while(valid(sortID)) {
+		if(i >= count) {
+			if([self phrase:sortID]) return sortID;
+			sortID = step_doc(metafiles, dir);
+			i = 1;
+			continue;
+		}
+		uint64_t const x = seek_doc(tokens[i].postings, dir, sortID);
+		if(!valid(x)) break;
+		if(x == sortID) { i++; continue; }
+		sortID = seek_doc(metafiles, dir, x);
+		i = 1;
+	}
+	db_postings_clear(metafiles);
+	return invalid(dir);
+}
+- (bool)phrase:(uint64_t const)metaFileID {
+	if(count < 2) return true;
+	uint64_t const *positions[count];
+	size_t npositions[count];
+	for(size_t i = 0; i < count; i++) {
+		uint64_t x = metaFileID;
+		int rc = db_postings_seek(tokens[i].postings, &x, 0);
+		if(DB_NOTFOUND == rc) return false;
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+		rc = db_postings_positions(tokens[i].postings, &positions[i], &npositions[i]);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+		// Meta-files indexed before positions were recorded only have
+		// position 0, so all we can check is that every token appears.
+		if(npositions[i] && 0 == positions[i][0]) return true;
+	}
+	for(size_t j = 0; j < npositions[0]; j++) {
+		uint64_t const position = positions[0][j];
+		size_t i = 1;
+		for(; i < count; i++) {
+			if(!has_position(positions[i], npositions[i], position+i)) break;
+		}
+		if(i >= count) return true;
+	}
+	return false;
 }
 @end
 
@@ -332,8 +414,8 @@
 - (void)free {
 	FREE(&field);
 	FREE(&value);
-	db_cursor_close(metafiles); metafiles = NULL;
-	db_cursor_close(match); match = NULL;
+	db_postings_close(metafiles); metafiles = NULL;
+	db_postings_close(match); match = NULL;
 	[super free];
 }
 
@@ -360,9 +442,13 @@
 	}
 	return DB_EINVAL;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(metadata \"%s\" \"%s\")\n", field, value);
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(metadata ");
+	print_string(file, field);
+	fprintf(file, " ");
+	print_string(file, value);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	size_t len = 0;
@@ -376,47 +462,36 @@
 	int rc = [super prepare:txn];
 	if(rc < 0) return rc;
 	if(!field || !value) return DB_EINVAL;
-	db_cursor_renew(txn, &metafiles); // SLNFieldValueAndMetaFileID
-	db_cursor_renew(txn, &match); // SLNFieldValueAndMetaFileID
+	DB_range range[1];
+	SLNFieldValuePostingsRange2(range, txn, field, value);
+	rc = db_postings_renew(txn, range, &metafiles);
+	if(rc < 0) return rc;
+	rc = db_postings_renew(txn, range, &match);
+	if(rc < 0) return rc;
 	return 0;
 }
 
 - (uint64_t)seekMeta:(int const)dir :(uint64_t const)sortID {
-	DB_range range[1];
-	SLNFieldValueAndMetaFileIDRange2(range, curtxn, field, value);
-	DB_val metadata_key[1];
-	SLNFieldValueAndMetaFileIDKeyPack(metadata_key, curtxn, field, value, sortID);
-	int rc = db_cursor_seekr(metafiles, range, metadata_key, NULL, dir);
+	uint64_t x = sortID;
+	int rc = db_postings_seek(metafiles, &x, dir);
 	if(rc < 0) return invalid(dir);
-	strarg_t f, v;
-	uint64_t actualSortID;
-	SLNFieldValueAndMetaFileIDKeyUnpack(metadata_key, curtxn, &f, &v, &actualSortID);
-	return actualSortID;
+	return x;
 }
 - (uint64_t)currentMeta:(int const)dir {
-	DB_val metadata_key[1];
-	int rc = db_cursor_current(metafiles, metadata_key, NULL);
-	if(rc < 0) return invalid(dir);
-	strarg_t f, v;
 	uint64_t sortID;
-	SLNFieldValueAndMetaFileIDKeyUnpack(metadata_key, curtxn, &f, &v, &sortID);
+	int rc = db_postings_current(metafiles, &sortID);
+	if(rc < 0) return invalid(dir);
 	return sortID;
 }
 - (uint64_t)stepMeta:(int const)dir {
-	DB_range range[1];
-	SLNFieldValueAndMetaFileIDRange2(range, curtxn, field, value);
-	DB_val metadata_key[1];
-	int rc = db_cursor_nextr(metafiles, range, metadata_key, NULL, dir);
-	if(rc < 0) return invalid(dir);
-	strarg_t f, v;
 	uint64_t sortID;
-	SLNFieldValueAndMetaFileIDKeyUnpack(metadata_key, curtxn, &f, &v, &sortID);
+	int rc = db_postings_next(metafiles, &sortID, dir);
+	if(rc < 0) return invalid(dir);
 	return sortID;
 }
 - (bool)match:(uint64_t const)metaFileID {
-	DB_val metadata_key[1];
-	SLNFieldValueAndMetaFileIDKeyPack(metadata_key, curtxn, field, value, metaFileID);
-	int rc = db_cursor_seek(match, metadata_key, NULL, 0);
+	uint64_t x = metaFileID;
+	int rc = db_postings_seek(match, &x, 0);
 	if(rc >= 0) return true;
 	if(DB_NOTFOUND == rc) return false;
 	assertf(0, "Database error %s", sln_strerror(rc));
@@ -94,9 +94,11 @@ cleanup:
 	}
 	return DB_EINVAL;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(links-to \"%s\")\n", URI);
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(links-to ");
+	print_string(file, URI);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, URI);
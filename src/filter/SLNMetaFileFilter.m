@@ -15,9 +15,9 @@
 - (SLNFilter *)unwrap {
 	return self;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(meta)\n");
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(meta)\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	assert(0);
@@ -26,12 +26,12 @@
 	subfilter = filter;
 	return 0;
 }
-- (void)print:(size_t const)depth {
-	indent(depth);
-	fprintf(stderr, "(negation\n");
-	[subfilter print:depth+1];
-	indent(depth);
-	fprintf(stderr, ")\n");
+- (void)print:(FILE *const)file :(size_t const)depth {
+	indent(file, depth);
+	fprintf(file, "(negation\n");
+	[subfilter print:file :depth+1];
+	indent(file, depth);
+	fprintf(file, ")\n");
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	size_t len = 0;
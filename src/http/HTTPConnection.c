@@ -2,10 +2,23 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <zlib.h>
 #include "HTTPConnection.h"
 #include "status.h"
 
 #define BUFFER_SIZE (1024 * 8)
+#define WRITE_BUFFER_SIZE (1024 * 4)
+#define WRITE_PARTS_MAX 16
+#define SENDFILE_MAX (1024 * 1024 * 1)
+
+// Compressed responses are mostly long URI lists and HTML, where a
+// smaller window costs little. Each stream needs about
+// (1 << (WINDOW_BITS+2)) + (1 << (MEM_LEVEL+9)) bytes, and long-polling
+// clients may keep one open indefinitely.
+#define DEFLATE_LEVEL 6
+#define DEFLATE_WINDOW_BITS 14
+#define DEFLATE_MEM_LEVEL 7
+#define DEFLATE_BUFFER_SIZE (1024 * 8)
 
 enum {
 	HTTPMessageIncomplete = 1 << 0,
@@ -24,9 +37,20 @@ struct HTTPConnection {
 	HTTPEvent type;
 	uv_buf_t out[1];
 
+	// Small writes (mostly headers) are gathered here and sent along
+	// with the next large write, or when we flush before blocking.
+	byte_t *wbuf;
+	size_t wlen;
+
+	// Set while a chunked response is being gzipped.
+	z_stream *deflate;
+	byte_t *zbuf;
+
 	unsigned flags;
 };
 
+static void deflate_free(HTTPConnectionRef const conn);
+
 int HTTPConnectionCreateIncoming(uv_stream_t *const socket, unsigned const flags, HTTPConnectionRef *const out) {
 	HTTPConnectionRef conn = calloc(1, sizeof(struct HTTPConnection));
 	if(!conn) return UV_ENOMEM;
@@ -97,12 +121,18 @@ void HTTPConnectionFree(HTTPConnectionRef *const connptr) {
 	// http_parser does not need to be freed, closed or destroyed.
 	memset(conn->parser, 0, sizeof(*conn->parser));
 
-	FREE(&conn->buf);
+	async_buf_put(conn->buf); conn->buf = NULL;
 	*conn->raw = uv_buf_init(NULL, 0);
 
 	conn->type = HTTPNothing;
 	*conn->out = uv_buf_init(NULL, 0);
 
+	FREE(&conn->wbuf);
+	conn->wlen = 0;
+
+	deflate_free(conn);
+	FREE(&conn->zbuf);
+
 	conn->flags = 0;
 
 	assert_zeroed(conn, 1);
@@ -129,10 +159,17 @@ int HTTPConnectionPeek(HTTPConnectionRef const conn, HTTPEvent *const type, uv_b
 			// after a timeout to give us a chance to reuse it,
 			// but even the two second timeout Apache uses causes
 			// a lot of problems...
-			FREE(&conn->buf);
+			// The buffer goes back to the per-thread pool, so
+			// the next read usually gets the same one back.
+			async_buf_put(conn->buf); conn->buf = NULL;
 			*conn->raw = uv_buf_init(NULL, 0);
 			*conn->out = uv_buf_init(NULL, 0);
 
+			// Whatever we wrote has to go out before we wait
+			// for a reply.
+			rc = HTTPConnectionFlush(conn);
+			if(rc < 0) return rc;
+
 			rc = async_read((uv_stream_t *)conn->stream, conn->raw);
 			if(UV_EOF == rc) conn->flags |= HTTPStreamEOF;
 			if(rc < 0) return rc;
@@ -367,14 +404,48 @@ int HTTPConnectionDrainMessage(HTTPConnectionRef const conn) {
 }
 
 
+// Sends any buffered output followed by parts in a single write.
+static int write_direct(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count) {
+	uv_stream_t *const stream = (uv_stream_t *)conn->stream;
+	if(!conn->wlen) {
+		if(!count) return 0;
+		return async_write(stream, parts, count);
+	}
+	uv_buf_t all[WRITE_PARTS_MAX];
+	all[0] = uv_buf_init((char *)conn->wbuf, conn->wlen);
+	conn->wlen = 0;
+	if(count+1 > numberof(all)) {
+		int rc = async_write(stream, all, 1);
+		if(rc < 0) return rc;
+		return async_write(stream, parts, count);
+	}
+	memcpy(all+1, parts, sizeof(parts[0]) * count);
+	return async_write(stream, all, count+1);
+}
+
 int HTTPConnectionWrite(HTTPConnectionRef const conn, byte_t const *const buf, size_t const len) {
 	if(!conn) return 0;
 	uv_buf_t parts[1] = { uv_buf_init((char *)buf, len) };
-	return async_write((uv_stream_t *)conn->stream, parts, numberof(parts));
+	return HTTPConnectionWritev(conn, parts, numberof(parts));
 }
 int HTTPConnectionWritev(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count) {
 	if(!conn) return 0;
-	return async_write((uv_stream_t *)conn->stream, parts, count);
+	size_t total = 0;
+	for(size_t i = 0; i < count; i++) total += parts[i].len;
+	if(conn->wlen+total > WRITE_BUFFER_SIZE) {
+		return write_direct(conn, parts, count);
+	}
+	if(!conn->wbuf) conn->wbuf = malloc(WRITE_BUFFER_SIZE);
+	if(!conn->wbuf) return write_direct(conn, parts, count);
+	for(size_t i = 0; i < count; i++) {
+		memcpy(conn->wbuf+conn->wlen, parts[i].base, parts[i].len);
+		conn->wlen += parts[i].len;
+	}
+	return 0;
+}
+int HTTPConnectionFlush(HTTPConnectionRef const conn) {
+	if(!conn) return 0;
+	return write_direct(conn, NULL, 0);
 }
 int HTTPConnectionWriteRequest(HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const requestURI, strarg_t const host) {
 	if(!conn) return 0;
@@ -466,7 +537,7 @@ int HTTPConnectionWriteFile(HTTPConnectionRef const conn, uv_file const file) {
 			return (int)len;
 		}
 		uv_buf_t const write = uv_buf_init((char *)buf, len);
-		ssize_t written = async_write((uv_stream_t *)conn->stream, &write, 1);
+		ssize_t written = write_direct(conn, &write, 1);
 		if(written < 0) {
 			FREE(&buf);
 			return (int)written;
@@ -475,6 +546,39 @@ int HTTPConnectionWriteFile(HTTPConnectionRef const conn, uv_file const file) {
 	FREE(&buf);
 	return 0;
 }
+// Sends length bytes of file starting at offset directly from the kernel.
+// The socket is non-blocking, so when its buffer fills up we write one
+// buffer the normal way, which waits for the client to catch up.
+int HTTPConnectionSendfile(HTTPConnectionRef const conn, uv_file const file, uint64_t offset, uint64_t length) {
+	if(!conn) return 0;
+	uv_os_fd_t fd;
+	int rc = uv_fileno((uv_handle_t *)conn->stream, &fd);
+	if(rc < 0) return rc;
+	rc = HTTPConnectionFlush(conn);
+	if(rc < 0) return rc;
+	byte_t *buf = NULL;
+	while(length > 0) {
+		ssize_t len = async_fs_sendfile(fd, file, offset, MIN(length, SENDFILE_MAX));
+		if(UV_EAGAIN == len) {
+			if(!buf) buf = malloc(BUFFER_SIZE);
+			if(!buf) { rc = UV_ENOMEM; break; }
+			uv_buf_t info = uv_buf_init((char *)buf, MIN(length, BUFFER_SIZE));
+			len = async_fs_read(file, &info, 1, offset);
+			if(len > 0) {
+				info.len = len;
+				rc = write_direct(conn, &info, 1);
+				if(rc < 0) break;
+			}
+		}
+		if(0 == len) rc = UV_EOF; // File was truncated.
+		if(len < 0) rc = (int)len;
+		if(rc < 0) break;
+		offset += len;
+		length -= len;
+	}
+	FREE(&buf);
+	return rc;
+}
 int HTTPConnectionWriteChunkLength(HTTPConnectionRef const conn, uint64_t const length) {
 	if(!conn) return 0;
 	str_t str[16];
@@ -482,16 +586,118 @@ int HTTPConnectionWriteChunkLength(HTTPConnectionRef const conn, uint64_t const
 	if(slen < 0) return UV_UNKNOWN;
 	return HTTPConnectionWrite(conn, (byte_t const *)str, slen);
 }
+static int write_chunk(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count) {
+	uint64_t total = 0;
+	for(size_t i = 0; i < count; i++) total += parts[i].len;
+	if(total <= 0) return 0;
+	str_t pfx[16];
+	int const pfxlen = snprintf(pfx, sizeof(pfx), "%llx\r\n", (unsigned long long)total);
+	if(pfxlen < 0) return UV_UNKNOWN;
+	// Each chunk goes out immediately (along with any buffered headers)
+	// because streaming responses may block between chunks.
+	uv_buf_t all[WRITE_PARTS_MAX-1];
+	if(count+2 > numberof(all)) {
+		int rc = 0;
+		rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)pfx, pfxlen);
+		rc = rc < 0 ? rc : write_direct(conn, parts, count);
+		rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)STR_LEN("\r\n"));
+		rc = rc < 0 ? rc : HTTPConnectionFlush(conn);
+		return rc;
+	}
+	all[0] = uv_buf_init(pfx, pfxlen);
+	memcpy(all+1, parts, sizeof(parts[0]) * count);
+	all[count+1] = uv_buf_init((char *)STR_LEN("\r\n"));
+	return write_direct(conn, all, count+2);
+}
+
+// Output is gathered in zbuf and sent as one chunk per call (or whenever
+// zbuf fills up). Every call ends with a flush so that streaming clients
+// don't wait on data stuck in the compressor.
+static int deflate_write_out(HTTPConnectionRef const conn) {
+	z_stream *const z = conn->deflate;
+	size_t const len = DEFLATE_BUFFER_SIZE - z->avail_out;
+	z->next_out = (Bytef *)conn->zbuf;
+	z->avail_out = DEFLATE_BUFFER_SIZE;
+	if(!len) return 0;
+	uv_buf_t const part = uv_buf_init((char *)conn->zbuf, len);
+	return write_chunk(conn, &part, 1);
+}
+static int deflate_chunk(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count, int const flush) {
+	z_stream *const z = conn->deflate;
+	for(unsigned int i = 0; i <= count; i++) {
+		int const mode = i < count ? Z_NO_FLUSH : flush;
+		z->next_in = i < count ? (Bytef *)parts[i].base : Z_NULL;
+		z->avail_in = i < count ? parts[i].len : 0;
+		for(;;) {
+			if(0 == z->avail_out) {
+				int rc = deflate_write_out(conn);
+				if(rc < 0) return rc;
+			}
+			if(Z_STREAM_ERROR == deflate(z, mode)) return UV_UNKNOWN;
+			// Input is only left over when the output filled up.
+			if(z->avail_out > 0) break;
+		}
+	}
+	return deflate_write_out(conn);
+}
+static void deflate_free(HTTPConnectionRef const conn) {
+	if(!conn->deflate) return;
+	deflateEnd(conn->deflate);
+	FREE(&conn->deflate);
+}
+static bool accepts_gzip(strarg_t const accept) {
+	if(!accept) return false;
+	strarg_t pos = accept;
+	for(;;) {
+		pos += strspn(pos, " \t,");
+		if('\0' == *pos) return false;
+		size_t const len = strcspn(pos, " \t,;");
+		bool const match =
+			(4 == len && 0 == strncasecmp(pos, "gzip", len)) ||
+			(6 == len && 0 == strncasecmp(pos, "x-gzip", len)) ||
+			(1 == len && '*' == pos[0]);
+		pos += len;
+		pos += strspn(pos, " \t");
+		bool refused = false;
+		if(';' == *pos) {
+			strarg_t const q = strstr(pos, "q=");
+			size_t const plen = strcspn(pos, ",");
+			refused = q && q < pos+plen && 0.0 == strtod(q+2, NULL);
+			pos += plen;
+		}
+		if(match) return !refused;
+	}
+}
+
+int HTTPConnectionWriteContentEncoding(HTTPConnectionRef const conn, strarg_t const accept) {
+	if(!conn) return 0;
+	int rc = HTTPConnectionWriteHeader(conn, "Vary", "Accept-Encoding");
+	if(rc < 0) return rc;
+	if(!accepts_gzip(accept)) return 0;
+	assert(!conn->deflate);
+
+	// If anything fails we just send the response uncompressed.
+	if(!conn->zbuf) conn->zbuf = malloc(DEFLATE_BUFFER_SIZE);
+	if(!conn->zbuf) return 0;
+	conn->deflate = calloc(1, sizeof(z_stream));
+	if(!conn->deflate) return 0;
+	rc = deflateInit2(conn->deflate, DEFLATE_LEVEL, Z_DEFLATED,
+		DEFLATE_WINDOW_BITS+16, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if(Z_OK != rc) {
+		FREE(&conn->deflate);
+		return 0;
+	}
+	conn->deflate->next_out = (Bytef *)conn->zbuf;
+	conn->deflate->avail_out = DEFLATE_BUFFER_SIZE;
+	return HTTPConnectionWriteHeader(conn, "Content-Encoding", "gzip");
+}
 int HTTPConnectionWriteChunkv(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count) {
 	if(!conn) return 0;
+	if(!conn->deflate) return write_chunk(conn, parts, count);
 	uint64_t total = 0;
 	for(size_t i = 0; i < count; i++) total += parts[i].len;
 	if(total <= 0) return 0;
-	int rc = 0;
-	rc = rc < 0 ? rc : HTTPConnectionWriteChunkLength(conn, total);
-	rc = rc < 0 ? rc : async_write((uv_stream_t *)conn->stream, parts, count);
-	rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)STR_LEN("\r\n"));
-	return rc;
+	return deflate_chunk(conn, parts, count, Z_SYNC_FLUSH);
 }
 int HTTPConnectionWriteChunkFile(HTTPConnectionRef const conn, strarg_t const path) {
 	bool worker = false;
@@ -513,6 +719,21 @@ int HTTPConnectionWriteChunkFile(HTTPConnectionRef const conn, strarg_t const pa
 	if(len < 0) rc = len;
 	if(rc < 0) goto cleanup;
 
+	// Compressed output has to go through the chunk writer, so we can't
+	// use sendfile.
+	if(conn->deflate) {
+		async_pool_leave(NULL); worker = false;
+		while(len > 0) {
+			uv_buf_t const part = uv_buf_init((char *)buf, len);
+			rc = HTTPConnectionWriteChunkv(conn, &part, 1);
+			if(rc < 0) goto cleanup;
+			len = async_fs_readall_simple(file, &chunk);
+			if(len < 0) rc = len;
+			if(rc < 0) goto cleanup;
+		}
+		goto cleanup;
+	}
+
 	// Fast path for small files.
 	if(len < BUFFER_SIZE) {
 		str_t pfx[16];
@@ -538,10 +759,9 @@ int HTTPConnectionWriteChunkFile(HTTPConnectionRef const conn, strarg_t const pa
 
 	async_pool_leave(NULL); worker = false;
 
-	// TODO: HACK, WriteFile continues from where we left off
 	rc = rc < 0 ? rc : HTTPConnectionWriteChunkLength(conn, req->statbuf.st_size);
 	rc = rc < 0 ? rc : HTTPConnectionWritev(conn, &chunk, 1);
-	rc = rc < 0 ? rc : HTTPConnectionWriteFile(conn, file);
+	rc = rc < 0 ? rc : HTTPConnectionSendfile(conn, file, len, req->statbuf.st_size - len);
 	rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)STR_LEN("\r\n"));
 
 cleanup:
@@ -554,11 +774,22 @@ cleanup:
 }
 int HTTPConnectionWriteChunkEnd(HTTPConnectionRef const conn) {
 	if(!conn) return 0;
+	if(conn->deflate) {
+		int rc = deflate_chunk(conn, NULL, 0, Z_FINISH);
+		deflate_free(conn);
+		if(rc < 0) return rc;
+	}
 	return HTTPConnectionWrite(conn, (byte_t const *)STR_LEN("0\r\n\r\n"));
 }
 int HTTPConnectionEnd(HTTPConnectionRef const conn) {
 	// We assume keep-alive is enabled.
-	return 0;
+	return HTTPConnectionFlush(conn);
+}
+void HTTPConnectionAbort(HTTPConnectionRef const conn) {
+	if(!conn) return;
+	// Treated like the client hanging up, so the server stops reading
+	// requests and frees the connection.
+	conn->flags |= HTTPStreamEOF;
 }
 
 int HTTPConnectionSendMessage(HTTPConnectionRef const conn, uint16_t const status, strarg_t const str) {
@@ -619,7 +850,7 @@ int HTTPConnectionSendFile(HTTPConnectionRef const conn, strarg_t const path, st
 	// TODO: Caching and other headers.
 	if(type) rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Content-Type", type);
 	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
-	rc = rc < 0 ? rc : HTTPConnectionWriteFile(conn, file);
+	rc = rc < 0 ? rc : HTTPConnectionSendfile(conn, file, 0, size);
 	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
 
 cleanup:
@@ -42,6 +42,7 @@ int HTTPConnectionDrainMessage(HTTPConnectionRef const conn);
 // Writing
 int HTTPConnectionWrite(HTTPConnectionRef const conn, byte_t const *const buf, size_t const len);
 int HTTPConnectionWritev(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count);
+int HTTPConnectionFlush(HTTPConnectionRef const conn);
 int HTTPConnectionWriteRequest(HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const requestURI, strarg_t const host);
 int HTTPConnectionWriteResponse(HTTPConnectionRef const conn, uint16_t const status, strarg_t const message);
 int HTTPConnectionWriteHeader(HTTPConnectionRef const conn, strarg_t const field, strarg_t const value);
@@ -49,11 +50,20 @@ int HTTPConnectionWriteContentLength(HTTPConnectionRef const conn, uint64_t cons
 int HTTPConnectionWriteSetCookie(HTTPConnectionRef const conn, strarg_t const cookie, strarg_t const path, uint64_t const maxage);
 int HTTPConnectionBeginBody(HTTPConnectionRef const conn);
 int HTTPConnectionWriteFile(HTTPConnectionRef const conn, uv_file const file);
+int HTTPConnectionSendfile(HTTPConnectionRef const conn, uv_file const file, uint64_t offset, uint64_t length);
+// Picks gzip if the client accepts it (`accept` is the Accept-Encoding
+// request header), in which case chunks are compressed until
+// HTTPConnectionWriteChunkEnd. Chunked responses only. Call before
+// HTTPConnectionBeginBody.
+int HTTPConnectionWriteContentEncoding(HTTPConnectionRef const conn, strarg_t const accept);
 int HTTPConnectionWriteChunkLength(HTTPConnectionRef const conn, uint64_t const length);
 int HTTPConnectionWriteChunkv(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count);
 int HTTPConnectionWriteChunkFile(HTTPConnectionRef const conn, strarg_t const path);
 int HTTPConnectionWriteChunkEnd(HTTPConnectionRef const conn);
 int HTTPConnectionEnd(HTTPConnectionRef const conn);
+// For responses that can't be finished (e.g. a chunked body that failed
+// partway). The connection is closed instead of being reused.
+void HTTPConnectionAbort(HTTPConnectionRef const conn);
 
 // Convenience
 int HTTPConnectionSendString(HTTPConnectionRef const conn, uint16_t const status, strarg_t const str);
@@ -0,0 +1,162 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include "HTTPRouter.h"
+#include "../../deps/openbsd-compat/includes.h"
+
+// The routes are compiled into a trie with one node per path segment,
+// so matching a request costs one pass over its path instead of one
+// parse per handler. Nodes are kept in a single array and refer to each
+// other by index. Node 0 is the root, so it never appears as a child.
+
+#define NONE SIZE_MAX
+
+struct node {
+	strarg_t seg; // Points into the route pattern, NULL for "*"
+	size_t len;
+	size_t child;
+	size_t sibling;
+	size_t route; // First route ending here
+};
+struct HTTPRouter {
+	HTTPRoute const *routes;
+	size_t *next; // Per route, the next one ending at the same node
+	struct node *nodes;
+	size_t count;
+	size_t size;
+};
+
+static size_t add_node(HTTPRouterRef const router, size_t const parent, strarg_t const seg, size_t const len) {
+	size_t *link = &router->nodes[parent].child;
+	while(0 != *link) {
+		struct node const *const x = &router->nodes[*link];
+		if(!seg && !x->seg) return *link;
+		if(seg && x->seg && len == x->len && 0 == memcmp(seg, x->seg, len)) return *link;
+		link = &router->nodes[*link].sibling;
+	}
+	if(router->count >= router->size) {
+		size_t const size = router->size * 2;
+		struct node *const nodes = reallocarray(router->nodes, size, sizeof(struct node));
+		if(!nodes) return NONE;
+		router->nodes = nodes;
+		router->size = size;
+		// The array may have moved.
+		link = &router->nodes[parent].child;
+		while(0 != *link) link = &router->nodes[*link].sibling;
+	}
+	size_t const n = router->count++;
+	router->nodes[n] = (struct node){ seg, len, 0, 0, NONE };
+	*link = n;
+	return n;
+}
+
+int HTTPRouterCreate(HTTPRoute const *const routes, size_t const count, HTTPRouterRef *const out) {
+	assert(out);
+	HTTPRouterRef router = calloc(1, sizeof(struct HTTPRouter));
+	if(!router) return UV_ENOMEM;
+	router->routes = routes;
+	router->next = calloc(count ? count : 1, sizeof(size_t));
+	router->size = 16;
+	router->nodes = calloc(router->size, sizeof(struct node));
+	if(!router->next || !router->nodes) {
+		HTTPRouterFree(&router);
+		return UV_ENOMEM;
+	}
+	router->nodes[0] = (struct node){ NULL, 0, 0, 0, NONE };
+	router->count = 1;
+
+	for(size_t i = 0; i < count; i++) {
+		strarg_t pos = routes[i].pattern;
+		if(!pos || '/' != pos[0]) {
+			HTTPRouterFree(&router);
+			return UV_EINVAL;
+		}
+		size_t n = 0;
+		size_t params = 0;
+		do {
+			pos++;
+			size_t const len = strcspn(pos, "/");
+			bool const wild = 1 == len && '*' == pos[0];
+			if(wild && ++params > HTTP_ROUTE_PARAMS_MAX) {
+				HTTPRouterFree(&router);
+				return UV_EINVAL;
+			}
+			n = add_node(router, n, wild ? NULL : pos, len);
+			if(NONE == n) {
+				HTTPRouterFree(&router);
+				return UV_ENOMEM;
+			}
+			pos += len;
+		} while('/' == pos[0]);
+
+		router->next[i] = NONE;
+		size_t *link = &router->nodes[n].route;
+		while(NONE != *link) link = &router->next[*link];
+		*link = i;
+	}
+
+	*out = router; router = NULL;
+	return 0;
+}
+void HTTPRouterFree(HTTPRouterRef *const routerptr) {
+	HTTPRouterRef router = *routerptr;
+	if(!router) return;
+	router->routes = NULL;
+	FREE(&router->next);
+	FREE(&router->nodes);
+	router->count = 0;
+	router->size = 0;
+	assert_zeroed(router, 1);
+	FREE(routerptr); router = NULL;
+}
+
+static bool match_segment(HTTPRouterRef const router, size_t const parent, unsigned const method, strarg_t const seg, size_t const params, HTTPRouteMatch *const out) {
+	size_t const len = strcspn(seg, "/?");
+	bool const last = '/' != seg[len];
+	for(int wild = 0; wild < 2; wild++) {
+		for(size_t n = router->nodes[parent].child; 0 != n; n = router->nodes[n].sibling) {
+			struct node const *const x = &router->nodes[n];
+			size_t count = params;
+			if(wild) {
+				if(x->seg || !len) continue;
+				out->params[count++] = uv_buf_init((char *)seg, len);
+			} else {
+				if(!x->seg || len != x->len) continue;
+				if(0 != memcmp(seg, x->seg, len)) continue;
+			}
+			if(!last) {
+				if(match_segment(router, n, method, seg+len+1, count, out)) return true;
+				continue;
+			}
+			for(size_t i = x->route; NONE != i; i = router->next[i]) {
+				if(!(router->routes[i].methods & method)) continue;
+				out->route = i;
+				out->count = count;
+				out->qs = seg+len;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+int HTTPRouterMatch(HTTPRouterRef const router, HTTPMethod const method, strarg_t const URI, HTTPRouteMatch *const out) {
+	assert(router);
+	assert(out);
+	if(!URI || '/' != URI[0]) return UV_ENOENT;
+	if(!match_segment(router, 0, HTTP_ROUTE_METHOD(method), URI+1, 0, out)) return UV_ENOENT;
+	return 0;
+}
+
+int HTTPRouteParamCopy(HTTPRouteMatch const *const match, size_t const i, strarg_t const chars, str_t *const out, size_t const max) {
+	assert(match);
+	assert(out);
+	if(i >= match->count) return UV_EINVAL;
+	uv_buf_t const *const param = &match->params[i];
+	if(param->len >= max) return UV_ENAMETOOLONG;
+	for(size_t j = 0; chars && j < param->len; j++) {
+		if(!strchr(chars, param->base[j])) return UV_EINVAL;
+	}
+	memcpy(out, param->base, param->len);
+	out[param->len] = '\0';
+	return 0;
+}
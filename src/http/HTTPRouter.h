@@ -0,0 +1,43 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef HTTPROUTER_H
+#define HTTPROUTER_H
+
+#include "../common.h"
+#include "HTTPConnection.h"
+
+typedef struct HTTPRouter* HTTPRouterRef;
+
+#define HTTP_ROUTE_PARAMS_MAX 4
+#define HTTP_ROUTE_METHOD(method) (1U << (method))
+
+// Patterns are made of path segments. A segment of "*" captures any
+// non-empty segment as a parameter. A query string is always allowed.
+// E.g. "/sln/file/*/*" matches "/sln/file/sha256/abc?x=y".
+// The pattern strings must outlive the router.
+typedef struct {
+	unsigned methods; // HTTP_ROUTE_METHOD(HTTP_GET) | ...
+	strarg_t pattern;
+} HTTPRoute;
+
+typedef struct {
+	size_t route; // Index into the route list
+	size_t count;
+	uv_buf_t params[HTTP_ROUTE_PARAMS_MAX]; // Not nul-terminated
+	strarg_t qs; // Points at '?' or '\0'
+} HTTPRouteMatch;
+
+int HTTPRouterCreate(HTTPRoute const *const routes, size_t const count, HTTPRouterRef *const out);
+void HTTPRouterFree(HTTPRouterRef *const routerptr);
+
+// Returns UV_ENOENT if no route matches both the path and the method.
+// Literal segments take precedence over parameters, then routes are
+// tried in the order they were listed.
+int HTTPRouterMatch(HTTPRouterRef const router, HTTPMethod const method, strarg_t const URI, HTTPRouteMatch *const out);
+
+// Copies a parameter into a nul-terminated buffer. Fails with UV_EINVAL
+// if it contains characters outside of `chars` (or any, if NULL).
+int HTTPRouteParamCopy(HTTPRouteMatch const *const match, size_t const i, strarg_t const chars, str_t *const out, size_t const max);
+
+#endif
@@ -1,14 +1,39 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#define _DEFAULT_SOURCE // SO_REUSEPORT
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include "../../deps/uv/include/uv.h"
 #include "../async/async.h"
 #include "HTTPServer.h"
 
+// Listening sockets per loop, one for each address the server's address
+// resolves to (e.g. IPv4 and IPv6 for the any-address).
+#define LISTEN_MAX 4
+
+// Each extra loop runs in its own thread with its own listening sockets.
+// The kernel balances incoming connections between them (SO_REUSEPORT).
+typedef struct {
+	HTTPServerRef server;
+	uv_thread_t thread[1];
+	uv_sem_t ready[1];
+	uv_async_t stop[1];
+	uv_tcp_t sockets[LISTEN_MAX];
+	unsigned nsockets;
+	int status;
+} HTTPServerLoop;
+
 struct HTTPServer {
 	HTTPListener listener;
 	void *context;
-	uv_tcp_t socket[1];
+	uv_tcp_t sockets[LISTEN_MAX];
+	unsigned nsockets;
+	bool listening;
+	struct addrinfo *info;
+	HTTPServerLoop *loops;
+	unsigned count;
+	unsigned running;
 };
 
 static void connection_cb(uv_stream_t *const socket, int const status);
@@ -18,25 +43,115 @@ HTTPServerRef HTTPServerCreate(HTTPListener const listener, void *const context)
 	HTTPServerRef const server = calloc(1, sizeof(struct HTTPServer));
 	server->listener = listener;
 	server->context = context;
+	server->count = 1;
 	return server;
 }
 void HTTPServerFree(HTTPServerRef *const serverptr) {
 	HTTPServerRef server = *serverptr;
 	if(!server) return;
 	HTTPServerClose(server);
+	if(server->running) {
+		// Joining waits for open connections to finish.
+		async_pool_enter(NULL);
+		for(unsigned i = 0; i < server->running; i++) {
+			uv_thread_join(server->loops[i].thread);
+		}
+		async_pool_leave(NULL);
+	}
+	FREE(&server->loops);
 	server->listener = NULL;
 	server->context = NULL;
+	server->count = 0;
+	server->running = 0;
 	assert_zeroed(server, 1);
 	FREE(serverptr); server = NULL;
 }
 
+int HTTPServerSetLoopCount(HTTPServerRef const server, unsigned const count) {
+	if(!server) return 0;
+	if(!count) return UV_EINVAL;
+	assertf(!server->listening, "HTTPServer already listening");
+	server->count = count;
+	return 0;
+}
+
+// Listens on every resolved address, with one handle each. Addresses that
+// can't be bound are skipped as long as at least one works.
+static int bind_listen(HTTPServerRef const server, uv_tcp_t sockets[], unsigned *const count, struct addrinfo const *const info, bool const reuseport) {
+	int rc = 0;
+	for(struct addrinfo const *each = info; each && *count < LISTEN_MAX; each = each->ai_next) {
+		// libuv doesn't expose SO_REUSEPORT, so we create the socket
+		// ourselves and hand it over.
+		int const fd = socket(each->ai_family, each->ai_socktype, each->ai_protocol);
+		if(fd < 0) { rc = -errno; continue; }
+		int const yes = 1;
+		rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if(rc >= 0 && reuseport) {
+#ifdef SO_REUSEPORT
+			rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#else
+			rc = -1, errno = ENOTSUP;
+#endif
+		}
+		// Otherwise the IPv6 any-address takes the IPv4 port too, and
+		// binding that fails.
+		if(rc >= 0 && AF_INET6 == each->ai_family) {
+			rc = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));
+		}
+		if(rc >= 0) rc = bind(fd, each->ai_addr, each->ai_addrlen);
+		if(rc < 0) rc = -errno;
+		if(rc < 0) { close(fd); continue; }
+
+		uv_tcp_t *const stream = &sockets[*count];
+		rc = uv_tcp_init(async_loop, stream);
+		if(rc < 0) { close(fd); return rc; }
+		stream->data = server;
+		(*count)++;
+		rc = uv_tcp_open(stream, fd);
+		if(rc < 0) { close(fd); return rc; }
+		rc = uv_listen((uv_stream_t *)stream, 511, connection_cb);
+		if(rc < 0) return rc;
+	}
+	if(!*count) {
+		if(rc < 0) return rc;
+		return UV_EADDRNOTAVAIL;
+	}
+	return 0;
+}
+
+static void loop_stop_cb(uv_async_t *const async) {
+	HTTPServerLoop *const loop = async->data;
+	for(unsigned i = 0; i < loop->nsockets; i++) {
+		uv_close((uv_handle_t *)&loop->sockets[i], NULL);
+	}
+	loop->nsockets = 0;
+	uv_close((uv_handle_t *)loop->stop, NULL);
+}
+static void loop_cleanup(void *const unused) {
+	async_pool_destroy_shared();
+}
+static void loop_thread(void *const arg) {
+	HTTPServerLoop *const loop = arg;
+	HTTPServerRef const server = loop->server;
+	async_init();
+	int rc = uv_async_init(async_loop, loop->stop, loop_stop_cb);
+	if(rc >= 0) loop->stop->data = loop;
+	if(rc >= 0) rc = bind_listen(server, loop->sockets, &loop->nsockets, server->info, true);
+	// On error we still wait for HTTPServerClose to stop us.
+	loop->status = rc;
+	uv_sem_post(loop->ready);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+
+	async_spawn(STACK_DEFAULT, loop_cleanup, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	async_destroy();
+}
+
 int HTTPServerListen(HTTPServerRef const server, strarg_t const address, strarg_t const port) {
 	if(!server) return 0;
-	assertf(!server->socket->data, "HTTPServer already listening");
+	assertf(!server->listening, "HTTPServer already listening");
 	int rc;
-	rc = uv_tcp_init(async_loop, server->socket);
-	if(rc < 0) return rc;
-	server->socket->data = server;
+	server->listening = true;
 
 	struct addrinfo const hints = {
 		.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG | AI_NUMERICSERV | AI_PASSIVE,
@@ -44,25 +159,41 @@ int HTTPServerListen(HTTPServerRef const server, strarg_t const address, strarg_
 		.ai_socktype = SOCK_STREAM,
 		.ai_protocol = 0, // ???
 	};
-	struct addrinfo *info;
-	rc = async_getaddrinfo(address, port, &hints, &info);
+	rc = async_getaddrinfo(address, port, &hints, &server->info);
 	if(rc < 0) {
 		HTTPServerClose(server);
 		return rc;
 	}
-	int bound = 0;
-	rc = 0;
-	for(struct addrinfo *each = info; each; each = each->ai_next) {
-		rc = uv_tcp_bind(server->socket, each->ai_addr, 0);
-		if(rc >= 0) bound++;
-	}
-	uv_freeaddrinfo(info);
-	if(!bound) {
+	bool const multi = server->count > 1;
+	rc = bind_listen(server, server->sockets, &server->nsockets, server->info, multi);
+	if(rc < 0) {
 		HTTPServerClose(server);
-		if(rc < 0) return rc;
-		return UV_EADDRNOTAVAIL;
+		return rc;
+	}
+
+	if(multi) {
+		server->loops = calloc(server->count-1, sizeof(*server->loops));
+		if(!server->loops) rc = UV_ENOMEM;
+	}
+	for(unsigned i = 0; rc >= 0 && i+1 < server->count; i++) {
+		HTTPServerLoop *const loop = &server->loops[i];
+		loop->server = server;
+		rc = uv_sem_init(loop->ready, 0);
+		if(rc < 0) break;
+		rc = uv_thread_create(loop->thread, loop_thread, loop);
+		if(rc < 0) {
+			uv_sem_destroy(loop->ready);
+			break;
+		}
+		server->running++;
+		async_pool_enter(NULL);
+		uv_sem_wait(loop->ready);
+		async_pool_leave(NULL);
+		uv_sem_destroy(loop->ready);
+		rc = loop->status;
 	}
-	rc = uv_listen((uv_stream_t *)server->socket, 511, connection_cb);
+
+	uv_freeaddrinfo(server->info); server->info = NULL;
 	if(rc < 0) {
 		HTTPServerClose(server);
 		return rc;
@@ -71,8 +202,16 @@ int HTTPServerListen(HTTPServerRef const server, strarg_t const address, strarg_
 }
 void HTTPServerClose(HTTPServerRef const server) {
 	if(!server) return;
-	if(!server->socket->data) return;
-	async_close((uv_handle_t *)server->socket);
+	if(!server->listening) return;
+	for(unsigned i = 0; i < server->running; i++) {
+		HTTPServerLoop *const loop = &server->loops[i];
+		if(loop->stop->data) uv_async_send(loop->stop);
+	}
+	for(unsigned i = 0; i < server->nsockets; i++) {
+		async_close((uv_handle_t *)&server->sockets[i]);
+	}
+	server->nsockets = 0;
+	server->listening = false;
 }
 
 static void connection(uv_stream_t *const socket) {
@@ -95,4 +234,3 @@ static void connection(uv_stream_t *const socket) {
 static void connection_cb(uv_stream_t *const socket, int const status) {
 	async_spawn(STACK_DEFAULT, (void (*)())connection, socket);
 }
-
@@ -14,6 +14,7 @@ typedef void (*HTTPListener)(void *const context, HTTPConnectionRef const conn);
 
 HTTPServerRef HTTPServerCreate(HTTPListener const listener, void *const context);
 void HTTPServerFree(HTTPServerRef *const serverptr);
+int HTTPServerSetLoopCount(HTTPServerRef const server, unsigned const count); // Must be called before listening
 int HTTPServerListen(HTTPServerRef const server, strarg_t const address, strarg_t const port);
 void HTTPServerClose(HTTPServerRef const server);
 
@@ -0,0 +1,326 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h> /* basename(3) */
+#include <limits.h>
+#include <sys/stat.h>
+#include "../util/raiserlimit.h"
+#include "../StrongLink.h"
+
+// Offline bulk import. Files are streamed straight into the repo instead
+// of going through HTTP, their data is synced and linked a batch at a
+// time, and each batch is indexed in a single transaction.
+// The repo shouldn't be in use by a server at the same time.
+
+#define IMPORT_READERS 16 // Files being read and hashed at once
+#define IMPORT_BATCH 1024 // Files per transaction (each holds a descriptor)
+#define READ_BUF_SIZE (1024 * 64)
+#define TAR_BLOCK 512
+
+static strarg_t path = NULL;
+static strarg_t src = NULL;
+static SLNRepoRef repo = NULL;
+static SLNSessionRef session = NULL;
+static int status = 0;
+static uint64_t imported = 0;
+
+static SLNSubmissionRef batch[IMPORT_BATCH] = {};
+static size_t batched = 0;
+static async_sem_t readers[1];
+
+static struct {
+	strarg_t ext;
+	strarg_t type;
+} const types[] = {
+	// Meta-files are recognized by extension, since there's no way to
+	// tell them apart from plain JSON otherwise.
+	{ ".sln-meta", SLN_META_TYPE },
+	{ ".txt", "text/plain; charset=utf-8" },
+	{ ".md", "text/markdown; charset=utf-8" },
+	{ ".markdown", "text/markdown; charset=utf-8" },
+	{ ".html", "text/html; charset=utf-8" },
+	{ ".htm", "text/html; charset=utf-8" },
+	{ ".css", "text/css; charset=utf-8" },
+	{ ".js", "text/javascript; charset=utf-8" },
+	{ ".json", "application/json" },
+	{ ".pdf", "application/pdf" },
+	{ ".png", "image/png" },
+	{ ".jpg", "image/jpeg" },
+	{ ".jpeg", "image/jpeg" },
+	{ ".gif", "image/gif" },
+};
+static strarg_t exttype(strarg_t const name) {
+	strarg_t const ext = strrchr(name, '.');
+	if(ext) for(size_t i = 0; i < numberof(types); i++) {
+		if(0 == strcasecmp(ext, types[i].ext)) return types[i].type;
+	}
+	return "application/octet-stream";
+}
+
+static int flush(SLNSubmissionRef *const list, size_t const count) {
+	// One fdatasync per file (issued concurrently) and one sync per data
+	// directory, then everything is indexed in a single commit.
+	int rc = SLNSubmissionSyncBatch(list, count);
+	if(rc >= 0) rc = SLNSubmissionStoreBatch(list, count);
+	if(rc >= 0) imported += count;
+	for(size_t i = 0; i < count; i++) SLNSubmissionFree(&list[i]);
+	if(rc >= 0) fprintf(stderr, "Imported %llu files\n", (unsigned long long)imported);
+	return rc;
+}
+static int enqueue(SLNSubmissionRef *const subptr) {
+	batch[batched++] = *subptr; *subptr = NULL;
+	if(batched < IMPORT_BATCH) return 0;
+
+	// Take the whole batch so that other readers can keep going while
+	// we wait on the disk.
+	SLNSubmissionRef *list = malloc(sizeof(batch));
+	if(!list) return UV_ENOMEM;
+	memcpy(list, batch, sizeof(batch));
+	memset(batch, 0, sizeof(batch));
+	batched = 0;
+	int rc = flush(list, IMPORT_BATCH);
+	FREE(&list);
+	return rc;
+}
+
+// Reads `size` bytes, or until EOF if size is negative.
+static int import_stream(uv_file const file, strarg_t const name, int64_t const size) {
+	SLNSubmissionRef sub = NULL;
+	byte_t *buf = NULL;
+	int rc = SLNSubmissionCreate(session, NULL, exttype(name), &sub);
+	if(rc < 0) goto cleanup;
+	buf = malloc(READ_BUF_SIZE);
+	if(!buf) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	int64_t remaining = size;
+	while(remaining) {
+		size_t const max = remaining < 0 ? READ_BUF_SIZE : MIN(remaining, READ_BUF_SIZE);
+		uv_buf_t const part = uv_buf_init((char *)buf, max);
+		ssize_t const len = async_fs_readall_simple(file, &part);
+		if(len < 0) rc = len;
+		if(rc < 0) goto cleanup;
+		if(0 == len && remaining > 0) rc = UV_EOF;
+		if(rc < 0) goto cleanup;
+		if(0 == len) break;
+		rc = SLNSubmissionWrite(sub, buf, len);
+		if(rc < 0) goto cleanup;
+		if(remaining > 0) remaining -= len;
+	}
+
+	rc = SLNSubmissionEndNoSync(sub);
+	if(rc < 0) goto cleanup;
+	rc = enqueue(&sub);
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Import error for %s: %s\n", name, sln_strerror(rc));
+	FREE(&buf);
+	SLNSubmissionFree(&sub);
+	return rc;
+}
+
+static void import_file(str_t *filepath) {
+	uv_file const file = async_fs_open(filepath, O_RDONLY, 0000);
+	int rc = file;
+	if(rc >= 0) {
+		rc = import_stream(file, filepath, -1);
+		async_fs_close(file);
+	} else {
+		fprintf(stderr, "Couldn't open %s: %s\n", filepath, sln_strerror(rc));
+	}
+	if(rc < 0 && status >= 0) status = rc;
+	FREE(&filepath);
+	async_sem_post(readers);
+}
+enum {
+	ENTRY_FILE = 0,
+	ENTRY_DIR,
+	ENTRY_SKIP,
+};
+static int import_dir(strarg_t const dir) {
+	struct dirent **list = NULL;
+	unsigned char *kind = NULL;
+	int count;
+
+	async_pool_enter(NULL);
+	count = scandir(dir, &list, NULL, alphasort);
+	int rc = count < 0 ? -errno : 0;
+	if(count > 0) kind = calloc(count, sizeof(*kind));
+	for(int i = 0; i < count && kind; i++) {
+		str_t *x = aasprintf("%s/%s", dir, list[i]->d_name);
+		struct stat info[1];
+		// Symlinks to directories aren't followed, since one pointing
+		// at an ancestor would make us recurse forever.
+		if(x && 0 == lstat(x, info)) {
+			if(S_ISDIR(info->st_mode)) kind[i] = ENTRY_DIR;
+			else if(S_ISLNK(info->st_mode) && (0 != stat(x, info) || S_ISDIR(info->st_mode))) kind[i] = ENTRY_SKIP;
+		}
+		FREE(&x);
+	}
+	async_pool_leave(NULL);
+
+	if(count > 0 && !kind) rc = UV_ENOMEM;
+	for(int i = 0; i < count && rc >= 0 && status >= 0; i++) {
+		strarg_t const name = list[i]->d_name;
+		if('.' == name[0]) continue; // Also skips "." and ".."
+		if(ENTRY_SKIP == kind[i]) {
+			fprintf(stderr, "Skipping symlink %s/%s\n", dir, name);
+			continue;
+		}
+		str_t *x = aasprintf("%s/%s", dir, name);
+		if(!x) rc = UV_ENOMEM;
+		if(rc < 0) break;
+		if(ENTRY_DIR == kind[i]) {
+			rc = import_dir(x);
+			FREE(&x);
+			continue;
+		}
+		async_sem_wait(readers);
+		rc = async_spawn(STACK_DEFAULT, (void (*)())import_file, x);
+		if(rc < 0) {
+			FREE(&x);
+			async_sem_post(readers);
+		}
+	}
+
+	for(int i = 0; i < count; i++) free(list[i]);
+	free(list); list = NULL;
+	FREE(&kind);
+	return rc;
+}
+
+// Minimal ustar reader: regular files only, plus GNU long names.
+static ssize_t read_block(byte_t block[TAR_BLOCK]) {
+	uv_buf_t const buf = uv_buf_init((char *)block, TAR_BLOCK);
+	ssize_t const len = async_fs_readall_simple(0, &buf);
+	if(len < 0) return len;
+	if(0 == len) return 0;
+	if(len < TAR_BLOCK) return UV_EOF;
+	return len;
+}
+static int skip(uint64_t const size) {
+	byte_t block[TAR_BLOCK];
+	for(uint64_t i = 0; i < size; i += TAR_BLOCK) {
+		ssize_t const rc = read_block(block);
+		if(0 == rc) return UV_EOF;
+		if(rc < 0) return rc;
+	}
+	return 0;
+}
+static int import_tar(void) {
+	byte_t block[TAR_BLOCK];
+	str_t longname[PATH_MAX] = "";
+	int rc = 0;
+	for(;;) {
+		ssize_t const len = read_block(block);
+		if(len < 0) return len;
+		if(0 == len) return 0;
+		if('\0' == block[0]) return 0; // End of archive
+
+		str_t sizestr[13] = {};
+		memcpy(sizestr, block+124, 12);
+		uint64_t const size = strtoull(sizestr, NULL, 8);
+		uint64_t const padded = (size + TAR_BLOCK-1) / TAR_BLOCK * TAR_BLOCK;
+		char const typeflag = block[156];
+
+		if('L' == typeflag) {
+			if(size >= sizeof(longname)) return UV_ENAMETOOLONG;
+			uv_buf_t const buf = uv_buf_init(longname, padded);
+			ssize_t const x = async_fs_readall_simple(0, &buf);
+			if(x < 0) return x;
+			if(x < padded) return UV_EOF;
+			longname[size] = '\0';
+			continue;
+		}
+
+		str_t name[PATH_MAX];
+		if(longname[0]) {
+			memcpy(name, longname, sizeof(name));
+			longname[0] = '\0';
+		} else {
+			str_t prefix[156] = {}, base[101] = {};
+			memcpy(prefix, block+345, 155);
+			memcpy(base, block+0, 100);
+			snprintf(name, sizeof(name), "%s%s%s", prefix, prefix[0] ? "/" : "", base);
+		}
+
+		if(('0' != typeflag && '\0' != typeflag) || !size) {
+			rc = skip(padded);
+			if(rc < 0) return rc;
+			continue;
+		}
+		rc = import_stream(0, name, size);
+		if(rc < 0) return rc;
+		rc = skip(padded - size);
+		if(rc < 0) return rc;
+	}
+}
+
+static void init(void *const unused) {
+	async_random((byte_t *)&SLNSeed, sizeof(SLNSeed));
+	async_sem_init(readers, IMPORT_READERS, 0);
+
+	str_t *tmp = strdup(path);
+	strarg_t const reponame = basename(tmp); // TODO
+	repo = SLNRepoCreate(path, reponame, getenv(SLN_HASH_ALGOS_ENV));
+	FREE(&tmp);
+	if(!repo) {
+		fprintf(stderr, "Repository could not be opened\n");
+		status = UV_EINVAL;
+		return;
+	}
+	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(repo);
+	session = SLNSessionCreateInternal(cache, 0, NULL, NULL, 0, SLN_ROOT, NULL);
+	if(!session) {
+		status = UV_ENOMEM;
+		return;
+	}
+
+	int rc = 0 == strcmp(src, "-") ? import_tar() : import_dir(src);
+	for(size_t i = 0; i < IMPORT_READERS; i++) async_sem_wait(readers);
+	if(rc >= 0 && status >= 0) rc = flush(batch, batched);
+	batched = 0;
+	if(rc < 0 && status >= 0) status = rc;
+	if(status < 0) {
+		fprintf(stderr, "Import failed: %s\n", sln_strerror(status));
+	} else {
+		fprintf(stderr, "Import finished (%llu files)\n", (unsigned long long)imported);
+	}
+}
+static void cleanup(void *const unused) {
+	for(size_t i = 0; i < batched; i++) SLNSubmissionFree(&batch[i]);
+	batched = 0;
+	SLNSessionRelease(&session);
+	SLNRepoFree(&repo);
+	async_sem_destroy(readers);
+
+	async_pool_destroy_shared();
+}
+
+int main(int const argc, char const *const *const argv) {
+	if(!getenv("UV_THREADPOOL_SIZE")) putenv((char *)"UV_THREADPOOL_SIZE=4");
+
+	raiserlimit();
+	async_init();
+
+	// TODO: Real option parsing.
+	if(3 != argc || '-' == argv[1][0]) {
+		fprintf(stderr, "Usage:\n\t" "%s <repo> <dir>\n\t" "%s <repo> - < archive.tar\n", argv[0], argv[0]);
+		return 1;
+	}
+	path = argv[1];
+	src = argv[2];
+
+	async_spawn(STACK_DEFAULT, init, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+
+	async_spawn(STACK_DEFAULT, cleanup, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+
+	async_destroy();
+
+	return status < 0 ? 1 : 0;
+}